@@ -0,0 +1,540 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define BENCH_QUERIES 200000
+#define BENCH_WINDOW 256
+#define REFLECT_BATCH 64
+#define REFLECT_RCVBUF (8 << 20)  // so the reflectors don't drop queries
+#define MAX_THREADS 64
+#define E2E_QUERIES 20000
+#define MICRO_ITERS 1000000
+#define CACHE_NAMES 100000
+#define CACHE_MB 64
+
+static volatile bool stop;
+static int completed, failed;
+static char server_addr[MAX_ADDR_LEN];  // of the reflectors, or dnsfake
+static long long *started, *latency;    // per query of the end to end runs
+static volatile unsigned long sink;     // keeps the results of the micro runs
+
+// Answer every query received on the socket with the query itself, flagged as
+// a response, so the benchmark only measures the client
+static void *reflector(void *arg) {
+  int sock = *(int *) arg;
+  char (*bufs)[MAX_MSG_LEN] = malloc(REFLECT_BATCH * MAX_MSG_LEN);
+  struct mmsghdr msgs[REFLECT_BATCH];
+  struct iovec iov[REFLECT_BATCH];
+  struct sockaddr_in addrs[REFLECT_BATCH];
+
+  memset(msgs, 0, sizeof(msgs));
+  for (int i = 0; i < REFLECT_BATCH; i++) {
+    iov[i].iov_base = bufs[i];
+    msgs[i].msg_hdr.msg_name = &addrs[i];
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  while (!stop) {
+    for (int i = 0; i < REFLECT_BATCH; i++) {
+      iov[i].iov_len = MAX_MSG_LEN;
+      msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+    int n = recvmmsg(sock, msgs, REFLECT_BATCH, MSG_WAITFORONE, NULL);
+    if (n <= 0)
+      continue;  // timed out, check whether to stop
+
+    for (int i = 0; i < n; i++) {
+      bufs[i][2] |= (char) 0x80;  // QR
+      iov[i].iov_len = msgs[i].msg_len;
+    }
+    for (int done = 0, r; done < n; done += r > 0 ? r : 1)
+      r = sendmmsg(sock, msgs + done, n - done, 0);
+  }
+  free(bufs);
+  return NULL;
+}
+
+// Count finished queries, from any thread
+static void bench_done(dns_resolver_t *res, dns_query_t *query,
+                       enum error_status status, dns_msg_t *ans) {
+  __atomic_fetch_add(&completed, 1, __ATOMIC_RELAXED);
+  if (status != NOERROR)
+    __atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+}
+
+// Resolve count queries through the reflectors, batch datagrams per system
+// call, and print the rate
+static void run_batch(int batch, int count) {
+  dns_server_t server = {"", 0, 0, MAX_RTO_USEC};
+  dns_options_t opts = {.hedge = -1, .edns = EDNS_PAYLOAD, .batch = batch};
+  dns_resolver_t res;
+  char name[MAX_NAME_LEN];
+
+  strcpy(server.addr, server_addr);
+  if (!resolver_init(&res, &server, 1, BENCH_WINDOW)
+      || !resolver_set_options(&res, &opts))
+    error("ERROR setting up the resolver!\n");
+
+  completed = failed = 0;
+  int submitted = 0;
+  long long start = now_usec();
+  while (completed < count) {
+    while (submitted < count && res.active < res.window) {
+      snprintf(name, MAX_NAME_LEN, "host%d.bench", submitted++);
+      resolver_submit(&res, name, A, bench_done, NULL);
+    }
+    resolver_process(&res, -1);
+  }
+  double secs = (now_usec() - start) / 1e6;
+  resolver_free(&res);
+
+  printf("batch %4d: %d queries in %.3f s, %.0f queries/s, %d failed\n",
+         batch, count, secs, count / secs, failed);
+}
+
+// Resolve count queries through the reflectors with a pool of threads, and
+// print the rate
+static void run_threads(int threads, int count) {
+  dns_server_t server = {"", 0, 0, MAX_RTO_USEC};
+  dns_options_t opts = {.window = BENCH_WINDOW, .hedge = -1,
+                        .edns = EDNS_PAYLOAD, .batch = BATCH_SIZE,
+                        .threads = threads};
+  dns_pool_t pool;
+  char name[MAX_NAME_LEN];
+
+  strcpy(server.addr, server_addr);
+  completed = failed = 0;
+  long long start = now_usec();
+  if (!pool_start(&pool, &server, 1, &opts, bench_done))
+    error("ERROR starting the worker threads!\n");
+  for (int i = 0; i < count; i++) {
+    snprintf(name, MAX_NAME_LEN, "host%d.bench", i);
+    pool_submit(&pool, name, A);
+  }
+  pool_finish(&pool);
+  double secs = (now_usec() - start) / 1e6;
+
+  printf("threads %3d: %d queries in %.3f s, %.0f queries/s, %d failed\n",
+         threads, count, secs, count / secs, failed);
+}
+
+// Open a reflector socket on port (any port if 0), sharing it with the other
+// reflectors. Return the socket
+static int open_reflector(unsigned short *port) {
+  int sock = socket(PF_INET, SOCK_DGRAM, 0), one = 1;
+  struct sockaddr_in addr = {.sin_family = AF_INET};
+  socklen_t len = sizeof(addr);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(*port);
+  struct timeval timeout = {0, 100000};
+  int rcvbuf = REFLECT_RCVBUF;
+
+  if (sock < 0
+      || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0
+      || bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || getsockname(sock, (struct sockaddr *) &addr, &len) < 0)
+    error("ERROR opening a reflector socket!\n");
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  if (setsockopt(sock, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)))
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  *port = ntohs(addr.sin_port);
+  return sock;
+}
+
+// Record the latency of a query of an end to end run, and print its answer
+// like the client does (to /dev/null)
+static void e2e_done(dns_resolver_t *res, dns_query_t *query,
+                     enum error_status status, dns_msg_t *ans) {
+  long i = (long) query->data;
+  latency[i] = now_usec() - started[i];
+  completed++;
+  if (status != NOERROR) {
+    failed++;
+    return;
+  }
+  print_answer(ans, resolver_server_name(res, query));
+}
+
+// Compare two latencies, for qsort
+static int cmp_latency(const void *a, const void *b) {
+  long long x = *(long long *) a, y = *(long long *) b;
+  return x < y ? -1 : x > y;
+}
+
+// Print the rate and latency percentiles of an end to end run
+static void print_latency(char *path, int count, double secs) {
+  qsort(latency, count, sizeof(long long), cmp_latency);
+  printf("%-6s: %d queries in %.3f s, %.0f queries/s, p50 %lld us, "
+         "p99 %lld us, p999 %lld us, %d failed\n", path, count, secs,
+         count / secs, latency[count / 2], latency[count * 99 / 100],
+         latency[count * 999 / 1000], failed);
+}
+
+// Name and type of the i-th query of an end to end run, going through every
+// type the client prints
+static enum query_type e2e_query(int i, char *name) {
+  enum query_type types[] = {A, NS, CNAME, MX, SOA, TXT, PTR};
+  enum query_type qtype = types[i % (sizeof(types) / sizeof(types[0]))];
+  if (qtype == PTR)
+    snprintf(name, MAX_NAME_LEN, "%d.%d.0.10.in-addr.arpa", i & 255,
+             (i >> 8) & 255);
+  else
+    snprintf(name, MAX_NAME_LEN, "host%d.bench", i);
+  return qtype;
+}
+
+// Resolve count queries the way a single query run of the client does, each
+// with a resolver of its own, then count queries the way the bulk mode does,
+// and print their rates and latencies
+static void run_e2e(int count) {
+  dns_server_t server = {"", 0, 0, MAX_RTO_USEC};
+  dns_options_t opts = {.hedge = -1, .edns = EDNS_PAYLOAD, .batch = 1};
+  dns_resolver_t res;
+  char name[MAX_NAME_LEN];
+
+  strcpy(server.addr, server_addr);
+  started = malloc(count * sizeof(long long));
+  latency = malloc(count * sizeof(long long));
+  FILE *devnull = fopen("/dev/null", "w");
+  if (started == NULL || latency == NULL || devnull == NULL)
+    error("ERROR allocating the latencies!\n");
+  print_set_output(devnull);
+
+  completed = failed = 0;
+  long long start = now_usec();
+  for (int i = 0; i < count; i++) {
+    started[i] = now_usec();
+    if (!resolver_init(&res, &server, 1, 1)
+        || !resolver_set_options(&res, &opts))
+      error("ERROR setting up the resolver!\n");
+    enum query_type qtype = e2e_query(i, name);
+    resolver_submit(&res, name, qtype, e2e_done, (void *) (long) i);
+    while (res.active)
+      resolver_process(&res, -1);
+    resolver_free(&res);
+  }
+  print_latency("single", count, (now_usec() - start) / 1e6);
+
+  opts.batch = BATCH_SIZE;
+  if (!resolver_init(&res, &server, 1, BULK_WINDOW)
+      || !resolver_set_options(&res, &opts))
+    error("ERROR setting up the resolver!\n");
+  completed = failed = 0;
+  int submitted = 0;
+  start = now_usec();
+  while (completed < count) {
+    while (submitted < count && res.active < res.window) {
+      enum query_type qtype = e2e_query(submitted, name);
+      started[submitted] = now_usec();
+      resolver_submit(&res, name, qtype, e2e_done, (void *) (long) submitted);
+      submitted++;
+    }
+    resolver_process(&res, -1);
+  }
+  print_latency("bulk", count, (now_usec() - start) / 1e6);
+  resolver_free(&res);
+
+  print_set_output(NULL);
+  fclose(devnull);
+  free(started);
+  free(latency);
+}
+
+// Build an MX answer for www.example.com into buf, with the names compressed
+// the way servers do: 4 MX records, 2 NS records and their addresses. Return
+// its length
+static size_t make_answer(char *buf) {
+  size_t len = build_query(buf, "www.example.com", MX, 1, 0);
+  char *p = buf + len;
+  int rrs[3] = {4, 2, 2};
+
+  buf[2] |= (char) 0x80;  // QR
+  for (int section = 0; section < 3; section++) {
+    put16(buf + 6 + 2 * section, (unsigned short) rrs[section]);
+    for (int i = 0; i < rrs[section]; i++) {
+      char rdata[16];
+      size_t rdlen;
+      if (section == 0) {
+        memcpy(p, "\xC0\x0C", 2);  // www.example.com
+        p += 2;
+        put16(rdata, (unsigned short) (10 * (i + 1)));
+        rdlen = 2 + snprintf(rdata + 2, 5, "\3mx%d", i) + 2;
+        put16(rdata + rdlen - 2, 0xC010);  // example.com
+      } else if (section == 1) {
+        memcpy(p, "\xC0\x10", 2);
+        p += 2;
+        rdlen = snprintf(rdata, 5, "\3ns%d", i) + 2;
+        put16(rdata + rdlen - 2, 0xC010);
+      } else {
+        p += snprintf(p, 5, "\3ns%d", i);
+        put16(p, 0xC010);
+        p += 2;
+        rdlen = 4;
+        put32(rdata, 0x0A000001 + i);
+      }
+      put16(p, section == 0 ? MX : section == 1 ? NS : A);
+      put16(p + 2, 1);
+      put32(p + 4, 3600);
+      put16(p + 8, (unsigned short) rdlen);
+      memcpy(p + 10, rdata, rdlen);
+      p += 10 + rdlen;
+    }
+  }
+  return p - buf;
+}
+
+// Print the time per operation of a micro run of MICRO_ITERS operations
+static void print_micro(char *what, long long start, int per_op, char *unit) {
+  double ns = (now_usec() - start) * 1000.0 / MICRO_ITERS;
+  printf("%-24s %8.1f ns/op", what, ns);
+  if (per_op > 1)
+    printf(", %.1f ns/%s", ns / per_op, unit);
+  printf("\n");
+}
+
+// Time the hot spots of the client: parsing an answer, decoding its
+// (compressed) names, and encoding a query, the way build_query does and from
+// the template of its type the way the resolver does, then looking up types
+// by name and formatting the rdata of the answer
+static void run_micro() {
+  static dns_msg_t msg;
+  char buf[BUFLEN], query[BUFLEN], name[MAX_NAME_LEN];
+  size_t len = make_answer(buf);
+  int names = 0;
+
+  long long start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++) {
+    parse_msg(&msg, buf, len);
+    sink += msg.nrecords;
+  }
+  print_micro("parse_msg", start, msg.nrecords, "record");
+
+  // Every owner name and the names in the rdata, memoized per message
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++) {
+    parse_msg(&msg, buf, len);
+    names = 0;
+    for (int j = 0; j < msg.nrecords; j++) {
+      dns_record_t *rr = &msg.records[j];
+      sink += msg_name(&msg, rr->name, name);
+      if (rr->type == NS || rr->type == MX)
+        sink += msg_name(&msg, rr->rdata + (rr->type == MX ? 2 : 0), name);
+      names += 1 + (rr->type == NS || rr->type == MX);
+    }
+  }
+  print_micro("parse_msg + msg_name", start, names, "name");
+
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++) {
+    char *qname = toQNAME("www.example.com");
+    sink += qname[0];
+    free(qname);
+  }
+  print_micro("toQNAME", start, 1, NULL);
+
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++)
+    sink += build_query(buf, "www.example.com", A, (unsigned short) i,
+                        EDNS_PAYLOAD);
+  print_micro("build_query", start, 1, NULL);
+
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++)
+    sink += encode_name(buf, "www.example.com");
+  print_micro("encode_name", start, 1, NULL);
+
+  // Both encoders must agree on every byte
+  dns_template_t t;
+  query_template(&t, A, EDNS_PAYLOAD, true);
+  len = template_query(&t, query, "www.example.com", 1);
+  if (len != build_query(buf, "www.example.com", A, 1, EDNS_PAYLOAD)
+      || memcmp(query, buf, len) != 0)
+    error("template_query and build_query disagree\n");
+
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++)
+    sink += template_query(&t, buf, "www.example.com", (unsigned short) i);
+  print_micro("template_query", start, 1, NULL);
+
+  // get_query_type upper cases the names in place
+  char types[][MAX_QUERY_LEN] = {"A", "MX", "TXT", "PTR", "AAAA", "CAA",
+                                 "TYPE99"};
+  int ntypes = sizeof(types) / sizeof(types[0]);
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++)
+    sink += get_query_type(types[i % ntypes]);
+  print_micro("get_query_type", start, 1, NULL);
+
+  len = make_answer(buf);
+  parse_msg(&msg, buf, len);
+  start = now_usec();
+  for (int i = 0; i < MICRO_ITERS; i++) {
+    for (int j = 0; j < msg.nrecords; j++) {
+      format_rdata(&msg, &msg.records[j], query, sizeof(query));
+      sink += query[0];
+    }
+  }
+  print_micro("format_rdata", start, msg.nrecords, "record");
+}
+
+/* Reader of the cache benchmark */
+typedef struct {
+  dns_cache_t *cache;
+  int names;
+  unsigned int seed;
+  int hits;
+} cache_reader_t;
+
+// Look up MICRO_ITERS random names of the cache, counting the hits
+static void *cache_reader(void *arg) {
+  cache_reader_t *r = arg;
+  dns_msg_t *msg = malloc(sizeof(dns_msg_t));
+  char buf[MAX_MSG_LEN], name[MAX_NAME_LEN];
+
+  for (int i = 0; msg && i < MICRO_ITERS; i++) {
+    snprintf(name, MAX_NAME_LEN, "host%d.bench",
+             (int) (rand_r(&r->seed) % r->names));
+    r->hits += cache_lookup(r->cache, name, MX, buf, msg, NULL);
+  }
+  free(msg);
+  return NULL;
+}
+
+// Store the answers of the cache benchmark under new names until stopped
+static void *cache_writer(void *arg) {
+  dns_cache_t *cache = arg;
+  static dns_msg_t msg;
+  char buf[BUFLEN], name[MAX_NAME_LEN];
+  parse_msg(&msg, buf, make_answer(buf));
+
+  for (int i = 0; !stop; i++) {
+    snprintf(name, MAX_NAME_LEN, "new%d.bench", i);
+    cache_store(cache, name, MX, &msg);
+  }
+  return NULL;
+}
+
+// Look up answers in the in-memory cache from 1 to max_threads threads at
+// once, its names stored in advance, then with a thread storing new answers
+// meanwhile, and print the rates
+static void run_cache(int names, int max_threads) {
+  static dns_msg_t msg;
+  char buf[BUFLEN], name[MAX_NAME_LEN];
+  dns_cache_t cache = {.mem = memcache_create((size_t) CACHE_MB << 20)};
+  if (cache.mem == NULL)
+    error("ERROR allocating the cache!\n");
+
+  parse_msg(&msg, buf, make_answer(buf));
+  for (int i = 0; i < names; i++) {
+    snprintf(name, MAX_NAME_LEN, "host%d.bench", i);
+    cache_store(&cache, name, MX, &msg);
+  }
+
+  int n = 1;
+  for (bool writing = false; n <= max_threads; ) {
+    pthread_t threads[MAX_THREADS], writer;
+    cache_reader_t readers[MAX_THREADS];
+    stop = false;
+    if (writing)
+      pthread_create(&writer, NULL, cache_writer, &cache);
+
+    long long start = now_usec();
+    for (int i = 0; i < n; i++) {
+      readers[i] = (cache_reader_t) {&cache, names, (unsigned int) i + 1, 0};
+      pthread_create(&threads[i], NULL, cache_reader, &readers[i]);
+    }
+    long long hits = 0;
+    for (int i = 0; i < n; i++) {
+      pthread_join(threads[i], NULL);
+      hits += readers[i].hits;
+    }
+    double secs = (now_usec() - start) / 1e6;
+    stop = true;
+    if (writing)
+      pthread_join(writer, NULL);
+
+    double lookups = (double) n * MICRO_ITERS;
+    printf("readers %3d%s: %.0f lookups/s, %.1f ns/lookup per thread, "
+           "%.1f%% hits\n", n, writing ? " + writer" : "", lookups / secs,
+           secs * 1e9 / MICRO_ITERS, 100.0 * hits / lookups);
+    if (writing)
+      break;
+    n = n < max_threads && 2 * n > max_threads ? max_threads : 2 * n;
+    if (n > max_threads) {
+      n = max_threads;
+      writing = true;
+    }
+  }
+  fflush(stdout);
+  memcache_summary(cache.mem);
+  memcache_free(cache.mem);
+}
+
+// Compare one sendto/recvfrom per datagram with sendmmsg/recvmmsg batches
+// of several sizes, then measure how the worker pool scales from one thread
+// to one per core (or max_threads), against local reflectors on every core
+static void run_io(int count, int max_threads) {
+  int batches[] = {1, 8, 32, 128};
+  int socks[MAX_THREADS];
+  pthread_t threads[MAX_THREADS];
+  unsigned short port = 0;
+  for (int i = 0; i < max_threads; i++) {
+    socks[i] = open_reflector(&port);
+    pthread_create(&threads[i], NULL, reflector, &socks[i]);
+  }
+  snprintf(server_addr, MAX_ADDR_LEN, "127.0.0.1:%hu", port);
+
+  for (size_t i = 0; i < sizeof(batches) / sizeof(batches[0]); i++)
+    run_batch(batches[i], count);
+  for (int n = 1; n <= max_threads; n = n < max_threads && 2 * n > max_threads
+       ? max_threads : 2 * n)
+    run_threads(n, count);
+
+  stop = true;
+  for (int i = 0; i < max_threads; i++) {
+    pthread_join(threads[i], NULL);
+    close(socks[i]);
+  }
+}
+
+// Run one of the benchmarks: the micro benchmarks, the client end to end
+// against a dnsfake server, the transport against local reflectors, or the
+// in-memory cache
+int main(int argc, char *argv[]) {
+  char *mode = argc > 1 ? argv[1] : "";
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int def_threads = ncpus > MAX_THREADS ? MAX_THREADS
+                    : ncpus > 1 ? (int) ncpus : 2;
+
+  if (strcmp(mode, "micro") == 0) {
+    run_micro();
+  } else if (strcmp(mode, "e2e") == 0 && argc > 2
+             && strlen(argv[2]) < MAX_ADDR_LEN) {
+    int count = argc > 3 ? atoi(argv[3]) : E2E_QUERIES;
+    if (count <= 0)
+      error("The number of queries must be a positive number\n");
+    strcpy(server_addr, argv[2]);
+    run_e2e(count);
+  } else if (strcmp(mode, "io") == 0) {
+    int count = argc > 2 ? atoi(argv[2]) : BENCH_QUERIES;
+    int max_threads = argc > 3 ? atoi(argv[3]) : def_threads;
+    if (count <= 0 || max_threads <= 0 || max_threads > MAX_THREADS)
+      error("The queries and threads must be positive numbers\n");
+    run_io(count, max_threads);
+  } else if (strcmp(mode, "cache") == 0) {
+    int names = argc > 2 ? atoi(argv[2]) : CACHE_NAMES;
+    int max_threads = argc > 3 ? atoi(argv[3]) : def_threads;
+    if (names <= 0 || max_threads <= 0 || max_threads > MAX_THREADS)
+      error("The names and threads must be positive numbers\n");
+    run_cache(names, max_threads);
+  } else {
+    error("Usage: dnsbench micro\n"
+          "       dnsbench e2e address[:port] [queries]\n"
+          "       dnsbench io [queries] [max_threads]\n"
+          "       dnsbench cache [names] [max_threads]\n");
+  }
+  return 0;
+}
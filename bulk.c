@@ -0,0 +1,188 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+static enum output_format format;
+
+// Print the outcome of a finished bulk query
+void bulk_done(dns_resolver_t *res, dns_query_t *query,
+               enum error_status status, dns_msg_t *ans) {
+  char type[MAX_QUERY_LEN], *reason;
+
+  // Failures are part of the structured output
+  if (format == OUT_NONE)
+    return;
+  if (format == OUT_JSON) {
+    print_json(query, status, ans,
+               status == NOERROR ? resolver_server_name(res, query) : NULL);
+    return;
+  }
+  if (format == OUT_BINARY) {
+    print_binary(query, status, ans);
+    return;
+  }
+
+  if (status == NOERROR) {
+    char *server = resolver_server_name(res, query);
+    dns_header_t ans_header = print_answer(ans, server);
+    if (ans_header.rcode != 0)
+      print_header(ans_header);
+    fprintf(output(), "Received %zu bytes from %s\n\n", ans->len, server);
+    return;
+  }
+
+  switch (status) {
+    case NORESPONSE: reason = "No response from server(s)";
+      break;
+    case SENDERROR: reason = "Send failed.";
+      break;
+    case RECVERROR: reason = "Receive failed.";
+      break;
+    default: reason = "No valid servers.";
+  }
+
+  // A single call, so that lines of worker threads don't mix
+  get_qtype_string(type, query->qtype);
+  fprintf(stderr, ";; %s %s: %s\n", query->name, type, reason);
+}
+
+// Set up printing the results of many queries in the format of the options.
+// Structured output is written in large blocks
+void bulk_output(dns_options_t *opts) {
+  format = opts->format;
+  if (format != OUT_TEXT)
+    setvbuf(stdout, NULL, _IOFBF, POOL_OUT_SIZE);
+}
+
+// Read the next "name [type]" line from in into domain and query, skipping
+// comments and invalid lines. Return false at the end of the input
+static bool next_query(FILE *in, char *domain, enum query_type *query) {
+  char line[BUFLEN], type[MAX_QUERY_LEN];
+
+  while (fgets(line, BUFLEN, in)) {
+    int n = sscanf(line, "%255s %19s", domain, type);
+    if (n < 1 || domain[0] == '#')
+      continue;
+    if (n == 1)
+      strcpy(type, "A");
+
+    enum domain_type domain_t = get_domain_type(domain);
+    *query = get_query_type(type);
+
+    char *invalid = check_query(domain_t, *query);
+    if (invalid) {
+      fprintf(stderr, ";; %s %s: %s", domain, type, invalid);
+      continue;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Resolve every query read from in with a pool of worker threads, each
+// keeping its own window of queries in flight
+static void run_pool(dns_options_t *opts, FILE *in, dns_server_t *data,
+                     int conf_size) {
+  dns_pool_t pool;
+  if (!pool_start(&pool, data, conf_size, opts, bulk_done))
+    error("ERROR starting the worker threads!\n");
+
+  char domain[MAX_NAME_LEN];
+  enum query_type query;
+  long long next_stats = now_usec() + opts->stats_interval_ms * 1000LL;
+  while (next_query(in, domain, &query)) {
+    pool_submit(&pool, domain, query);
+    if (opts->stats_file && now_usec() >= next_stats) {
+      pool_write_stats(&pool, opts->stats_file);
+      next_stats = now_usec() + opts->stats_interval_ms * 1000LL;
+    }
+  }
+
+  pool_finish(&pool);
+}
+
+// Resolve every query in the bulk file (or stdin for "-"), keeping up to a
+// window of queries in flight at the same time, on opts->threads threads
+void run_bulk(dns_options_t *opts) {
+  char *file = opts->bulk_file;
+  FILE *in = strcmp(file, "-") == 0 ? stdin : fopen(file, "r");
+  if (in == NULL)
+    error("Could not open input file.\n");
+
+  bulk_output(opts);
+
+  // The servers of the conf file aren't needed to resolve from the root
+  int conf_size = 0;
+  dns_server_t *data = opts->iterative ? NULL : get_conf_data(&conf_size);
+  if (data == NULL && !opts->iterative) {
+    fprintf(stderr, "Failed to open conf file!\n");
+    exit(0);
+  }
+
+  if (opts->threads > 1) {
+    run_pool(opts, in, data, conf_size);
+    if (in != stdin)
+      fclose(in);
+    save_server_state(data, conf_size);
+    free(data);
+    return;
+  }
+
+  dns_resolver_t res;
+  dns_iter_t iter;
+  if (!resolver_init(&res, data, conf_size, opts->window))
+    error("ERROR setting up the resolver!\n");
+  resolver_set_options(&res, opts);
+  if (opts->iterative && !iter_init(&iter, &res, opts->root_hints))
+    error("ERROR loading the root hints!\n");
+
+  char domain[MAX_NAME_LEN];
+  enum query_type query;
+  bool eof = false;
+  dns_resolver_t *stats[] = {&res};
+  long long next_stats = now_usec() + opts->stats_interval_ms * 1000LL;
+  int *active = opts->iterative ? &iter.active : &res.active;
+
+  while (!eof || *active) {
+    // Keep the window full, with one query per lookup in iterative mode
+    while (!eof && *active < res.window) {
+      if (!next_query(in, domain, &query))
+        eof = true;
+      else if (opts->iterative)
+        iter_submit(&iter, domain, query, bulk_done, NULL);
+      else
+        resolver_submit(&res, domain, query, bulk_done, NULL);
+    }
+
+    // Without waiting past the next stats write
+    int timeout = -1;
+    if (opts->stats_file) {
+      long long now = now_usec();
+      if (now >= next_stats) {
+        stats_write(opts->stats_file, stats, 1);
+        next_stats = now + opts->stats_interval_ms * 1000LL;
+      }
+      timeout = (int) ((next_stats - now + 999) / 1000);
+    }
+
+    if (opts->iterative && iter.active)
+      iter_process(&iter, timeout);
+    else if (!opts->iterative && res.active)
+      resolver_process(&res, timeout);
+  }
+
+  if (opts->stats_file)
+    stats_write(opts->stats_file, stats, 1);
+  if (opts->iterative) {
+    iter_summary(&iter);
+    iter_free(&iter);
+  }
+  resolver_free(&res);
+  if (in != stdin)
+    fclose(in);
+  if (data)
+    save_server_state(data, conf_size);
+  free(data);
+}
@@ -0,0 +1,320 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define CACHE_MAGIC 0x444e5343  // "DNSC"
+#define MAX_READ_RETRIES 100
+
+// Copy name into key in lowercase, without the trailing dot
+static void cache_key(char *key, char *name) {
+  int i;
+  for (i = 0; name[i] && i < MAX_NAME_LEN - 1; i++)
+    key[i] = (char) tolower(name[i]);
+  if (i && key[i - 1] == '.')
+    i--;
+  key[i] = 0;
+}
+
+// FNV-1a hash of a key, never 0 (which marks empty slots)
+static unsigned int cache_hash(char *key, unsigned short qtype) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; key[i]; i++)
+    hash = (hash ^ (unsigned char) key[i]) * 16777619u;
+  hash = (hash ^ qtype) * 16777619u;
+  return hash ? hash : 1;
+}
+
+// Go through the resource records of the parsed message, computing the
+// smallest TTL of all of them in min_ttl, and the negative caching TTL (the
+// smallest of the SOA TTL and minimum, RFC 2308) in neg_ttl if there is an SOA
+// in the authority section. If age is positive, it is subtracted from every
+// TTL in the message buffer
+static void walk_ttls(dns_msg_t *msg, long long age, unsigned int *min_ttl,
+                      unsigned int *neg_ttl) {
+  *min_ttl = UINT32_MAX;
+  *neg_ttl = 0;
+
+  for (int i = msg->header.qdcount; i < msg->nrecords; i++) {
+    dns_record_t *rr = &msg->records[i];
+    if (rr->type == OPT)
+      continue;  // its TTL field holds the EDNS flags
+
+    unsigned int ttl = rr->ttl;
+    if (age > 0) {
+      ttl = age < ttl ? ttl - (unsigned int) age : 0;
+      unsigned int net_ttl = htonl(ttl);
+      memcpy(msg->buf + rr->rdata - 6, &net_ttl, 4);  // TTL, then RDLENGTH
+      rr->ttl = ttl;
+    }
+    if (ttl < *min_ttl)
+      *min_ttl = ttl;
+
+    if (rr->section == AUTHORITY && rr->type == SOA) {
+      // MNAME and RNAME, followed by serial, refresh, retry, expire, minimum
+      int end = rr->rdata + rr->rdlength;
+      int soa = skip_name(msg->buf, end, rr->rdata);
+      soa = soa < 0 ? -1 : skip_name(msg->buf, end, soa);
+      if (soa >= 0 && soa + 20 <= end) {
+        unsigned int minimum = get32(msg->buf + soa + 16);
+        *neg_ttl = minimum < ttl ? minimum : ttl;
+      }
+    }
+  }
+}
+
+// Set every TTL of the parsed message (but the EDNS flags of its OPT record)
+// to ttl, in the message buffer too
+static void set_ttls(dns_msg_t *msg, unsigned int ttl) {
+  unsigned int net_ttl = htonl(ttl);
+  for (int i = msg->header.qdcount; i < msg->nrecords; i++) {
+    dns_record_t *rr = &msg->records[i];
+    if (rr->type != OPT) {
+      memcpy(msg->buf + rr->rdata - 6, &net_ttl, 4);
+      rr->ttl = ttl;
+    }
+  }
+}
+
+// Read the entry into msg if it holds the key and expires after valid_after.
+// Return false on a miss, or if the entry keeps changing under the reader
+static bool read_entry(dns_cache_entry_t *entry, char *key, unsigned int hash,
+                       unsigned short qtype, long long valid_after, char *msg,
+                       size_t *len, long long *stored, long long *expires) {
+  for (int retry = 0; retry < MAX_READ_RETRIES; retry++) {
+    unsigned int seq = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;  // being written
+
+    bool hit = entry->hash == hash && entry->qtype == qtype
+        && entry->expires > valid_after && entry->len <= EDNS_PAYLOAD
+        && strncmp(entry->name, key, MAX_NAME_LEN) == 0;
+    if (hit) {
+      *len = entry->len;
+      *stored = entry->stored;
+      *expires = entry->expires;
+      memcpy(msg, entry->msg, *len);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) == seq)
+      return hit;
+  }
+  return false;
+}
+
+// Open (creating it if needed) and map the CACHE_FILE. Return false if the
+// cache can't be used
+bool cache_open(dns_cache_t *cache) {
+  cache->size = sizeof(dns_cache_header_t)
+      + CACHE_SLOTS * sizeof(dns_cache_entry_t);
+  cache->fd = open(CACHE_FILE, O_RDWR | O_CREAT, 0644);
+  if (cache->fd < 0)
+    return false;
+
+  // Set up the file under the lock, so concurrent runs agree on its layout
+  flock(cache->fd, LOCK_EX);
+
+  struct stat st;
+  dns_cache_header_t header;
+  bool valid = fstat(cache->fd, &st) == 0 && (size_t) st.st_size == cache->size
+      && pread(cache->fd, &header, sizeof(header), 0) == sizeof(header)
+      && header.magic == CACHE_MAGIC && header.nslots == CACHE_SLOTS
+      && header.entry_size == sizeof(dns_cache_entry_t);
+
+  if (!valid) {
+    memset(&header, 0, sizeof(header));
+    header.magic = CACHE_MAGIC;
+    header.nslots = CACHE_SLOTS;
+    header.entry_size = sizeof(dns_cache_entry_t);
+    valid = ftruncate(cache->fd, 0) == 0
+        && ftruncate(cache->fd, (off_t) cache->size) == 0
+        && pwrite(cache->fd, &header, sizeof(header), 0) == sizeof(header);
+  }
+
+  flock(cache->fd, LOCK_UN);
+
+  if (valid) {
+    cache->header = mmap(NULL, cache->size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED, cache->fd, 0);
+    valid = cache->header != MAP_FAILED;
+  }
+  if (!valid) {
+    close(cache->fd);
+    return false;
+  }
+
+  cache->entries = (dns_cache_entry_t *) (cache->header + 1);
+  return true;
+}
+
+// Claim the refresh of an answer, refreshing being the time its last one was
+// started at, unless that was less than TIMEOUT_SEC ago (by any process or
+// thread), since it may still get the new answer
+static bool claim_refresh(long long *refreshing, long long now) {
+  long long started = __atomic_load_n(refreshing, __ATOMIC_RELAXED);
+  return now - started >= TIMEOUT_SEC
+      && __atomic_compare_exchange_n(refreshing, &started, now, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// Look the key up in the CACHE_FILE the way memcache_get does in memory
+static bool file_get(dns_cache_t *cache, char *key, unsigned int hash,
+                     unsigned short qtype, long long valid_after, char *msg,
+                     size_t *len, long long *stored, long long *expires,
+                     unsigned int **hits, long long **refreshing) {
+  for (int i = 0; i < CACHE_PROBES; i++) {
+    dns_cache_entry_t *entry = &cache->entries[(hash + i) % CACHE_SLOTS];
+    if (__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) == 0)
+      return false;  // slots are never emptied, so the key isn't further
+
+    if (read_entry(entry, key, hash, qtype, valid_after, msg, len, stored,
+                   expires)) {
+      *hits = &entry->hits;
+      *refreshing = &entry->refreshing;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Look up the answer to (name, qtype) as cache_lookup does, among the answers
+// that expired less than STALE_MAX_SEC ago too if stale. Those get a TTL of
+// STALE_TTL_SEC, and should always be refreshed
+static bool lookup(dns_cache_t *cache, char *name, unsigned short qtype,
+                   char *buf, dns_msg_t *msg, bool stale, bool *refresh) {
+  char key[MAX_NAME_LEN];
+  cache_key(key, name);
+  unsigned int hash = cache_hash(key, qtype);
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  long long now = ts.tv_sec, stored, expires;
+  long long valid_after = stale ? now - STALE_MAX_SEC : now;
+  size_t len;
+  unsigned int *hits;
+  long long *refreshing;
+
+  bool found = cache->mem
+      ? memcache_get(cache->mem, key, hash, qtype, valid_after, buf, &len,
+                     &stored, &expires, &hits, &refreshing)
+      : file_get(cache, key, hash, qtype, valid_after, buf, &len, &stored,
+                 &expires, &hits, &refreshing);
+  if (!found || !parse_msg(msg, buf, len))
+    return false;
+
+  // Hot answers are refreshed once little of their TTL is left, so that they
+  // don't expire while still being asked for. Only the hits by then count, so
+  // that the readers of an answer don't all write to it. The time left is in
+  // microseconds, for the short TTLs to have some of it
+  bool due = true;
+  if (expires <= now) {
+    set_ttls(msg, STALE_TTL_SEC);
+  } else {
+    unsigned int min_ttl, neg_ttl;
+    walk_ttls(msg, now - stored, &min_ttl, &neg_ttl);
+    long long left = expires * 1000000 - now * 1000000 - ts.tv_nsec / 1000;
+    due = cache->prefetch
+        && left * 100 <= (expires - stored) * 1000000 * cache->prefetch
+        && __atomic_add_fetch(hits, 1, __ATOMIC_RELAXED) >= PREFETCH_HITS;
+  }
+  if (refresh)
+    *refresh = due && claim_refresh(refreshing, now);
+  return true;
+}
+
+// Look up the answer to (name, qtype), copying it to buf (of MAX_MSG_LEN bytes)
+// with the TTLs reduced by the time it spent in the cache, and parsing it into
+// msg. Return false on a miss. If refresh isn't NULL, it is set when the
+// answer is hot and close to expiring, for the caller to ask for it again
+bool cache_lookup(dns_cache_t *cache, char *name, unsigned short qtype,
+                  char *buf, dns_msg_t *msg, bool *refresh) {
+  return lookup(cache, name, qtype, buf, msg, false, refresh);
+}
+
+// Look up the answer to (name, qtype) as cache_lookup does, also serving it
+// if it expired less than STALE_MAX_SEC ago (RFC 8767), with a TTL of
+// STALE_TTL_SEC. For the servers that can't be reached, so refresh is set
+// for the caller to try again unless another refresh is under way
+bool cache_lookup_stale(dns_cache_t *cache, char *name, unsigned short qtype,
+                        char *buf, dns_msg_t *msg, bool *refresh) {
+  return lookup(cache, name, qtype, buf, msg, true, refresh);
+}
+
+// Store the answer to (name, qtype) for as long as its TTLs allow. Negative
+// answers (NXDOMAIN, or NOERROR without answers) are stored for the time given
+// by the SOA in their authority section, and not at all without one
+void cache_store(dns_cache_t *cache, char *name, unsigned short qtype,
+                 dns_msg_t *ans) {
+  // The slots of the CACHE_FILE are of a fixed size, the memory takes any
+  // answer a lookup can copy
+  size_t len = ans->len;
+  if (len > (cache->mem ? MAX_MSG_LEN : EDNS_PAYLOAD))
+    return;
+
+  dns_header_t header = ans->header;
+  if (header.tc || (header.rcode != 0 && header.rcode != 3))
+    return;
+
+  unsigned int min_ttl, neg_ttl, ttl;
+  walk_ttls(ans, 0, &min_ttl, &neg_ttl);
+  ttl = header.rcode == 0 && header.ancount ? min_ttl : neg_ttl;
+  if (ttl == 0)
+    return;
+
+  char key[MAX_NAME_LEN];
+  cache_key(key, name);
+  unsigned int hash = cache_hash(key, qtype);
+  long long now = time(NULL);
+
+  if (cache->mem) {
+    memcache_put(cache->mem, key, hash, qtype, ans->buf, len, now, now + ttl);
+    return;
+  }
+
+  flock(cache->fd, LOCK_EX);
+
+  // Reuse the slot of the key, or an empty one, or else evict the entry that
+  // expires first (stale ones before any other)
+  dns_cache_entry_t *victim = NULL;
+  bool same = false;
+  for (int i = 0; i < CACHE_PROBES; i++) {
+    dns_cache_entry_t *entry = &cache->entries[(hash + i) % CACHE_SLOTS];
+    same = entry->hash == hash && entry->qtype == qtype
+        && strncmp(entry->name, key, MAX_NAME_LEN) == 0;
+    if (entry->hash == 0 || same) {
+      victim = entry;
+      break;
+    }
+    if (victim == NULL || entry->expires < victim->expires)
+      victim = entry;
+  }
+
+  // Mark the entry as being written (a writer that died may have left it so)
+  unsigned int seq = __atomic_load_n(&victim->seq, __ATOMIC_RELAXED) | 1;
+  __atomic_store_n(&victim->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  victim->stored = now;
+  victim->expires = now + ttl;
+  // A refreshed answer stays hot for a while, unless it stops being asked for.
+  // Readers update these two without the lock
+  unsigned int hits = __atomic_load_n(&victim->hits, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->hits, same ? hits / 2 : 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&victim->refreshing, 0, __ATOMIC_RELAXED);
+  victim->qtype = qtype;
+  victim->len = (unsigned short) len;
+  strcpy(victim->name, key);
+  memcpy(victim->msg, ans->buf, len);
+  __atomic_store_n(&victim->hash, hash, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&victim->seq, seq + 1, __ATOMIC_RELEASE);
+
+  flock(cache->fd, LOCK_UN);
+}
+
+// Unmap and close the CACHE_FILE
+void cache_close(dns_cache_t *cache) {
+  munmap(cache->header, cache->size);
+  close(cache->fd);
+}
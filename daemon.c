@@ -0,0 +1,436 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+/* Client query waiting for its answer from the resolver */
+typedef struct {
+  bool tcp;
+  int fd;                   // TCP client, or the UDP socket
+  unsigned int gen;         // of the TCP client, which may close meanwhile
+  struct sockaddr_in addr;  // UDP client
+  unsigned short id;        // as sent by the client (network byte order)
+  bool rd, edns, log;
+  size_t payload;           // largest UDP answer the client takes
+  char question[MAX_WIRE_NAME_LEN + 4];  // as sent, for error answers
+  size_t question_len;
+} daemon_query_t;
+
+/* TCP client, with length-prefixed queries and answers (RFC 7766) */
+typedef struct {
+  dns_conn_t conn;          // fd -1 for a free slot
+  unsigned int gen;         // bumped when it closes
+} daemon_client_t;
+
+static struct {
+  dns_resolver_t res;
+  int epfd, udp, listener;
+  daemon_client_t *clients; // by fd
+  int clients_cap, nclients;
+  daemon_query_t *queries;  // a window of them, like the resolver
+  int *free_queries, nfree;
+  dns_msg_t msg;            // the client query being handled
+  char out[TCP_BUFLEN];     // the answer being sent
+  FILE *devnull;            // where sampled answers are printed, for dns.log
+  unsigned long long received, answered, failed, truncated;
+} stub;
+
+static volatile sig_atomic_t stopping;
+
+// Stop the event loop on SIGINT or SIGTERM
+static void stop(int sig) {
+  (void) sig;
+  stopping = 1;
+}
+
+// Close a TCP client, forgetting the answers it still waits for
+static void close_client(int fd) {
+  daemon_client_t *client = &stub.clients[fd];
+  tcp_close(&client->conn);
+  client->gen++;
+  stub.nclients--;
+}
+
+// Send an answer to the client of q, over its transport. A TCP client that
+// can't take it is closed
+static void send_answer(daemon_query_t *q, char *msg, size_t len) {
+  if (!q->tcp) {
+    sendto(stub.udp, msg, len, 0, (struct sockaddr *) &q->addr,
+           sizeof(q->addr));
+    return;
+  }
+
+  daemon_client_t *client = &stub.clients[q->fd];
+  if (client->conn.fd < 0 || client->gen != q->gen)
+    return;  // gone since it asked
+  if (!tcp_send(&client->conn, stub.epfd, NULL, msg, len))
+    close_client(q->fd);
+}
+
+// Answer the client of q with rcode and its question alone (none if it was
+// malformed), or with just the TC bit to have it ask again over TCP
+static void send_error(daemon_query_t *q, int rcode, bool tc) {
+  char msg[sizeof(dns_header_t) + sizeof(q->question)];
+  dns_header_t header = init_header(0);
+  header.id = q->id;
+  header.qr = 1;
+  header.rd = q->rd;
+  header.ra = 1;
+  header.tc = tc;
+  header.rcode = (unsigned char) rcode;
+  header.qdcount = htons(q->question_len ? 1 : 0);
+
+  memcpy(msg, &header, sizeof(header));
+  memcpy(msg + sizeof(header), q->question, q->question_len);
+  send_answer(q, msg, sizeof(header) + q->question_len);
+}
+
+// Get a free client query, or NULL if a window of them is in flight
+static daemon_query_t *new_query() {
+  return stub.nfree ? &stub.queries[stub.free_queries[--stub.nfree]]
+                      : NULL;
+}
+
+// Put a client query back in the free ones
+static void free_query(daemon_query_t *q) {
+  stub.free_queries[stub.nfree++] = (int) (q - stub.queries);
+}
+
+// Send the answer to a client query, from the cache or the upstream servers:
+// under the id and question of the client, without the OPT record if it
+// didn't send one, truncated if it doesn't fit in its UDP payload. Failures
+// are answered SERVFAIL
+static void daemon_done(dns_resolver_t *res, dns_query_t *query,
+                        enum error_status status, dns_msg_t *ans) {
+  daemon_query_t *q = query->data;
+  char *msg = stub.out;
+  size_t len = status == NOERROR ? ans->len : 0;
+
+  if (status != NOERROR) {
+    stub.failed++;
+    send_error(q, 2, false);
+    free_query(q);
+    return;
+  }
+
+  memcpy(msg, ans->buf, len);
+  memcpy(msg, &q->id, sizeof(q->id));
+  msg[2] = (char) ((msg[2] & ~1) | q->rd);
+
+  // The name is the same, but may differ in case (0x20 randomisation)
+  int question = skip_name(msg, len, sizeof(dns_header_t));
+  if (question >= 0 && (size_t) question + 4 - sizeof(dns_header_t)
+      == q->question_len)
+    memcpy(msg + sizeof(dns_header_t), q->question, q->question_len);
+
+  // The OPT record comes last, when the answer has one
+  dns_record_t *opt = msg_opt(ans);
+  if (!q->edns && opt && opt == &ans->records[ans->nrecords - 1]) {
+    len = opt->name;
+    put16(msg + 10, (unsigned short) (ans->header.arcount - 1));
+  }
+
+  if (q->log)
+    print_answer(ans, resolver_server_name(res, query));
+
+  if (!q->tcp && len > q->payload) {
+    stub.truncated++;
+    send_error(q, ans->header.rcode, true);
+  } else {
+    stub.answered++;
+    send_answer(q, msg, len);
+  }
+  free_query(q);
+}
+
+// Handle a query of length len from a client: TCP client fd, or the UDP
+// client at addr. Malformed messages and answers are ignored
+static void handle_query(char *buf, size_t len, bool tcp, int fd,
+                         struct sockaddr_in *addr) {
+  dns_msg_t *msg = &stub.msg;
+  if (!parse_msg(msg, buf, len) || msg->header.qr)
+    return;
+  stub.received++;
+
+  daemon_query_t *q = new_query();
+  daemon_query_t overflow;
+  if (q == NULL)
+    q = &overflow;  // only used to answer SERVFAIL
+
+  q->tcp = tcp;
+  q->fd = tcp ? fd : stub.udp;
+  q->gen = tcp ? stub.clients[fd].gen : 0;
+  if (addr)
+    q->addr = *addr;
+  q->id = msg->header.id;
+  q->rd = msg->header.rd;
+  q->log = log_sampled();
+  q->question_len = 0;
+
+  dns_record_t *opt = msg_opt(msg);
+  q->edns = opt != NULL;
+  q->payload = opt && opt->class > BUFLEN ? opt->class : BUFLEN;
+
+  // A single question, of class IN, standard queries only
+  char name[MAX_NAME_LEN];
+  dns_record_t *rr = msg->records;
+  int end = msg->header.qdcount == 1 ? skip_name(buf, len, rr->name) : -1;
+  if (end < 0 || msg_name(msg, rr->name, name) < 0) {
+    send_error(q, 1, false);  // FORMERR
+  } else {
+    q->question_len = end + 4 - rr->name;
+    memcpy(q->question, buf + rr->name, q->question_len);
+    if (msg->header.opcode != 0 || rr->class != 1)
+      send_error(q, 4, false);  // NOTIMP
+    else if (q == &overflow)
+      send_error(q, 2, false);  // SERVFAIL, too many queries in flight
+    else if (resolver_submit(&stub.res, name, (enum query_type) rr->type,
+                             daemon_done, q) >= 0)
+      return;
+    else
+      send_error(q, 2, false);
+  }
+
+  stub.failed++;
+  if (q != &overflow)
+    free_query(q);
+}
+
+// Answer every query waiting on the UDP socket, up to a burst, so that TCP
+// clients and answers from upstream get their turn
+static void read_udp() {
+  char buf[MAX_MSG_LEN];
+  struct sockaddr_in addr;
+
+  for (int i = 0; i < DAEMON_UDP_BURST; i++) {
+    socklen_t addr_len = sizeof(addr);
+    ssize_t n = recvfrom(stub.udp, buf, sizeof(buf), MSG_DONTWAIT,
+                         (struct sockaddr *) &addr, &addr_len);
+    if (n < 0)
+      return;
+    handle_query(buf, n, false, -1, &addr);
+  }
+}
+
+// Accept the TCP clients waiting on the listener, while there is room
+static void accept_clients() {
+  for (;;) {
+    int fd = accept4(stub.listener, NULL, NULL, SOCK_NONBLOCK);
+    if (fd < 0)
+      return;
+    if (stub.nclients == DAEMON_CLIENTS) {
+      close(fd);
+      continue;
+    }
+
+    if (fd >= stub.clients_cap) {
+      int cap = stub.clients_cap ? 2 * stub.clients_cap : 1024;
+      while (cap <= fd)
+        cap *= 2;
+      daemon_client_t *clients = realloc(stub.clients,
+                                         cap * sizeof(daemon_client_t));
+      if (clients == NULL) {
+        close(fd);
+        continue;
+      }
+      memset(clients + stub.clients_cap, 0,
+             (cap - stub.clients_cap) * sizeof(daemon_client_t));
+      for (int i = stub.clients_cap; i < cap; i++)
+        clients[i].conn.fd = -1;
+      stub.clients = clients;
+      stub.clients_cap = cap;
+    }
+
+    dns_conn_t *conn = &stub.clients[fd].conn;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    if (conn->in == NULL)
+      conn->in = malloc(TCP_BUFLEN);
+    if (conn->in == NULL
+        || epoll_ctl(stub.epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      close(fd);
+      continue;
+    }
+
+    conn->fd = fd;
+    conn->connected = true;
+    conn->writing = false;
+    conn->out_len = conn->in_len = conn->in_start = 0;
+    conn->last_used = now_usec();
+    stub.nclients++;
+  }
+}
+
+// Handle the events of a TCP client: write what is queued for it, and handle
+// every query received from it
+static void handle_client(int fd, unsigned int events) {
+  dns_conn_t *conn = &stub.clients[fd].conn;
+  if ((events & EPOLLOUT) && !tcp_flush(conn, stub.epfd)) {
+    close_client(fd);
+    return;
+  }
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
+
+  for (;;) {
+    int r = tcp_read(conn);
+
+    char *msg;
+    size_t len;
+    while (conn->fd >= 0 && (msg = tcp_next_msg(conn, &len)))
+      handle_query(msg, len, true, fd, NULL);
+
+    if (r < 0 && conn->fd >= 0)
+      close_client(fd);
+    if (r <= 0 || conn->fd < 0)
+      break;
+  }
+}
+
+// Close the TCP clients that didn't send anything for TCP_IDLE_USEC and have
+// nothing left to write
+static void close_idle_clients() {
+  long long now = now_usec();
+  for (int fd = 0; fd < stub.clients_cap; fd++) {
+    dns_conn_t *conn = &stub.clients[fd].conn;
+    if (conn->fd >= 0 && conn->out_len == 0
+        && now - conn->last_used > TCP_IDLE_USEC)
+      close_client(fd);
+  }
+}
+
+// Open the UDP socket and TCP listener on addr, watched by the event loop
+// along with the resolver
+static bool open_listeners(char *addr_str) {
+  struct sockaddr_in addr;
+  struct epoll_event ev = {.events = EPOLLIN};
+  int one = 1, rcvbuf = DAEMON_RCVBUF;
+
+  if (!parse_server_addr(addr_str, &addr))
+    return false;
+  // Blocking, so that answers wait for room in the send buffer instead of
+  // being dropped; it is read with MSG_DONTWAIT
+  stub.udp = socket(PF_INET, SOCK_DGRAM, 0);
+  stub.listener = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  stub.epfd = epoll_create1(0);
+  if (stub.udp < 0 || stub.listener < 0 || stub.epfd < 0
+      || bind(stub.udp, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || setsockopt(stub.listener, SOL_SOCKET, SO_REUSEADDR, &one,
+                    sizeof(one))
+      || bind(stub.listener, (struct sockaddr *) &addr, sizeof(addr)) < 0
+      || listen(stub.listener, SOMAXCONN) < 0)
+    return false;
+  // Past net.core.rmem_max too, when allowed to
+  if (setsockopt(stub.udp, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf,
+                 sizeof(rcvbuf)))
+    setsockopt(stub.udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  int fds[] = {stub.udp, stub.listener, resolver_fd(&stub.res)};
+  for (int i = 0; i < 3; i++) {
+    ev.data.fd = fds[i];
+    if (epoll_ctl(stub.epfd, EPOLL_CTL_ADD, fds[i], &ev) < 0)
+      return false;
+  }
+  return true;
+}
+
+// Run as a caching stub resolver on opts->listen, over UDP and TCP, until
+// SIGINT or SIGTERM: queries are answered from the cache, and misses are
+// forwarded to the servers of the conf file, with up to a window in flight
+// (identical ones coalesced). One in opts->log_sample queries is logged
+void run_daemon(dns_options_t *opts) {
+  int conf_size;
+  dns_server_t *data = get_conf_data(&conf_size);
+  if (data == NULL) {
+    fprintf(stderr, "Failed to open conf file!\n");
+    exit(0);
+  }
+
+  dns_resolver_t *res = &stub.res;
+  if (!resolver_init(res, data, conf_size, opts->window))
+    error("ERROR setting up the resolver!\n");
+  resolver_set_options(res, opts);
+
+  stub.queries = calloc(opts->window, sizeof(daemon_query_t));
+  stub.free_queries = calloc(opts->window, sizeof(int));
+  stub.devnull = fopen("/dev/null", "w");
+  if (!stub.queries || !stub.free_queries || !stub.devnull)
+    error("ERROR allocating the daemon!\n");
+  for (int i = 0; i < opts->window; i++)
+    stub.free_queries[stub.nfree++] = opts->window - 1 - i;
+  print_set_output(stub.devnull);
+
+  if (!open_listeners(opts->listen))
+    error("ERROR opening the listening sockets!\n");
+
+  struct sigaction sa = {.sa_handler = stop};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  struct epoll_event events[MAX_EVENTS];
+  dns_resolver_t *stats[] = {res};
+  long long next_stats = now_usec() + opts->stats_interval_ms * 1000LL;
+  long long next_idle = now_usec() + 1000000;
+
+  while (!stopping) {
+    // Without sleeping past a timeout of the resolver, or the housekeeping
+    int timeout = resolver_timeout(res);
+    if (timeout < 0 || timeout > 1000)
+      timeout = 1000;
+
+    int n = epoll_wait(stub.epfd, events, MAX_EVENTS, timeout);
+    for (int i = 0; i < n; i++) {
+      int fd = events[i].data.fd;
+      if (fd == stub.udp)
+        read_udp();
+      else if (fd == stub.listener)
+        accept_clients();
+      else if (fd != resolver_fd(res))
+        handle_client(fd, events[i].events);
+    }
+    resolver_process(res, 0);
+
+    long long now = now_usec();
+    if (now >= next_idle) {
+      close_idle_clients();
+      next_idle = now + 1000000;
+    }
+    if (opts->stats_file && now >= next_stats) {
+      stats_write(opts->stats_file, stats, 1);
+      next_stats = now + opts->stats_interval_ms * 1000LL;
+    }
+  }
+
+  unsigned long long *counters = res->counters;
+  fprintf(stderr, ";; daemon: %llu queries, %llu answered, %llu truncated, "
+          "%llu failed, %llu coalesced\n"
+          ";; cache: %llu hits, %llu misses, %llu prefetched, %llu stale\n",
+          stub.received, stub.answered, stub.truncated, stub.failed,
+          counters[RES_COALESCED], counters[RES_CACHE_HITS],
+          counters[RES_CACHE_MISSES], counters[RES_PREFETCHES],
+          counters[RES_STALE]);
+  if (opts->memcache)
+    memcache_summary(opts->memcache);
+  if (opts->stats_file)
+    stats_write(opts->stats_file, stats, 1);
+
+  for (int fd = 0; fd < stub.clients_cap; fd++) {
+    tcp_close(&stub.clients[fd].conn);
+    free(stub.clients[fd].conn.in);
+    free(stub.clients[fd].conn.out);
+  }
+  close(stub.udp);
+  close(stub.listener);
+  close(stub.epfd);
+  print_set_output(NULL);
+  fclose(stub.devnull);
+  free(stub.clients);
+  free(stub.queries);
+  free(stub.free_queries);
+  resolver_free(res);
+  save_server_state(data, conf_size);
+  free(data);
+}
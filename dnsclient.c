@@ -4,125 +4,280 @@
 
 #include "dnsclient.h"
 
+static enum output_format format;
+
+// Print the answer of the single query resolved by main
+static void single_done(dns_resolver_t *res, dns_query_t *query,
+                        enum error_status status, dns_msg_t *ans) {
+  *(enum error_status *) query->data = status;
+  if (format == OUT_NONE)
+    return;
+  if (format == OUT_JSON) {
+    print_json(query, status, ans,
+               status == NOERROR ? resolver_server_name(res, query) : NULL);
+    return;
+  }
+  if (format == OUT_BINARY) {
+    print_binary(query, status, ans);
+    return;
+  }
+  if (status != NOERROR)
+    return;
+
+  // If no server answered with NOERROR, the last header is printed
+  char *server = resolver_server_name(res, query);
+  dns_header_t ans_header = print_answer(ans, server);
+  if (ans_header.rcode != 0)
+    print_header(ans_header);
+  printf("Received %zu bytes from %s\n", ans->len, server);
+}
+
 int main(int argc, char *argv[]) {
+  dns_options_t options = {
+      .window = BULK_WINDOW,
+      .hedge = -1,
+      .cache = true,
+      .prefetch = PREFETCH_PCT,
+      .edns = EDNS_PAYLOAD,
+      .batch = BATCH_SIZE,
+      .threads = 1,
+      .log_flush_ms = LOG_FLUSH_MS,
+      .stats_interval_ms = STATS_INTERVAL_MS,
+      .coalesce = true,
+      .cwnd = CWND_INIT,
+      .log_sample = -1,
+  }, *opts = &options;
+  int opt;
+
+  while ((opt = getopt(argc, argv,
+                       "f:w:B:t:rH:ne:i:dbs:S:o:x:q:IR:CL:l:P:Y:W:M:")) != -1) {
+    switch (opt) {
+      case 'f': opts->bulk_file = optarg;
+        break;
+      case 'w': opts->window = atoi(optarg);
+        break;
+      case 'B': opts->batch = atoi(optarg);
+        break;
+      case 't': opts->threads = atoi(optarg);
+        break;
+      case 'r': opts->hedge = 0;
+        break;
+      case 'H': opts->hedge = atoll(optarg) * 1000;
+        break;
+      case 'n': opts->cache = false;
+        break;
+      case 'P': opts->prefetch = atoi(optarg);
+        break;
+      case 'e': opts->edns = atoi(optarg);
+        break;
+      case 'i': opts->log_flush_ms = atoi(optarg);
+        break;
+      case 'd': opts->log_drop = true;
+        break;
+      case 'b': opts->log_binary = true;
+        break;
+      case 's': opts->stats_file = optarg;
+        break;
+      case 'S': opts->stats_interval_ms = atoi(optarg);
+        break;
+      case 'x': opts->sweep = optarg;
+        break;
+      case 'q': opts->rate = atoi(optarg);
+        break;
+      case 'C': opts->coalesce = false;
+        break;
+      case 'W': opts->cwnd = atoi(optarg);
+        break;
+      case 'M': opts->cache_mb = atoi(optarg);
+        break;
+      case 'I': opts->iterative = true;
+        break;
+      case 'R': opts->root_hints = optarg;
+        opts->iterative = true;
+        break;
+      case 'L': opts->listen = optarg;
+        break;
+      case 'Y': opts->replay = optarg;
+        break;
+      case 'l': opts->log_sample = atoi(optarg);
+        break;
+      case 'o':
+        if (strcmp(optarg, "json") == 0)
+          opts->format = OUT_JSON;
+        else if (strcmp(optarg, "binary") == 0)
+          opts->format = OUT_BINARY;
+        else if (strcmp(optarg, "none") == 0)
+          opts->format = OUT_NONE;
+        else if (strcmp(optarg, "text") != 0)
+          error("The output format must be text, json, binary or none\n");
+        break;
+      default: argc = 0;
+    }
+  }
+
+  if (opts->edns && (opts->edns < BUFLEN || opts->edns > MAX_MSG_LEN))
+    error("The EDNS payload size must be 0 or between 512 and 4096\n");
+  if (opts->window > MAX_WINDOW)
+    error("The window must be at most 32768\n");
+  if (opts->batch < 1 || opts->batch > MAX_BATCH)
+    error("The batch size must be between 1 and 1024\n");
+  if (opts->prefetch < 0 || opts->prefetch > 100)
+    error("The prefetch threshold must be between 0 and 100\n");
+  if (opts->stats_interval_ms <= 0)
+    error("The stats interval must be a positive number\n");
+  if (opts->cwnd < 0)
+    error("The congestion window must be 0 or a positive number\n");
+  if (opts->cache_mb < 0 || opts->cache_mb > 1 << 20)
+    error("The memory cache size must be 0 or a positive number of MB\n");
+
+  // The daemon doesn't log by default, since it runs for long, and neither
+  // does a replay, which sends nothing
+  if (opts->log_sample < 0)
+    opts->log_sample = opts->listen || opts->replay ? 0 : 1;
+  if (argc && opts->log_sample && !log_init(opts))
+    error("Could not open message log file.\n");
+
+  // Replay mode: messages decoded from a capture or a message log, offline
+  if (opts->replay && argc) {
+    run_replay(opts);
+    return 0;
+  }
+
+  // The in-memory cache lasts as long as the process, so it is shared by the
+  // resolvers of every thread
+  if (opts->cache && opts->cache_mb && argc) {
+    opts->memcache = memcache_create((size_t) opts->cache_mb << 20);
+    if (opts->memcache == NULL)
+      error("Could not allocate the memory cache.\n");
+  }
+
+  // Daemon mode: a caching stub resolver for the local clients
+  if (opts->listen && argc) {
+    if (opts->window <= 0)
+      error("The window must be a positive number\n");
+    if (opts->iterative)
+      error("The daemon forwards to the conf file servers only\n");
+    run_daemon(opts);
+    memcache_free(opts->memcache);
+    return 0;
+  }
+
+  // Sweep mode: PTR records of whole ranges
+  if (opts->sweep && argc) {
+    if (opts->window <= 0)
+      error("The window must be a positive number\n");
+    if (opts->rate < 0)
+      error("The rate must be a positive number, or 0 for no limit\n");
+    run_sweep(opts);
+    memcache_free(opts->memcache);
+    return 0;
+  }
+
+  // Bulk mode: names and types are read from a file (or stdin)
+  if (opts->bulk_file && argc) {
+    if (opts->window <= 0)
+      error("The window must be a positive number\n");
+    if (opts->threads <= 0)
+      error("The number of threads must be a positive number\n");
+    if (opts->iterative && opts->threads > 1)
+      error("Iterative resolution runs on a single thread\n");
+    run_bulk(opts);
+    memcache_free(opts->memcache);
+    return 0;
+  }
+
   // Checking arguments validity
-  if (argc < 3) {
-    fprintf(stderr, "Usage: %s name/ip query_type\n", argv[0]);
+  if (argc - optind < 2) {
+    fprintf(stderr,
+            "Usage: %s [options] name/ip query_type\n"
+            "       %s [options] -f file|- [-w window] [-t threads]\n"
+            "       %s [options] -x cidr[,cidr...] [-w window] [-q qps]\n"
+            "       %s [options] -L addr[:port] [-w window] [-l sample]\n"
+            "       %s [options] -Y capture.pcap|message.log|message.bin\n"
+            "  -B batch     datagrams per sendmmsg/recvmmsg, 1 for none\n"
+            "  -t threads   bulk mode worker threads, one per core\n"
+            "  -n           don't use the response cache\n"
+            "  -M mb        keep the cache in memory instead of in\n"
+            "               " CACHE_FILE ", up to mb MB shared by the\n"
+            "               threads, for as long as the process runs\n"
+            "  -P percent   refresh hot cached answers with this much of\n"
+            "               their TTL left, 0 never (default 10)\n"
+            "  -e payload   advertised EDNS UDP payload size, 0 to disable\n"
+            "  -r           race all servers\n"
+            "  -C           send identical queries in flight separately\n"
+            "  -W cwnd      queries in flight to each server at first, the\n"
+            "               window adapting to losses, 0 for no limit\n"
+            "  -H hedge_ms  also try the next server after hedge_ms\n"
+            "  -i flush_ms  interval between log writes\n"
+            "  -l sample    log one in sample queries, 0 for none (the\n"
+            "               default of the daemon)\n"
+            "  -d           drop log records when the log buffer is full\n"
+            "  -b           binary message log (" MSG_BIN_LOG ")\n"
+            "  -s file      write statistics to file (JSON if it ends in\n"
+            "               .json, Prometheus text otherwise)\n"
+            "  -S stats_ms  interval between statistics writes in bulk mode\n"
+            "  -o format    text, json (a line per query), binary records\n"
+            "               or none\n"
+            "  -I           resolve iteratively from the root servers\n"
+            "  -R file      root hints for -I, an address[:port] per line\n",
+            argv[0], argv[0], argv[0], argv[0], argv[0]);
     exit(0);
   }
 
   char domain[MAX_NAME_LEN];
-  strcpy(domain, argv[1]);
+  snprintf(domain, MAX_NAME_LEN, "%s", argv[optind]);
 
   enum domain_type domain_t = get_domain_type(domain);
-  enum query_type query = get_query_type(argv[2]);
-
-  if (domain_t == -1)
-    error("Please enter a valid IP or domain name!\n");
-  if (query == -1)
-    error("Please enter a valid query type!\n");
-
-  if (query == TXT && domain_t != NAME)
-    error("The TXT query requires a domain name\n");
-  if (query == PTR && domain_t != IP)
-    error("The PTR query requires an IP\n");
-
-  // Retrieving DNS server information from the CONF_FILE
-  int conf_size;
-  char **data = get_conf_data(&conf_size);
-
-  // Opening UDP socket
-  int sockUDP = socket(PF_INET, SOCK_DGRAM, 0);
-  if (sockUDP < 0)
-    error("ERROR opening socket!\n");
-
-  // Initialising header
-  dns_header_t header = init_header();
-
-  // Initialising question
-  char *qname = toQNAME(domain);
-  dns_question_t question = init_question(query);
-
-  // Creating message
-  char *msg = calloc(BUFLEN, sizeof(char));
-  size_t header_len = sizeof(header),
-      qname_len = strlen(qname) + 1,
-      question_len = sizeof(question);
-  memcpy(msg, &header, header_len);
-  memcpy(msg + header_len, qname, qname_len);
-  memcpy(msg + header_len + qname_len, &question, question_len);
-
-  // Logging message
-  size_t msg_len = header_len + qname_len + question_len;
-  log_msg(msg, msg_len);
-
-  // Setting timeout value
-  struct timeval time;
-  time.tv_sec = TIMEOUT_SEC;
-  time.tv_usec = TIMEOUT_USEC;
-
-  // Setting up server
-  struct sockaddr_in server;
-  server.sin_family = AF_INET;
-  server.sin_port = htons(53);
-
-  // Setting up file descriptor set
-  fd_set read_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(sockUDP, &read_fds);
-
-  // Initiating communication
-  int i;
-  ssize_t r;
-  char buf[BUFLEN];
-  char received[BUFLEN];
-  enum error_status status = NOSERVER;
-  printf("Trying \"%s\"\n", domain);
-
-  for (i = 0; i < conf_size; i++) {
-    if (inet_aton(data[i], &server.sin_addr) < 0)
-      continue;
-
-    socklen_t sockaddr_len = sizeof(struct sockaddr);
-    if (sendto(sockUDP,
-               msg,
-               msg_len,
-               0,
-               (struct sockaddr *) &server,
-               sockaddr_len) < 0) {
-      status = SENDERROR;
-      continue;
-    }
+  enum query_type query = get_query_type(argv[optind + 1]);
 
-    if (select(sockUDP + 1, &read_fds, NULL, NULL, &time) == 0) {
-      status = NORESPONSE;
-      continue;  // timeout
-    }
+  char *invalid = check_query(domain_t, query);
+  if (invalid)
+    error(invalid);
 
-    struct sockaddr_in host;
-    r = recvfrom(sockUDP,
-                 buf,
-                 BUFLEN,
-                 0,
-                 (struct sockaddr *) &host,
-                 &sockaddr_len);
-    if (r < 0) {
-      status = RECVERROR;
-      continue;
-    }
+  // Retrieving DNS server information from the CONF_FILE, unless resolving
+  // from the root
+  int conf_size = 0;
+  dns_server_t *data = opts->iterative ? NULL : get_conf_data(&conf_size);
+  if (data == NULL && !opts->iterative) {
+    fprintf(stderr, "Failed to open conf file!\n");
+    exit(0);
+  }
 
-    // If the response has NOERROR status, or we're out of valid servers
-    dns_header_t ans_header = parse_answer(buf, data[i]);
-    if (ans_header.rcode == 0) {
-      status = NOERROR;
-      sprintf(received, "Received %zu bytes from %s\n", r, data[i]);
-      break;
-    } else if (i == conf_size - 1) {
-      // If no more servers are available, print the last header
-      print_header(ans_header);
-    }
+  // The query is sent through a resolver with a window of one
+  dns_resolver_t res;
+  dns_iter_t iter;
+  if (!resolver_init(&res, data, conf_size, 1))
+    error("ERROR setting up the resolver!\n");
+  resolver_set_options(&res, opts);
+  if (opts->iterative && !iter_init(&iter, &res, opts->root_hints))
+    error("ERROR loading the root hints!\n");
+
+  enum error_status status = NOSERVER;
+  format = opts->format;
+  if (format == OUT_TEXT)
+    printf("Trying \"%s\"\n", domain);
+
+  if (opts->iterative) {
+    iter_submit(&iter, domain, query, single_done, &status);
+    while (iter.active)
+      iter_process(&iter, -1);
+    iter_free(&iter);
+  } else {
+    resolver_submit(&res, domain, query, single_done, &status);
+    while (res.active)
+      resolver_process(&res, -1);
   }
 
+  // Keeping the RTT estimates for the next runs, even if the query failed
+  dns_resolver_t *stats[] = {&res};
+  if (opts->stats_file && !stats_write(opts->stats_file, stats, 1))
+    fprintf(stderr, "Could not write the statistics file.\n");
+  resolver_free(&res);
+  memcache_free(opts->memcache);
+  if (data)
+    save_server_state(data, conf_size);
+  free(data);
+
   switch (status) {
     case NORESPONSE: error("No response from server(s)\n");
     case SENDERROR: error("Send failed.\n");
@@ -130,13 +285,4 @@ int main(int argc, char *argv[]) {
     case NOSERVER: error("No valid servers.\n");
     case NOERROR: break;
   }
-
-  printf("%s", received);
-
-  close(sockUDP);
-  for (i = 0; i <= conf_size; i++)
-    free(data[i]);
-  free(data);
-  free(qname);
-  free(msg);
 }
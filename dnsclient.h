@@ -2,41 +2,153 @@
 #define TEMA3_DNSCLIENT_H
 
 #define BUFLEN 512
+#define MAX_MSG_LEN 4096    /* largest UDP payload that can be advertised */
+#define EDNS_PAYLOAD 1232   /* default advertised UDP payload (EDNS0) */
+#define OPT_LEN 11          /* OPT pseudo-record without options */
+#define TCP_BUFLEN (2 + 65535)  /* one length-prefixed message over TCP */
 #define MAX_IPS 20
 #define MAX_NAME_LEN 256
 #define MAX_QUERY_LEN 20
 #define MAX_RDATA_LEN 50
+/* Records of the largest message parse_msg takes (over TCP, 5 bytes each at
+ * least), then room for the names decoded from it */
+#define MAX_RECORDS ((TCP_BUFLEN - 2 - 12) / 5)
+#define ARENA_SIZE (MAX_RECORDS * sizeof(dns_record_t) + 8 * MAX_MSG_LEN)
+#define MAX_WIRE_NAME_LEN 255  /* RFC 1035 limit, length octets included */
+#define MAX_POINTER_HOPS 64
+#define MAX_QUERY_SIZE (12 + MAX_WIRE_NAME_LEN + 4 + OPT_LEN)  /* encoded */
+#define NAME_MEMO_SIZE 64      /* decoded name suffixes kept per message */
 
 #define CONF_FILE "dns_servers.conf"
+#define STATE_FILE "dns_servers.state"
+#define CACHE_FILE "dns_cache.db"
 #define MSG_LOG "message.log"
+#define MSG_BIN_LOG "message.bin"
 #define DNS_LOG "dns.log"
 
 #define TIMEOUT_SEC 5
 #define TIMEOUT_USEC 0
 
-/* -- Query & Resource Record Type: -- */
-// #define A     1   /* IPv4 address */
-// #define NS    2   /* Authoritative name server */
-// #define CNAME 5   /* Canonical name for an alias */
-// #define MX    15  /* Mail exchange */
-// #define SOA   6   /* Start of a zone of Authority */
-// #define TXT   16  /* Text strings */
+/* Retransmit timeout bounds, the upper one is the old fixed timeout */
+#define MIN_RTO_USEC 20000
+#define MAX_RTO_USEC (TIMEOUT_SEC * 1000000LL + TIMEOUT_USEC)
+#define MAX_ADDR_LEN 64
+
+#define CACHE_SLOTS 4096   /* entries in the response cache */
+#define CACHE_PROBES 8     /* slots searched for a key */
+#define PREFETCH_PCT 10    /* default share of its TTL left when a hot answer
+                              is refreshed */
+#define PREFETCH_HITS 2    /* hits close to expiry that make an answer hot */
+#define STALE_MAX_SEC 86400  /* expired answers can be served for (RFC 8767) */
+#define STALE_TTL_SEC 30   /* TTL of the stale answers served */
+#define DOWN_TIMEOUTS 3    /* timeouts in a row after which a server is down */
+#define CWND_INIT 16       /* default queries in flight to a server at first */
+#define CWND_MIN 1         /* smallest congestion window */
+#define CACHE_LINE 64
+#define MEM_SHARDS 32      /* shards of the in-memory cache */
+#define MEM_WAYS 7         /* entries per bucket, a cache line with its seq */
+#define MEM_MAX_MOVES 32   /* entries kept by the CLOCK hand per store */
+
+#define BULK_WINDOW 100   /* default number of queries in flight */
+#define MAX_WINDOW 32768  /* half the transaction ids, so that a free one is
+                             found quickly */
+#define LOG_FLUSH_MS 100  /* default interval between log writes */
+#define MAX_EVENTS 64
+#define BATCH_SIZE 32     /* default datagrams per sendmmsg/recvmmsg */
+#define POOL_QUEUE 1024   /* names waiting for each worker thread */
+#define POOL_OUT_SIZE 65536  /* output a worker buffers before writing it */
+#define MAX_BATCH 1024
+#define RCVBUF_PER_QUERY 2048  /* socket buffer reserved per query in flight */
+#define DEFAULT_RCVBUF 212992  /* usual net.core.rmem_default */
+#define TCP_IDLE_USEC 10000000LL  /* idle TCP connections are closed after */
+#define STATS_SUB_BUCKETS 16  /* linear histogram buckets per power of two */
+#define STATS_BUCKETS (28 * STATS_SUB_BUCKETS)  /* values up to 2^31 */
+#define STATS_INTERVAL_MS 10000  /* default interval between stats writes */
+#define MAX_HOPS 16       /* queries of one iterative lookup */
+#define MAX_CNAMES 8      /* aliases followed by one iterative lookup */
+#define GLUELESS_DEPTH 2  /* nested lookups of nameserver addresses */
+#define ZONE_SLOTS 4096   /* zones in the delegation cache */
+#define ZONE_PROBES 8     /* slots searched for a zone */
+#define DAEMON_CLIENTS 8192  /* TCP clients served at once */
+#define DAEMON_UDP_BURST 64  /* datagrams read before other events */
+#define DAEMON_RCVBUF (8 << 20)  /* for the bursts of every client */
+
+/* -- Query & Resource Record Types: -- */
+/* The record types known by name: X(name, value, formatter), the formatter
+ * being the function of output.c that decodes their rdata into presentation
+ * format. The tables of types are all expanded from this list, other types
+ * are named TYPEnnn and their rdata written as \# (RFC 3597) */
+#define RR_TYPES(X) \
+  X(A, 1, put_a) \
+  X(NS, 2, put_name_rdata) \
+  X(CNAME, 5, put_name_rdata) \
+  X(SOA, 6, put_soa) \
+  X(PTR, 12, put_name_rdata) \
+  X(MX, 15, put_mx) \
+  X(TXT, 16, put_txt) \
+  X(AAAA, 28, put_aaaa) \
+  X(SRV, 33, put_srv) \
+  X(OPT, 41, put_opt) \
+  X(DS, 43, put_ds) \
+  X(CAA, 257, put_caa)
+#define RR_TYPE_LIMIT 512  /* known types are below it, for direct indexing */
 
 enum query_type {
-  A = 1,
-  NS = 2,
-  CNAME = 5,
-  MX = 15,
-  SOA = 6,
-  TXT = 16,
-  PTR = 0,
+#define RR_VALUE(name, value, formatter) name = value,
+  RR_TYPES(RR_VALUE)
+#undef RR_VALUE
   NONE = -1
 };
 
+/* Position of a type in the tables of types, RR_GENERIC for unknown ones */
+enum rr_index {
+  RR_GENERIC,
+#define RR_INDEX(name, value, formatter) RR_##name,
+  RR_TYPES(RR_INDEX)
+#undef RR_INDEX
+  RR_COUNT
+};
+
 enum domain_type { NAME = 1, IP = 2, INVALID = -1 };
 
 enum error_status { NOERROR, NORESPONSE, SENDERROR, RECVERROR, NOSERVER };
 
+enum section { QUESTION, ANSWER, AUTHORITY, ADDITIONAL };
+
+enum log_file { LOG_MSG, LOG_DNS, LOG_FILES };
+
+enum output_format { OUT_TEXT, OUT_JSON, OUT_BINARY, OUT_NONE };
+
+/* Counters kept per server. The answers are also counted by RCODE, from
+ * STAT_RCODE (NOERROR) to STAT_RCODE + 5 (REFUSED), the rest after them */
+enum stats_counter {
+  STAT_QUERIES,     // sent, over UDP or TCP
+  STAT_RETRIES,     // sent again after the first server or transport
+  STAT_TIMEOUTS,
+  STAT_TRUNCATED,
+  STAT_ANSWERS,
+  STAT_BYTES_OUT,
+  STAT_BYTES_IN,
+  STAT_THROTTLED,   // waited for room in the congestion window
+  STAT_CWND_CUTS,   // times the congestion window was cut
+  STAT_RCODE,
+  STATS_COUNTERS = STAT_RCODE + 7
+};
+
+/* Counters kept per resolver, for its queries to any server */
+enum resolver_counter {
+  RES_COALESCED,    // answered without being sent, with an identical query
+  RES_CACHE_HITS,
+  RES_CACHE_MISSES,
+  RES_PREFETCHES,   // hot answers refreshed before they expired
+  RES_STALE,        // expired answers served, the servers being unreachable
+  RES_COUNTERS
+};
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // sendmmsg, recvmmsg
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
 #include <stdio.h>
@@ -47,6 +159,21 @@ enum error_status { NOERROR, NORESPONSE, SENDERROR, RECVERROR, NOSERVER };
 #include <stdbool.h>
 #include <netinet/in.h>
 #include <zconf.h>
+#include <errno.h>
+#include <time.h>
+#include <strings.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
 
 /* -- Define DNS message format -- */
 /* Header section format */
@@ -142,26 +269,544 @@ typedef struct {
 } dns_rr_t;
 
 
+/* A question or resource record of a parsed message. Names and rdata are
+ * offsets in the message buffer, nothing is copied out of it */
+typedef struct {
+  unsigned short name;      // offset of the owner name
+  unsigned short type;
+  unsigned short class;
+  unsigned short rdlength;  // 0 for questions
+  unsigned int ttl;         // 0 for questions
+  unsigned short rdata;     // offset of the rdata (end of a question)
+  unsigned char section;
+} dns_record_t;
+
+/* Query of one type, pre-encoded in wire order (big endian, flags as bytes):
+ * only the transaction id and the name are written for each query */
+typedef struct {
+  unsigned short qtype;
+  unsigned short edns;      // advertised UDP payload, 0 without EDNS
+  bool recurse;             // RD flag
+  char header[12];          // the id is left 0
+  char tail[4 + OPT_LEN];   // QTYPE, QCLASS, then the OPT record if edns
+  size_t tail_len;          // 0 for a template that wasn't set up
+} dns_template_t;
+
+/* Scratch memory of a message, reset for every new message */
+typedef struct {
+  size_t used;
+  char mem[ARENA_SIZE] __attribute__((aligned(8)));
+} dns_arena_t;
+
+/* Decoded name suffix, memoized by its offset in the message */
+typedef struct {
+  unsigned short offset;
+  unsigned char len;
+  char *str;                // in the arena, NULL for an empty slot
+} dns_name_memo_t;
+
+/* A parsed message: the header and an array of all its records, in order */
+typedef struct {
+  char *buf;
+  size_t len;
+  dns_header_t header;
+  dns_record_t *records;    // allocated from the arena
+  int nrecords;
+  dns_name_memo_t *memo;    // allocated from the arena on the first decoding
+  dns_arena_t arena;
+} dns_msg_t;
+
+/* A DNS server from CONF_FILE and its round trip time estimates (in usec) */
+typedef struct {
+  char addr[MAX_ADDR_LEN];
+  long long srtt;           // smoothed RTT, 0 if never measured
+  long long rttvar;         // RTT variation
+  long long rto;            // retransmit timeout
+  int timeouts;             // in a row since its last answer (not saved)
+} dns_server_t;
+
+/* Congestion window of a resolver to a server (AIMD): queries are only sent
+ * to it while fewer than cwnd are in flight, the others wait in a FIFO */
+typedef struct {
+  double cwnd;
+  double ssthresh;          // slow start (one more per answer) below it
+  int inflight;             // queries sent to it that are pending
+  int head, tail;           // slots of the queries waiting, -1 for none
+  long long cut;            // when cwnd was last cut, in now_usec time
+  long long answered;       // when it last answered, or was set up
+} dns_cwnd_t;
+
+/* Response cache entry, in the fixed layout of the memory-mapped CACHE_FILE.
+ * Readers check seq before and after copying an entry (odd while it is being
+ * written), writers are serialised with a lock on the file */
+typedef struct {
+  unsigned int seq;
+  unsigned int hash;        // hash of the key, 0 for an empty slot
+  long long stored;         // wall clock time the answer was stored at
+  long long expires;        // wall clock time the answer expires at
+  long long refreshing;     // wall clock time a refresh was started at
+  unsigned int hits;        // close to expiry, with half of the previous ones
+  unsigned short qtype;
+  unsigned short len;
+  char name[MAX_NAME_LEN];  // lowercased name, without the trailing dot
+  char msg[EDNS_PAYLOAD];   // answer in wire format
+} dns_cache_entry_t;
+
+typedef struct {
+  unsigned int magic;
+  unsigned int nslots;
+  unsigned int entry_size;  // changes to the layout invalidate the file
+  unsigned int reserved;
+} dns_cache_header_t;
+
+/* Bucket of the in-memory cache, a cache line. Readers check seq before and
+ * after copying an entry it points to (odd while the bucket is written) */
+typedef struct {
+  unsigned int seq;
+  unsigned int hashes[MEM_WAYS];   // of the keys, 0 for an empty way
+  unsigned int offsets[MEM_WAYS];  // of the entries in the arena
+} __attribute__((aligned(CACHE_LINE))) dns_mem_bucket_t;
+
+/* What readers update of an in-memory cache entry, away from its bucket so
+ * that they don't invalidate the line every reader of the bucket checks */
+typedef struct {
+  long long refreshing;     // wall clock time a refresh was started at
+  unsigned int hits;        // close to expiry, with half of the previous ones
+  bool ref;                 // asked for since the CLOCK hand passed it
+} dns_mem_meta_t;
+
+/* Entry of the TTL index of an in-memory cache shard */
+typedef struct {
+  long long expires;        // wall clock time, once no longer served stale
+  unsigned int bucket;
+  int way;
+} dns_mem_expiry_t;
+
+/* Shard of the in-memory cache, by key hash. The entries are appended to the
+ * arena, a ring whose tail a CLOCK hand reclaims, and found through the open
+ * addressing buckets. Readers take no lock, writers take that of the shard */
+typedef struct {
+  pthread_mutex_t lock;
+  dns_mem_bucket_t *buckets;
+  dns_mem_meta_t *meta;     // by bucket, then way
+  unsigned int nbuckets;
+  char *arena;
+  size_t arena_size;
+  size_t head, tail;        // bytes ever appended to and reclaimed from it
+  dns_mem_expiry_t *ttls;   // TTL index, a min-heap of the expiries
+  int nttls, ttls_cap;
+  unsigned long long entries, evicted, expired, moved;
+} __attribute__((aligned(CACHE_LINE))) dns_mem_shard_t;
+
+/* Response cache in memory, shared by the threads of a process */
+typedef struct {
+  dns_mem_shard_t shards[MEM_SHARDS];
+} dns_memcache_t;
+
+typedef struct {
+  dns_memcache_t *mem;      // used instead of the CACHE_FILE if not NULL
+  int fd;
+  size_t size;
+  dns_cache_header_t *header;
+  dns_cache_entry_t *entries;
+  int prefetch;             // percent of its TTL left when a hot answer is
+                            // refreshed, 0 never
+} dns_cache_t;
+
+/* Command line options */
+typedef struct {
+  char *bulk_file;          // bulk mode input, NULL for a single query
+  int window;
+  long long hedge;
+  bool cache;
+  int cache_mb;             // in-memory cache size, 0 for the CACHE_FILE
+  dns_memcache_t *memcache; // of cache_mb, shared by every resolver
+  int prefetch;             // percent of the TTL left to refresh hot answers
+  int edns;                 // advertised UDP payload, 0 without EDNS
+  int batch;                // datagrams per sendmmsg/recvmmsg call
+  int threads;              // bulk mode worker threads
+  int log_flush_ms;         // interval between log writes
+  bool log_drop;            // drop log records instead of waiting when full
+  bool log_binary;          // length-prefixed binary message log
+  char *stats_file;         // statistics export, NULL for none
+  enum output_format format;  // how answers are printed
+  char *sweep;              // ranges to sweep for PTR records, or NULL
+  int rate;                 // sweep queries per second, 0 for no limit
+  int stats_interval_ms;    // interval between stats writes in bulk mode
+  bool coalesce;            // identical queries in flight are sent once
+  int cwnd;                 // initial congestion window per server, 0 for
+                            // none
+  char *listen;             // daemon mode address, NULL for a client
+  char *replay;             // capture or message log to decode, or NULL
+  int log_sample;           // log one in log_sample queries, 0 for none,
+                            // -1 for the default of the mode
+  bool iterative;           // resolve from the root instead of the servers
+  char *root_hints;         // root servers for iterative mode, NULL for the
+                            // built-in ones
+} dns_options_t;
+
+/* Histogram in the style of HdrHistogram: values below STATS_SUB_BUCKETS are
+ * counted exactly, larger ones in STATS_SUB_BUCKETS buckets per power of two,
+ * so a value is known within 1/STATS_SUB_BUCKETS of itself */
+typedef struct {
+  unsigned long long counts[STATS_BUCKETS];
+  unsigned long long total, sum, max;
+} dns_hist_t;
+
+/* Statistics of the queries a resolver sent to a server. Only the thread of
+ * the resolver writes them, any thread may read them */
+typedef struct {
+  unsigned long long counters[STATS_COUNTERS];
+  dns_hist_t latency;       // usec from sending a query to its answer
+} dns_server_stats_t;
+
+typedef struct dns_resolver dns_resolver_t;
+typedef struct dns_query dns_query_t;
+
+/* Called once per submitted query, with the parsed answer (if any) */
+typedef void (*dns_callback_t)(dns_resolver_t *res, dns_query_t *query,
+                               enum error_status status, dns_msg_t *ans);
+
+/* A query in flight in the resolver */
+struct dns_query {
+  char name[MAX_NAME_LEN];  // queried name, without the trailing dot
+  enum query_type qtype;
+  unsigned short id;        // transaction id (host byte order)
+  char msg[BUFLEN];
+  size_t msg_len;
+  bool edns;                // whether msg carries an OPT record
+  bool recurse;             // RD flag, cleared for iterative resolution
+  bool refresh;             // refreshes a cached answer, no caller waits
+  int server;               // index of the server that answered
+  int next_server;          // position in order of the next server to send to
+  int order[MAX_IPS];       // servers by expected latency at submit time
+  int nservers;             // servers in order
+  long long sent[MAX_IPS];  // when the query was sent to each, by position
+  unsigned long long pending;  // positions sent to that haven't answered yet
+  unsigned long long tcp;   // positions asked over TCP after truncation
+  int sends;                // times it was sent, to any server
+  unsigned int gen;         // bumped when the slot is released, invalidates
+                            // its timers
+  enum error_status status;
+  bool in_use;
+  bool inflight;            // can be joined by identical queries
+  unsigned int key;         // hash of the lowercased name and type
+  int next_inflight;        // next query in flight in its bucket
+  int followers;            // first identical query waiting for this one
+  int next_follower;        // next one waiting for the same query
+  int wait_server;          // server whose window it waits for, or -1
+  int wait_prev, wait_next; // queries waiting for the same server
+  dns_callback_t callback;
+  void *data;               // caller data
+};
+
+/* TCP connection to a server, shared by every query that falls back to it.
+ * Queries are pipelined as length-prefixed messages (RFC 7766) */
+typedef struct {
+  int fd;                   // -1 when closed
+  bool connected, writing;  // writing: waiting for EPOLLOUT
+  char *out;                // queued messages not written yet
+  size_t out_len, out_cap;
+  char *in;                 // TCP_BUFLEN bytes of received data
+  size_t in_len, in_start;  // in_start: first byte not handled yet
+  int outstanding;          // messages sent that weren't answered yet
+  long long last_used;
+} dns_conn_t;
+
+/* Pending timeout, kept in a min-heap ordered by deadline */
+typedef struct {
+  long long deadline;
+  int slot;
+  unsigned int gen;
+  int server;               // position in the order of the query of the
+                            // server that timed out, or HEDGE(next one)
+  long long sent;           // when the query was sent to that server
+} dns_timer_t;
+
+/* Datagram waiting for the next sendmmsg */
+typedef struct {
+  int slot;
+  unsigned int gen;
+  int pos;                  // position of the server in the query order
+} dns_send_t;
+
+struct dns_resolver {
+  int sock, epfd;
+  dns_server_t **servers;   // valid servers, stats are updated in place:
+                            // nconf from the conf file, then the added ones
+  struct sockaddr_in *addrs;
+  dns_conn_t *conns;        // TCP connection to each server
+  dns_cwnd_t *cwnds;        // congestion window to each server
+  int cwnd_init;            // initial congestion window, 0 for none
+  int nwaiting;             // queries waiting for room in a window
+  bool admit;               // room was made since they were last tried
+  int nservers, nconf, servers_cap;
+  int order[MAX_IPS];       // conf servers sorted by expected latency
+  bool order_dirty;
+  dns_query_t *queries;     // window slots
+  int *free_slots;          // stack of the window - active unused slots
+  int window, active;
+  int *by_id;               // transaction id -> slot, or -1
+  unsigned int seed;
+  dns_timer_t *timers;
+  int ntimers, timers_cap;
+  long long hedge;          // usec before also trying the next server:
+                            // -1 sequential, 0 race all servers at once
+  dns_cache_t cache;
+  bool use_cache;
+  unsigned short edns;      // advertised UDP payload, 0 without EDNS
+  dns_template_t templates[RR_COUNT];  // by type index, set up on use
+  char buf[MAX_MSG_LEN];    // receive buffer
+  int batch;                // datagrams per sendmmsg/recvmmsg, 1 for one
+                            // sendto/recvfrom per datagram
+  struct mmsghdr *rx, *tx;
+  struct iovec *rx_iov, *tx_iov;
+  struct sockaddr_in *rx_addrs;
+  char *rx_bufs;            // batch receive buffers of MAX_MSG_LEN bytes,
+                            // reused by every recvmmsg
+  dns_send_t *tx_queue;     // datagrams to send, batch at most
+  int ntx;
+  dns_msg_t msg;            // the answer being handled
+  char cache_buf[MAX_MSG_LEN];  // cached answer handed over on submission,
+  dns_msg_t cache_msg;      // apart from msg, which followers still wait for
+                            // while the callbacks submit queries
+  dns_server_stats_t *stats;  // per server, in the order of servers
+  dns_hist_t parse_time;    // nsec to parse an answer
+  bool coalesce;            // identical queries wait for the one in flight
+  int *inflight;            // hash buckets of the coalescing queries in
+  unsigned int inflight_mask;  // flight, chained through their slots
+  unsigned long long counters[RES_COUNTERS];
+};
+
+/* Delegation cache entry: the nameservers a zone was delegated to */
+typedef struct {
+  char name[MAX_NAME_LEN];  // lowercased zone, without the trailing dot
+  long long expires;        // in now_usec time, 0 for an empty slot
+  int servers[MAX_IPS];     // indices in the resolver
+  int nservers;
+} dns_zone_t;
+
+typedef struct dns_iter dns_iter_t;
+typedef struct dns_lookup dns_lookup_t;
+
+/* Name being resolved iteratively, with one query at a time going down from
+ * the closest known zone */
+struct dns_lookup {
+  dns_iter_t *iter;
+  char name[MAX_NAME_LEN];  // lowercased, the target of the last alias
+  enum query_type qtype;
+  char zone[MAX_NAME_LEN];  // zone of the servers being asked
+  int servers[MAX_IPS], nservers;
+  char ns_names[MAX_IPS][MAX_NAME_LEN];  // nameservers of the last referral
+  int nns, next_ns;         // next_ns: next one to look up without glue
+  unsigned int ttl;         // of the last referral
+  int hops, cnames, depth;  // depth: of nameserver lookups
+  dns_lookup_t *parent;     // waiting for the address of its nameserver
+  dns_lookup_t *next;       // waiting for a free slot in the resolver
+  dns_callback_t callback;
+  void *data;
+};
+
+/* Iterative resolution on a resolver, starting from the root hints */
+struct dns_iter {
+  dns_resolver_t *res;
+  dns_zone_t *zones;        // delegation cache, ZONE_SLOTS entries
+  int roots[MAX_IPS], nroots;
+  unsigned short port;      // of the root hints, used for every nameserver
+  unsigned int *addr_keys;  // nameserver address -> index in the resolver,
+  int *addr_servers;        // in open addressing (0 for an empty slot)
+  int naddrs, addrs_cap;
+  dns_lookup_t *waiting, *waiting_tail;
+  int active;               // lookups submitted and not finished
+  unsigned long long lookups, hops, referrals, zone_hits;
+};
+
+/* Name waiting for a worker thread */
+typedef struct {
+  char name[MAX_NAME_LEN];
+  enum query_type qtype;
+} dns_pool_item_t;
+
+typedef struct dns_pool dns_pool_t;
+
+/* Worker thread of a pool, with its own resolver (socket, queries in flight,
+ * buffers) and copy of the server estimates, so workers share nothing. Names
+ * come through a single producer, single consumer ring */
+typedef struct {
+  dns_pool_t *pool;
+  pthread_t thread;
+  int cpu;
+  dns_resolver_t res;
+  dns_server_t *servers;
+  int evfd;                 // eventfd waking the worker for new names
+  bool sleeping;            // waiting for events, new names must wake it
+  bool started;
+  unsigned long head __attribute__((aligned(64)));  // next to push
+  unsigned long tail __attribute__((aligned(64)));  // next to pop
+  dns_pool_item_t queue[POOL_QUEUE];
+} dns_worker_t;
+
+struct dns_pool {
+  dns_worker_t *workers;
+  int nworkers;
+  dns_server_t *servers;    // estimates merged back when the pool finishes
+  int nservers;
+  dns_options_t *opts;
+  dns_callback_t callback;
+  bool eof;                 // no more names will be submitted
+};
+
 // dnsutils.c
-char **get_conf_data(int *conf_size);
+dns_server_t *get_conf_data(int *conf_size);
+enum rr_index rr_index(unsigned short type);
+const char *rr_type_name(unsigned short type);
 enum query_type get_query_type(char *type);
 enum domain_type get_domain_type(char *type);
-dns_header_t init_header();
+char *check_query(enum domain_type domain_t, enum query_type query);
+dns_header_t init_header(unsigned short id);
 dns_question_t init_question(unsigned short qtype);
 char* toQNAME(char *name);
 dns_header_t get_header(char *buf);
 void get_qtype_string(char *type, unsigned short qtype);
 void get_qclass_string(char *class, unsigned short qclass);
-int decompress_string(char *src, char *dest, int offset);
 dns_question_t get_question(char *buf);
-dns_rr_t get_rr(char *buf);
-char *get_rdata(char *buf, dns_rr_t rr, int offset);
+size_t build_query(char *msg, char *domain, unsigned short qtype,
+                   unsigned short id, unsigned short edns);
+long long now_usec();
+long long now_nsec();
+bool parse_server_addr(char *addr, struct sockaddr_in *sa);
 
-// parseutils.c
+// wire.c
+unsigned short get16(char *p);
+unsigned int get32(char *p);
+void put16(char *p, unsigned short v);
+void put32(char *p, unsigned int v);
+int encode_name(char *wire, char *name);
+void query_template(dns_template_t *t, unsigned short qtype,
+                    unsigned short edns, bool recurse);
+size_t template_query(dns_template_t *t, char *msg, char *name,
+                      unsigned short id);
+void *arena_alloc(dns_arena_t *arena, size_t size);
+void arena_reset(dns_arena_t *arena);
+int skip_name(char *buf, size_t len, int offset);
+int msg_name(dns_msg_t *msg, int offset, char *dest);
+bool msg_name_equal(dns_msg_t *msg, int offset, char *name);
+bool parse_msg(dns_msg_t *msg, char *buf, size_t len);
+dns_record_t *msg_section(dns_msg_t *msg, enum section section, int *count);
+dns_record_t *msg_opt(dns_msg_t *msg);
+
+// log.c
+bool log_init(dns_options_t *opts);
+void log_write(int file, char *data, size_t len);
 void log_msg(char *msg, size_t len);
-dns_header_t parse_answer(char *ans, char *server);
+bool log_sampled();
+void log_close();
+
+// parseutils.c
+void print_set_output(FILE *f);
+FILE *output();
+dns_header_t print_answer(dns_msg_t *msg, char *server);
 void print_header(dns_header_t header);
 
+// output.c
+void format_rdata(dns_msg_t *msg, dns_record_t *rr, char *dest, size_t size);
+void print_json(dns_query_t *query, enum error_status status, dns_msg_t *ans,
+                char *server);
+void print_binary(dns_query_t *query, enum error_status status,
+                  dns_msg_t *ans);
+
+// servers.c
+void server_rtt_sample(dns_server_t *server, long long rtt);
+void server_timeout(dns_server_t *server, long long waited);
+void cwnd_init(dns_cwnd_t *cw, int cwnd);
+void cwnd_grow(dns_cwnd_t *cw, int max);
+bool cwnd_cut(dns_cwnd_t *cw, long long sent, long long now);
+void load_server_state(dns_server_t *servers, int n);
+void save_server_state(dns_server_t *servers, int n);
+void merge_server_state(dns_server_t *servers, dns_server_t **copies,
+                        int ncopies, int n);
+
+// resolver.c
+bool resolver_init(dns_resolver_t *res, dns_server_t *servers, int nservers,
+                   int window);
+int resolver_submit(dns_resolver_t *res, char *name, enum query_type qtype,
+                    dns_callback_t callback, void *data);
+int resolver_add_server(dns_resolver_t *res, char *addr);
+int resolver_submit_to(dns_resolver_t *res, char *name, enum query_type qtype,
+                       int *servers, int n, bool recurse,
+                       dns_callback_t callback, void *data);
+int resolver_fd(dns_resolver_t *res);
+int resolver_timeout(dns_resolver_t *res);
+int resolver_process(dns_resolver_t *res, int timeout_ms);
+bool resolver_set_options(dns_resolver_t *res, dns_options_t *opts);
+char *resolver_server_name(dns_resolver_t *res, dns_query_t *query);
+void resolver_free(dns_resolver_t *res);
+
+// iterate.c
+bool iter_init(dns_iter_t *iter, dns_resolver_t *res, char *file);
+bool iter_submit(dns_iter_t *iter, char *name, enum query_type qtype,
+                 dns_callback_t callback, void *data);
+int iter_process(dns_iter_t *iter, int timeout_ms);
+void iter_summary(dns_iter_t *iter);
+void iter_free(dns_iter_t *iter);
+
+// pool.c
+bool pool_start(dns_pool_t *pool, dns_server_t *servers, int nservers,
+                dns_options_t *opts, dns_callback_t callback);
+void pool_submit(dns_pool_t *pool, char *name, enum query_type qtype);
+bool pool_write_stats(dns_pool_t *pool, char *path);
+void pool_finish(dns_pool_t *pool);
+
+// stats.c
+void stats_add(unsigned long long *counter, unsigned long long n);
+void hist_record(dns_hist_t *hist, unsigned long long value);
+bool stats_write(char *path, dns_resolver_t **res, int n);
+
+// tcp.c
+bool tcp_send(dns_conn_t *conn, int epfd, struct sockaddr_in *addr, char *msg,
+              size_t len);
+bool tcp_flush(dns_conn_t *conn, int epfd);
+int tcp_read(dns_conn_t *conn);
+char *tcp_next_msg(dns_conn_t *conn, size_t *len);
+void tcp_close(dns_conn_t *conn);
+
+// cache.c
+bool cache_open(dns_cache_t *cache);
+bool cache_lookup(dns_cache_t *cache, char *name, unsigned short qtype,
+                  char *buf, dns_msg_t *msg, bool *refresh);
+bool cache_lookup_stale(dns_cache_t *cache, char *name, unsigned short qtype,
+                        char *buf, dns_msg_t *msg, bool *refresh);
+void cache_store(dns_cache_t *cache, char *name, unsigned short qtype,
+                 dns_msg_t *ans);
+void cache_close(dns_cache_t *cache);
+
+// memcache.c
+dns_memcache_t *memcache_create(size_t size);
+bool memcache_get(dns_memcache_t *mc, char *key, unsigned int hash,
+                  unsigned short qtype, long long valid_after, char *msg,
+                  size_t *len, long long *stored, long long *expires,
+                  unsigned int **hits, long long **refreshing);
+void memcache_put(dns_memcache_t *mc, char *key, unsigned int hash,
+                  unsigned short qtype, char *msg, size_t len, long long now,
+                  long long expires);
+void memcache_summary(dns_memcache_t *mc);
+void memcache_free(dns_memcache_t *mc);
+
+// bulk.c
+void bulk_done(dns_resolver_t *res, dns_query_t *query,
+               enum error_status status, dns_msg_t *ans);
+void bulk_output(dns_options_t *opts);
+void run_bulk(dns_options_t *opts);
+
+// sweep.c
+void run_sweep(dns_options_t *opts);
+
+// daemon.c
+void run_daemon(dns_options_t *opts);
+
+// replay.c
+void run_replay(dns_options_t *opts);
+
 
 static inline void error(char *msg) {
   fprintf(stderr, "%s", msg);
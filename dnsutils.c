@@ -29,31 +29,34 @@ ssize_t readline(int sockd, void *vptr, size_t maxlen) {
   return n;
 }
 
-// Extract configuration data from the CONF_FILE, returning
-// a vector of server addresses of size conf_size
-char **get_conf_data(int *conf_size) {
+// Extract configuration data from the CONF_FILE, returning a vector of
+// servers of size conf_size, with the RTT estimates saved in STATE_FILE, or
+// NULL if the file can't be read
+dns_server_t *get_conf_data(int *conf_size) {
   char buf[BUFLEN];
   int fd = open(CONF_FILE, O_RDONLY);
+  if (fd < 0)
+    return NULL;
 
-  char **data = calloc(MAX_IPS, sizeof(char *));
-
-  if (fd < 0) {
-    fprintf(stderr, "Failed to open conf file!\n");
-    exit(0);
+  dns_server_t *data = calloc(MAX_IPS, sizeof(dns_server_t));
+  if (data == NULL) {
+    close(fd);
+    return NULL;
   }
 
   int i = 0;
-  while (readline(fd, buf, BUFLEN)) {
-    if (buf[0] != '#') {
-      data[i] = calloc(BUFLEN, sizeof(char));
-      strcpy(data[i], buf);
+  while (i < MAX_IPS && readline(fd, buf, BUFLEN)) {
+    if (buf[0] != '#' && buf[0] != 0) {
+      snprintf(data[i].addr, MAX_ADDR_LEN, "%.*s", MAX_ADDR_LEN - 1, buf);
+      data[i].rto = MAX_RTO_USEC;
       i++;
     }
   }
 
-  *conf_size = i - 1;
+  *conf_size = i;
 
   close(fd);
+  load_server_state(data, i);
   return data;
 }
 
@@ -76,7 +79,63 @@ enum domain_type get_domain_type(char *type) {
   return NAME;
 }
 
-// Get the query type value from a string
+#define RR_NAME_SLOTS 64  /* hash table of the type names, a power of two */
+
+static const char *rr_names[RR_COUNT] = {
+#define RR_NAME(name, value, formatter) [RR_##name] = #name,
+  RR_TYPES(RR_NAME)
+#undef RR_NAME
+};
+static const unsigned short rr_values[RR_COUNT] = {
+#define RR_VALUE(name, value, formatter) [RR_##name] = value,
+  RR_TYPES(RR_VALUE)
+#undef RR_VALUE
+};
+// Index of every type value, 0 (RR_GENERIC) for those without a name
+static const unsigned char rr_by_value[RR_TYPE_LIMIT] = {
+#define RR_BY_VALUE(name, value, formatter) [value] = RR_##name,
+  RR_TYPES(RR_BY_VALUE)
+#undef RR_BY_VALUE
+};
+// Index of every type name, by rr_name_hash, 0 for empty slots
+static unsigned char rr_by_name[RR_NAME_SLOTS];
+
+_Static_assert(RR_COUNT <= 256 && 2 * RR_COUNT <= RR_NAME_SLOTS,
+               "too many record types for their tables");
+
+// Hash an upper case type name (FNV-1a)
+static unsigned int rr_name_hash(const char *name) {
+  unsigned int hash = 2166136261u;
+  for (; *name; name++)
+    hash = (hash ^ (unsigned char) *name) * 16777619u;
+  return hash;
+}
+
+// Fill the hash table of the type names, before main runs so that lookups
+// don't need a lock
+__attribute__((constructor)) static void rr_init_names() {
+  for (int i = RR_GENERIC + 1; i < RR_COUNT; i++) {
+    unsigned int slot = rr_name_hash(rr_names[i]);
+    while (rr_by_name[slot % RR_NAME_SLOTS])
+      slot++;
+    rr_by_name[slot % RR_NAME_SLOTS] = (unsigned char) i;
+  }
+}
+
+// Get the index of a type in the tables of types, RR_GENERIC if it has no name
+enum rr_index rr_index(unsigned short type) {
+  return type < RR_TYPE_LIMIT ? (enum rr_index) rr_by_value[type]
+                              : RR_GENERIC;
+}
+
+// Get the name of a type, or NULL if it has none
+const char *rr_type_name(unsigned short type) {
+  return rr_names[rr_index(type)];
+}
+
+// Get the query type value from a string: the name of a type, or TYPEnnn for
+// any other (RFC 3597). Return NONE if it isn't one of those, or OPT, which is
+// only a pseudo-record
 enum query_type get_query_type(char *type) {
   int i = 0;
   while (type[i]) {
@@ -84,43 +143,27 @@ enum query_type get_query_type(char *type) {
     i++;
   }
 
-  if (strcmp(type, "A") == 0)  // Host Address
-    return A;
-  else if (strcmp(type, "MX") == 0) // Mail Exchange
-    return MX;
-  else if (strcmp(type, "NS") == 0) // Authoritative Name Server
-    return NS;
-  else if (strcmp(type, "CNAME") == 0) // Canonical name for alias
-    return CNAME;
-  else if (strcmp(type, "SOA") == 0) // Start of Zone of Authority
-    return SOA;
-  else if (strcmp(type, "TXT") == 0) // Text strings
-    return TXT;
-  else if (strcmp(type, "PTR") == 0) // Domain Name Pointer
-    return PTR;
-  else
+  unsigned int slot = rr_name_hash(type);
+  for (int index; (index = rr_by_name[slot % RR_NAME_SLOTS]); slot++) {
+    if (strcmp(rr_names[index], type) == 0)
+      return index == RR_OPT ? NONE : (enum query_type) rr_values[index];
+  }
+
+  char *end;
+  if (strncmp(type, "TYPE", 4) != 0 || !isdigit((unsigned char) type[4]))
     return NONE;
+  unsigned long value = strtoul(type + 4, &end, 10);
+  return *end || value == 0 || value > 65535 || value == OPT
+      ? NONE : (enum query_type) value;
 }
 
 // Get query type string from value (the reverse of get_query_type)
 void get_qtype_string(char *type, unsigned short qtype) {
-  switch (qtype) {
-    case A: strcpy(type, "A");
-      break;
-    case MX: strcpy(type, "MX");
-      break;
-    case NS: strcpy(type, "NS");
-      break;
-    case CNAME: strcpy(type, "CNAME");
-      break;
-    case SOA: strcpy(type, "SOA");
-      break;
-    case TXT: strcpy(type, "TXT");
-      break;
-    case PTR: strcpy(type, "PTR");
-      break;
-    default: strcpy(type, "UNDEFINED");
-  }
+  const char *name = rr_type_name(qtype);
+  if (name)
+    strcpy(type, name);
+  else
+    sprintf(type, "TYPE%hu", qtype);
 }
 
 // Get query class string from value (only one possible value, but implemented
@@ -133,11 +176,26 @@ void get_qclass_string(char *class, unsigned short qclass) {
   }
 }
 
-// Initialise a dns_header_t
-dns_header_t init_header() {
+// Check that a query type can be used with the given domain type, returning
+// an error message if it can't
+char *check_query(enum domain_type domain_t, enum query_type query) {
+  if (domain_t == -1)
+    return "Please enter a valid IP or domain name!\n";
+  if (query == -1)
+    return "Please enter a valid query type!\n";
+
+  if (query == TXT && domain_t != NAME)
+    return "The TXT query requires a domain name\n";
+  if (query == PTR && domain_t != IP)
+    return "The PTR query requires an IP\n";
+  return NULL;
+}
+
+// Initialise a dns_header_t with the given transaction id
+dns_header_t init_header(unsigned short id) {
   dns_header_t header;
   memset(&header, 0, sizeof(header));
-  header.id = htons((uint16_t) getpid());  // using process id as transaction id
+  header.id = htons(id);
   header.rd = 1;
   header.qdcount = htons(1);
   return header;
@@ -173,57 +231,47 @@ dns_question_t get_question(char *buf) {
   return question;
 }
 
-// Extract resource records from address
-dns_rr_t get_rr(char *buf) {
-  dns_rr_t rr;
-  memcpy(&rr, buf, sizeof(dns_rr_t));
-
-  rr.type = ntohs(rr.type);
-  rr.class = ntohs(rr.class);
-  rr.ttl = ntohl(rr.ttl);
-  rr.rdlength = ntohs(rr.rdlength);
-
-  return rr;
+// Write a query for domain into msg, returning the length of the message. If
+// edns is set, an OPT record advertises it as the UDP payload size (RFC 6891)
+size_t build_query(char *msg, char *domain, unsigned short qtype,
+                   unsigned short id, unsigned short edns) {
+  dns_header_t header = init_header(id);
+  if (edns)
+    header.arcount = htons(1);
+  char *qname = toQNAME(domain);
+  dns_question_t question = init_question(qtype);
+
+  size_t header_len = sizeof(header),
+      qname_len = strlen(qname) + 1,
+      question_len = sizeof(question);
+  memcpy(msg, &header, header_len);
+  memcpy(msg + header_len, qname, qname_len);
+  memcpy(msg + header_len + qname_len, &question, question_len);
+
+  free(qname);
+  size_t len = header_len + qname_len + question_len;
+  if (edns == 0)
+    return len;
+
+  // Root name, type, payload size as class, zero extended RCODE, version,
+  // flags (as TTL) and no options
+  char opt[OPT_LEN] = {0, 0, OPT, (char) (edns >> 8), (char) edns};
+  memcpy(msg + len, opt, OPT_LEN);
+  return len + OPT_LEN;
 }
 
-// Extract rdata from address buf + offset using information from rr
-char *get_rdata(char *buf, dns_rr_t rr, int offset) {
-  char *rdata = calloc(MAX_RDATA_LEN, sizeof(char));
-  char str[MAX_NAME_LEN];
-  unsigned int nr;
-
-  switch (rr.type) {
-    case A:
-      sprintf(rdata,
-              "%hhu.%hhu.%hhu.%hhu",
-              *(buf + offset),
-              *(buf + offset + 1),
-              *(buf + offset + 2),
-              *(buf + offset + 3));
-      break;
-    case NS:
-    case PTR:
-    case CNAME: decompress_string(buf, rdata, offset);
-      break;
-    case MX: decompress_string(buf, str, offset + 2);
-      sprintf(rdata, "%hhu %s", *(buf + offset + 1), str);
-      break;
-    case SOA: offset += decompress_string(buf, rdata, offset);
-      size_t len = strlen(rdata);
-      rdata[len] = ' ';
-      offset += decompress_string(buf, rdata + len + 1, offset);
-      for (int i = 0; i < 5; i++) {
-        memcpy(&nr, buf + offset, 4);
-        sprintf(rdata, "%s %d", rdata, ntohl(nr));
-        offset += 4;
-      }
-      break;
-    case TXT: memcpy(rdata, buf + offset, rr.rdlength);
-      break;
-    default:sprintf(rdata, "UNDEFINED");
-  }
+// Get the current monotonic time in microseconds
+long long now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
 
-  return rdata;
+// Get the current monotonic time in nanoseconds
+long long now_nsec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 // Convert a string to the QNAME format
@@ -245,39 +293,21 @@ char *toQNAME(char *name) {
   return qname;
 }
 
-// Check if the first two bits of a 16-bit sequence are set
-bool is_pointer(unsigned short sequence) {
-  // if the first two bits are 1 => sequence >> 14 == 0x11 = 3
-  return (sequence >> 14u) == 3;
+// Parse a server address, "a.b.c.d" or "a.b.c.d:port" (port 53 by default),
+// into sa. Return false if it isn't valid
+bool parse_server_addr(char *addr, struct sockaddr_in *sa) {
+  char host[MAX_ADDR_LEN];
+  unsigned int port = 53;
+  char *colon = strchr(addr, ':');
+
+  snprintf(host, MAX_ADDR_LEN, "%.*s",
+           colon ? (int) (colon - addr) : MAX_ADDR_LEN - 1, addr);
+  if (colon && (sscanf(colon + 1, "%u", &port) != 1 || port == 0
+                || port > 65535))
+    return false;
+
+  memset(sa, 0, sizeof(*sa));
+  sa->sin_family = AF_INET;
+  sa->sin_port = htons((unsigned short) port);
+  return inet_aton(host, &sa->sin_addr) != 0;
 }
-
-// Decompress a compressed message section at src + offset, knowing that src is
-// the beginning of the whole message and writing result to dest
-// Return value is the length of the data that was decompressed
-int decompress_string(char *src, char *dest, int offset) {
-  int i = offset;
-  size_t dest_len = 0;
-  unsigned short sequence;
-  while (src[i]) {
-    memcpy(&sequence, src + i, 2);
-    sequence = ntohs(sequence);
-
-    if (is_pointer(sequence)) {
-      int new_offset = sequence & (unsigned) 0xFFF;  // clearing first two bits
-      decompress_string(src, dest + dest_len, new_offset);
-      i += 2;
-      return i - offset;
-    } else {  // sequence is a label
-      for (int j = 0; j < src[i]; j++)
-        dest[dest_len++] = src[i + j + 1];
-      dest[dest_len++] = '.';
-      i += src[i] + 1;
-      if (!src[i]) {
-        dest[dest_len] = 0;
-        i++;
-        return i - offset;
-      }
-    }
-  }
-  return i - offset;
-}
\ No newline at end of file
@@ -0,0 +1,528 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define FAKE_CONNS 64     // TCP clients served at once
+#define FAKE_QUEUE 4096   // answers waiting for their delay
+#define FAKE_TTL 300      // default TTL of every record
+#define FAKE_DELEGATIONS 16
+#define FAKE_NS 4         // nameservers per delegation
+
+/* Answer to be sent once its delay has passed */
+typedef struct {
+  long long due;
+  int fd;                   // UDP socket or TCP connection, -1 if it closed
+  bool tcp;
+  struct sockaddr_in addr;
+  size_t len;
+  char msg[2 + BUFLEN];     // room for the TCP length prefix
+} fake_reply_t;
+
+/* Child zone delegated to other servers, with glue for the ones given by
+ * address */
+typedef struct {
+  char zone[MAX_NAME_LEN];
+  char ns[FAKE_NS][MAX_NAME_LEN];  // nameserver names
+  struct in_addr glue[FAKE_NS];    // their addresses, 0 for glueless ones
+  int nns;
+} fake_delegation_t;
+
+/* TCP client, sending length-prefixed queries */
+typedef struct {
+  int fd;                   // -1 for a free slot
+  char in[2 + BUFLEN];
+  size_t in_len;
+} fake_conn_t;
+
+static long long delay_usec;
+static double loss, truncation;
+static double rate;       // UDP queries answered per second, 0 for no limit
+static double tokens;     // of the rate limit bucket
+static long long tokens_at;
+static unsigned int seed = 1;
+static fake_reply_t queue[FAKE_QUEUE];
+static int queue_head, queue_len;
+static fake_conn_t conns[FAKE_CONNS];
+static char *zone;        // authoritative zone, NULL to answer everything
+static fake_delegation_t delegations[FAKE_DELEGATIONS];
+static int ndelegations;
+static char a_rdata[8] = "\12\0\0\1\12\0\0\2";  // A answers
+static int a_count = 2;
+static unsigned int ttl = FAKE_TTL;
+
+// Whether an event of the given probability happens
+static bool chance(double p) {
+  return p > 0 && rand_r(&seed) < p * ((double) RAND_MAX + 1);
+}
+
+// Whether a UDP query is within the rate limit, the way response rate
+// limiting drops the rest: a token bucket holding a tenth of a second of them
+static bool within_rate() {
+  if (rate <= 0)
+    return true;
+  long long now = now_usec();
+  tokens += (now - tokens_at) * rate / 1e6;
+  tokens_at = now;
+  if (tokens > rate / 10)
+    tokens = rate / 10;
+  if (tokens < 1)
+    return false;
+  tokens--;
+  return true;
+}
+
+// Append a resource record owned by the name in wire format at owner. Return
+// the position after it
+static char *put_record(char *p, char *owner, size_t owner_len,
+                        unsigned short type, char *rdata, size_t len) {
+  memcpy(p, owner, owner_len);
+  p += owner_len;
+  put16(p, type);
+  put16(p + 2, 1);  // IN
+  put32(p + 4, ttl);
+  put16(p + 8, (unsigned short) len);
+  memcpy(p + 10, rdata, len);
+  return p + 10 + len;
+}
+
+// Append a resource record owned by the question name (compressed to offset
+// 12) at p. Return the position after it
+static char *put_rr(char *p, unsigned short type, char *rdata, size_t len) {
+  return put_record(p, "\xC0\x0C", 2, type, rdata, len);
+}
+
+// Write the dotted name into wire at wire, returning its length
+static size_t wire_name(char *name, char *wire) {
+  char *qname = toQNAME(name);
+  size_t len = strlen(qname) + 1;
+  memcpy(wire, qname, len);
+  free(qname);
+  return len;
+}
+
+// Write the question name at q + offset in dotted form, without the trailing
+// dot ("" for the root)
+static void question_name(char *q, int offset, char *name) {
+  int len = 0;
+  for (unsigned char c; (c = (unsigned char) q[offset]); offset += c + 1) {
+    if (len)
+      name[len++] = '.';
+    memcpy(name + len, q + offset + 1, c);
+    len += c;
+  }
+  name[len] = 0;
+}
+
+// Whether name is zone or under it ("" or "." being the root)
+static bool in_zone(char *name, char *zone) {
+  size_t len = strlen(name), zone_len = strlen(zone);
+  if (zone_len == 0 || strcmp(zone, ".") == 0)
+    return true;
+  return len >= zone_len && strcasecmp(name + len - zone_len, zone) == 0
+      && (len == zone_len || name[len - zone_len - 1] == '.');
+}
+
+// Find the deepest delegation name is at or under, or NULL
+static fake_delegation_t *find_delegation(char *name) {
+  fake_delegation_t *found = NULL;
+  for (int i = 0; i < ndelegations; i++)
+    if (in_zone(name, delegations[i].zone)
+        && (!found || strlen(delegations[i].zone) > strlen(found->zone)))
+      found = &delegations[i];
+  return found;
+}
+
+// Append the referral to delegation d at p: its NS records in the authority
+// section and the glue in the additional section, counted in ns and ar
+static char *put_referral(char *p, fake_delegation_t *d, int *ns, int *ar) {
+  char owner[MAX_NAME_LEN + 1], target[MAX_NAME_LEN + 1];
+  size_t owner_len = wire_name(d->zone, owner);
+
+  for (int i = 0; i < d->nns; i++) {
+    size_t len = wire_name(d->ns[i], target);
+    p = put_record(p, owner, owner_len, NS, target, len);
+  }
+  *ns = d->nns;
+  for (int i = 0; i < d->nns; i++) {
+    if (d->glue[i].s_addr == 0)
+      continue;
+    size_t len = wire_name(d->ns[i], target);
+    p = put_record(p, target, len, A, (char *) &d->glue[i], 4);
+    ++*ar;
+  }
+  return p;
+}
+
+// Parse a "zone=ns[,ns...]" delegation, where each nameserver is an address
+// (named nsN.zone, with glue) or a name (without glue). Return false if it
+// is invalid
+static bool parse_delegation(char *arg, fake_delegation_t *d) {
+  char *eq = strchr(arg, '='), *save;
+  if (eq == NULL || eq == arg || eq - arg >= MAX_NAME_LEN)
+    return false;
+
+  snprintf(d->zone, MAX_NAME_LEN, "%.*s", (int) (eq - arg), arg);
+  d->nns = 0;
+  for (char *ns = strtok_r(eq + 1, ",", &save); ns;
+       ns = strtok_r(NULL, ",", &save)) {
+    if (d->nns == FAKE_NS || strlen(ns) + strlen(d->zone) + 6 > MAX_NAME_LEN)
+      return false;
+    if (inet_pton(AF_INET, ns, &d->glue[d->nns]) == 1) {
+      sprintf(d->ns[d->nns], "ns%d.%s", d->nns + 1, d->zone);
+    } else {
+      d->glue[d->nns].s_addr = 0;
+      strcpy(d->ns[d->nns], ns);
+    }
+    d->nns++;
+  }
+  return d->nns > 0;
+}
+
+// Append the SOA of the zone (the question name) at p
+static char *put_soa(char *p) {
+  char soa[] = "\3ns1\xC0\x0C\12hostmaster\xC0\x0C"
+      "\0\0\7\xE2" "\0\0\x1C\x20" "\0\0\3\x84" "\0\1\x51\x80" "\0\0\1\x2C";
+  return put_rr(p, SOA, soa, sizeof(soa) - 1);
+}
+
+// Whether the reverse name at q + offset doesn't exist, to exercise sweeps:
+// nothing exists under a.b.c.0/24 when c >= 128, nor odd addresses
+static bool reverse_nxdomain(char *q, int offset) {
+  int octets[4], n = 0;
+  char label[64];
+
+  for (unsigned char c; (c = (unsigned char) q[offset]); offset += c + 1) {
+    memcpy(label, q + offset + 1, c);
+    label[c] = 0;
+    if (strcasecmp(label, "in-addr") == 0)
+      break;
+    if (n == 4)
+      return false;
+    octets[n++] = atoi(label);
+  }
+  if (q[offset] == 0)
+    return false;  // not a reverse name
+
+  // The octets come last first
+  return (n >= 3 && octets[n - 3] >= 128) || (n == 4 && octets[0] % 2);
+}
+
+// Build the canned answer to the query of length len into ans (of BUFLEN
+// bytes). Names starting with "nx" don't exist (see reverse_nxdomain for
+// reverse names), and those starting with "tc" (or a share of the others,
+// with -t) are truncated over UDP. With a zone, names outside it are refused,
+// names under a delegation get a referral, and the rest authoritative
+// answers. Return the length of the answer, or 0 to ignore a malformed query
+static size_t build_answer(char *q, size_t len, char *ans, bool tcp) {
+  int end = len > sizeof(dns_header_t)
+      ? skip_name(q, len, sizeof(dns_header_t)) : -1;
+  if (end < 0 || (size_t) end + 4 > len || end + 4 > BUFLEN / 2
+      || (q[2] & 0x80))
+    return 0;
+
+  unsigned short qtype = get16(q + end);
+  char *label = q + sizeof(dns_header_t) + 1;
+  bool nx = (q[sizeof(dns_header_t)] >= 2 && strncasecmp(label, "nx", 2) == 0)
+      || reverse_nxdomain(q, sizeof(dns_header_t));
+  bool tc = !tcp && ((q[sizeof(dns_header_t)] >= 2
+      && strncasecmp(label, "tc", 2) == 0) || chance(truncation));
+
+  // Authoritative servers don't recurse
+  char name[MAX_NAME_LEN];
+  question_name(q, sizeof(dns_header_t), name);
+  fake_delegation_t *referral = zone ? find_delegation(name) : NULL;
+  bool refused = zone && !in_zone(name, zone);
+  unsigned short flags = zone ? (referral || refused ? 0x8000 : 0x8400)
+      : 0x8080;
+  nx = nx && !refused && !referral;
+
+  // Header and question, then the records
+  memcpy(ans, q, end + 4);
+  put16(ans + 2, (unsigned short) (flags | (q[2] & 1) << 8
+                                   | (refused ? 5 : nx ? 3 : 0)));
+  put16(ans + 4, 1);
+  memset(ans + 6, 0, 6);
+  char *p = ans + end + 4;
+  int an = 0, ns = 0, ar = 0;
+
+  if (tc) {
+    ans[2] |= 2;
+  } else if (referral) {
+    p = put_referral(p, referral, &ns, &ar);
+  } else if (nx) {
+    p = put_soa(p);
+    ns = 1;
+  } else if (!refused) {
+    switch (qtype) {
+      case A:
+        for (an = 0; an < a_count; an++)
+          p = put_rr(p, A, a_rdata + 4 * an, 4);
+        break;
+      case NS:
+        p = put_rr(p, NS, "\3ns1\xC0\x0C", 6);
+        p = put_rr(p, NS, "\3ns2\xC0\x0C", 6);
+        an = 2;
+        break;
+      case CNAME:
+        p = put_rr(p, CNAME, "\3www\7example\3com\0", 17);
+        an = 1;
+        break;
+      case MX:
+        p = put_rr(p, MX, "\0\12\4mail\xC0\x0C", 9);
+        p = put_rr(p, MX, "\0\24\5mail2\xC0\x0C", 10);
+        an = 2;
+        break;
+      case SOA:
+        p = put_soa(p);
+        an = 1;
+        break;
+      case TXT:
+        p = put_rr(p, TXT, "\13v=spf1 -all", 12);
+        an = 1;
+        break;
+      case PTR:
+        p = put_rr(p, PTR, "\4host\7example\3com\0", 18);
+        an = 1;
+        break;
+      case AAAA:
+        p = put_rr(p, AAAA, "\x20\x01\x0d\xb8\0\0\0\0"
+                   "\0\0\0\0\0\0\0\1", 16);  // 2001:db8::1
+        an = 1;
+        break;
+      case SRV:
+        p = put_rr(p, SRV, "\0\12\0\5\0\x35\3ns1\xC0\x0C", 12);
+        an = 1;
+        break;
+      case DS:
+        p = put_rr(p, DS, "\x30\x39\15\2\x01\x23\x45\x67", 8);
+        an = 1;
+        break;
+      case CAA:
+        p = put_rr(p, CAA, "\0\5issueexample.net", 18);
+        an = 1;
+        break;
+      default:  // no data, with the SOA for negative caching
+        p = put_soa(p);
+        ns = 1;
+    }
+  }
+  put16(ans + 6, (unsigned short) an);
+  put16(ans + 8, (unsigned short) ns);
+  put16(ans + 10, (unsigned short) ar);
+  return p - ans;
+}
+
+// Send an answer now. TCP answers are dropped, along with the connection,
+// if the client doesn't keep up
+static void send_reply(fake_reply_t *r) {
+  if (r->fd < 0)
+    return;
+  if (!r->tcp) {
+    sendto(r->fd, r->msg + 2, r->len, 0, (struct sockaddr *) &r->addr,
+           sizeof(r->addr));
+    return;
+  }
+
+  put16(r->msg, (unsigned short) r->len);
+  if (send(r->fd, r->msg, r->len + 2, MSG_NOSIGNAL) != (ssize_t) r->len + 2)
+    shutdown(r->fd, SHUT_RDWR);
+}
+
+// Answer the query of length len, right away or once the delay has passed.
+// Lost queries and those over the rate limit are not answered
+static void answer(int fd, bool tcp, struct sockaddr_in *addr, char *q,
+                   size_t len) {
+  fake_reply_t now, *r = &now;
+  if (!tcp && (chance(loss) || !within_rate()))
+    return;
+  if (delay_usec) {
+    if (queue_len == FAKE_QUEUE)
+      return;  // overloaded
+    r = &queue[(queue_head + queue_len) % FAKE_QUEUE];
+  }
+
+  r->len = build_answer(q, len, r->msg + 2, tcp);
+  if (r->len == 0)
+    return;
+  r->fd = fd;
+  r->tcp = tcp;
+  if (addr)
+    r->addr = *addr;
+
+  if (delay_usec) {
+    r->due = now_usec() + delay_usec;
+    queue_len++;
+  } else {
+    send_reply(r);
+  }
+}
+
+// Send the delayed answers that are due, and return the time until the next
+// one in ms (-1 if there is none)
+static int send_due() {
+  long long now = now_usec();
+  while (queue_len && queue[queue_head].due <= now) {
+    send_reply(&queue[queue_head]);
+    queue_head = (queue_head + 1) % FAKE_QUEUE;
+    queue_len--;
+  }
+  return queue_len ? (int) ((queue[queue_head].due - now + 999) / 1000) : -1;
+}
+
+// Answer every query waiting on the UDP socket
+static void read_udp(int sock) {
+  char q[BUFLEN];
+  struct sockaddr_in addr;
+  socklen_t addr_len = sizeof(addr);
+  ssize_t n;
+
+  while ((n = recvfrom(sock, q, BUFLEN, MSG_DONTWAIT,
+                       (struct sockaddr *) &addr, &addr_len)) >= 0) {
+    answer(sock, false, &addr, q, n);
+    addr_len = sizeof(addr);
+  }
+}
+
+// Close a TCP connection, forgetting the answers still queued for it
+static void close_client(fake_conn_t *c) {
+  for (int i = 0; i < queue_len; i++)
+    if (queue[(queue_head + i) % FAKE_QUEUE].fd == c->fd)
+      queue[(queue_head + i) % FAKE_QUEUE].fd = -1;
+  close(c->fd);
+  c->fd = -1;
+}
+
+// Answer the complete queries received on a TCP connection
+static void read_tcp(fake_conn_t *c) {
+  ssize_t n = read(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len);
+  if (n <= 0) {
+    if (n == 0 || (errno != EAGAIN && errno != EINTR))
+      close_client(c);
+    return;
+  }
+  c->in_len += n;
+
+  size_t start = 0;
+  while (c->in_len - start >= 2) {
+    size_t len = get16(c->in + start);
+    if (len > BUFLEN) {
+      close_client(c);
+      return;
+    }
+    if (c->in_len - start < 2 + len)
+      break;
+    answer(c->fd, true, NULL, c->in + start + 2, len);
+    start += 2 + len;
+  }
+  c->in_len -= start;
+  memmove(c->in, c->in + start, c->in_len);
+}
+
+// Accept a TCP client, if there is room for it
+static void accept_client(int listener) {
+  int fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK);
+  if (fd < 0)
+    return;
+  for (int i = 0; i < FAKE_CONNS; i++) {
+    if (conns[i].fd < 0) {
+      conns[i].fd = fd;
+      conns[i].in_len = 0;
+      return;
+    }
+  }
+  close(fd);
+}
+
+// Open the UDP socket and TCP listener on addr
+static void open_sockets(struct sockaddr_in *addr, int *udp, int *listener) {
+  int one = 1, rcvbuf = 8 << 20;
+  *udp = socket(PF_INET, SOCK_DGRAM, 0);
+  *listener = socket(PF_INET, SOCK_STREAM, 0);
+
+  if (*udp < 0 || *listener < 0
+      || bind(*udp, (struct sockaddr *) addr, sizeof(*addr)) < 0
+      || setsockopt(*listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+      || bind(*listener, (struct sockaddr *) addr, sizeof(*addr)) < 0
+      || listen(*listener, FAKE_CONNS) < 0)
+    error("ERROR opening the sockets!\n");
+  if (setsockopt(*udp, SOL_SOCKET, SO_RCVBUFFORCE, &rcvbuf, sizeof(rcvbuf)))
+    setsockopt(*udp, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+}
+
+// Local DNS server with canned answers, for testing and benchmarking the
+// client without a network: it answers every type the client prints, over
+// UDP and TCP, with an optional delay, loss rate, truncation rate and UDP rate
+// limit. Given a zone and delegations, a few of them on loopback addresses
+// stand in for the authoritative servers from the root down
+int main(int argc, char *argv[]) {
+  char *addr_str = "127.0.0.1:53";
+  struct sockaddr_in addr;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "d:l:t:q:z:D:a:T:")) != -1) {
+    switch (opt) {
+      case 'd': delay_usec = atoll(optarg) * 1000;
+        break;
+      case 'l': loss = atof(optarg);
+        break;
+      case 't': truncation = atof(optarg);
+        break;
+      case 'q': rate = atof(optarg);
+        break;
+      case 'z': zone = optarg;
+        break;
+      case 'D':
+        if (ndelegations == FAKE_DELEGATIONS
+            || !parse_delegation(optarg, &delegations[ndelegations++]))
+          argc = 0;
+        break;
+      case 'a': a_count = 1;
+        if (inet_pton(AF_INET, optarg, a_rdata) != 1)
+          argc = 0;
+        break;
+      case 'T': ttl = (unsigned int) atoi(optarg);
+        break;
+      default: argc = 0;
+    }
+  }
+  if (argc == 0 || optind < argc - 1 || delay_usec < 0
+      || (optind < argc && !parse_server_addr(argv[optind], &addr)))
+    error("Usage: dnsfake [-d delay_ms] [-l loss] [-t truncation] [-q qps]\n"
+          "               [-a addr] [-T ttl] [-z zone [-D child=ns[,ns...]]...]"
+          "\n               [address[:port]]\n");
+  if (optind == argc)
+    parse_server_addr(addr_str, &addr);
+
+  int udp, listener;
+  open_sockets(&addr, &udp, &listener);
+  for (int i = 0; i < FAKE_CONNS; i++)
+    conns[i].fd = -1;
+
+  struct pollfd fds[2 + FAKE_CONNS];
+  fake_conn_t *polled[2 + FAKE_CONNS];
+  for (;;) {
+    int nfds = 2;
+    fds[0] = (struct pollfd) {.fd = udp, .events = POLLIN};
+    fds[1] = (struct pollfd) {.fd = listener, .events = POLLIN};
+    for (int i = 0; i < FAKE_CONNS; i++) {
+      if (conns[i].fd >= 0) {
+        polled[nfds] = &conns[i];
+        fds[nfds++] = (struct pollfd) {.fd = conns[i].fd, .events = POLLIN};
+      }
+    }
+
+    if (poll(fds, nfds, send_due()) < 0 && errno != EINTR)
+      error("ERROR waiting for queries!\n");
+
+    if (fds[0].revents)
+      read_udp(udp);
+    if (fds[1].revents)
+      accept_client(listener);
+    for (int i = 2; i < nfds; i++)
+      if (fds[i].revents)
+        read_tcp(polled[i]);
+    send_due();
+  }
+}
@@ -0,0 +1,497 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+/* IPv4 addresses of the root servers, a to m (from root.hints) */
+static char *root_hints[] = {
+    "198.41.0.4", "170.247.170.2", "192.33.4.12", "199.7.91.13",
+    "192.203.230.10", "192.5.5.241", "192.112.36.4", "198.97.190.53",
+    "192.36.148.17", "192.58.128.30", "193.0.14.129", "199.7.83.42",
+    "202.12.27.33"
+};
+
+static void hop_done(dns_resolver_t *res, dns_query_t *query,
+                     enum error_status status, dns_msg_t *ans);
+static void lookup_start(dns_lookup_t *lookup);
+
+// Copy name into zone in lowercase, without the trailing dot ("" for the
+// root)
+static void zone_key(char *zone, char *name) {
+  int i;
+  for (i = 0; name[i] && i < MAX_NAME_LEN - 1; i++)
+    zone[i] = (char) tolower(name[i]);
+  if (i && zone[i - 1] == '.')
+    i--;
+  zone[i] = 0;
+}
+
+// Whether name is zone or under it, both in the form of zone_key
+static bool in_zone(char *name, char *zone) {
+  size_t len = strlen(name), zone_len = strlen(zone);
+  return zone_len == 0
+      || (len >= zone_len && strcasecmp(name + len - zone_len, zone) == 0
+          && (len == zone_len || name[len - zone_len - 1] == '.'));
+}
+
+// FNV-1a hash of a zone
+static unsigned int zone_hash(char *zone) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; zone[i]; i++)
+    hash = (hash ^ (unsigned char) zone[i]) * 16777619u;
+  return hash;
+}
+
+// Find the nameservers of zone in the delegation cache, or NULL if they
+// aren't known or expired
+static dns_zone_t *zone_find(dns_iter_t *iter, char *zone, long long now) {
+  unsigned int hash = zone_hash(zone);
+  for (int i = 0; i < ZONE_PROBES; i++) {
+    dns_zone_t *entry = &iter->zones[(hash + i) % ZONE_SLOTS];
+    if (entry->expires > now && strcmp(entry->name, zone) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+// Remember the n nameservers of zone for ttl seconds, in place of the same
+// zone, an expired one, or the one expiring first among its probes
+static void zone_store(dns_iter_t *iter, char *zone, int *servers, int n,
+                       unsigned int ttl) {
+  long long now = now_usec();
+  unsigned int hash = zone_hash(zone);
+  dns_zone_t *victim = NULL;
+
+  if (ttl == 0)
+    return;
+  for (int i = 0; i < ZONE_PROBES; i++) {
+    dns_zone_t *entry = &iter->zones[(hash + i) % ZONE_SLOTS];
+    if (strcmp(entry->name, zone) == 0 || entry->expires <= now) {
+      victim = entry;
+      break;
+    }
+    if (victim == NULL || entry->expires < victim->expires)
+      victim = entry;
+  }
+
+  strcpy(victim->name, zone);
+  victim->expires = now + ttl * 1000000LL;
+  victim->nservers = n < MAX_IPS ? n : MAX_IPS;
+  memcpy(victim->servers, servers, victim->nservers * sizeof(int));
+}
+
+// Get the index in the resolver of the nameserver at addr, on the port of the
+// root hints, adding it the first time. Return -1 if it can't be added
+static int iter_server(dns_iter_t *iter, struct in_addr addr) {
+  if (addr.s_addr == 0)
+    return -1;
+
+  // Address -> server map, in open addressing, grown at half full
+  if (2 * (iter->naddrs + 1) > iter->addrs_cap) {
+    int cap = iter->addrs_cap ? 2 * iter->addrs_cap : 256;
+    unsigned int *keys = calloc(cap, sizeof(unsigned int));
+    int *servers = calloc(cap, sizeof(int));
+    if (keys == NULL || servers == NULL) {
+      free(keys);
+      free(servers);
+      return -1;
+    }
+    for (int i = 0; i < iter->addrs_cap; i++) {
+      if (iter->addr_keys[i] == 0)
+        continue;
+      int j = (int) (iter->addr_keys[i] * 2654435761u % cap);
+      while (keys[j])
+        j = (j + 1) % cap;
+      keys[j] = iter->addr_keys[i];
+      servers[j] = iter->addr_servers[i];
+    }
+    free(iter->addr_keys);
+    free(iter->addr_servers);
+    iter->addr_keys = keys;
+    iter->addr_servers = servers;
+    iter->addrs_cap = cap;
+  }
+
+  int i = (int) (addr.s_addr * 2654435761u % iter->addrs_cap);
+  while (iter->addr_keys[i] && iter->addr_keys[i] != addr.s_addr)
+    i = (i + 1) % iter->addrs_cap;
+  if (iter->addr_keys[i])
+    return iter->addr_servers[i];
+
+  char name[MAX_ADDR_LEN];
+  inet_ntop(AF_INET, &addr, name, sizeof(name));
+  if (iter->port != 53)
+    sprintf(name + strlen(name), ":%u", iter->port);
+  int server = resolver_add_server(iter->res, name);
+  if (server >= 0) {
+    iter->addr_keys[i] = addr.s_addr;
+    iter->addr_servers[i] = server;
+    iter->naddrs++;
+  }
+  return server;
+}
+
+// Add the root servers from the hints file, "address[:port]" per line (the
+// nameservers of every referral are asked on the port of the first one), or
+// the built-in ones for NULL. Return false if there are none
+static bool load_root_hints(dns_iter_t *iter, char *file) {
+  char line[BUFLEN], addr[MAX_ADDR_LEN];
+  struct sockaddr_in sa;
+  FILE *f = file ? fopen(file, "r") : NULL;
+  int n = 0;
+
+  if (file && f == NULL)
+    return false;
+  iter->port = 53;
+  while (iter->nroots < MAX_IPS) {
+    if (f == NULL && n == sizeof(root_hints) / sizeof(root_hints[0]))
+      break;
+    if (f && !fgets(line, BUFLEN, f))
+      break;
+    if (f && (sscanf(line, "%63s", addr) != 1 || addr[0] == '#'))
+      continue;
+    if (f == NULL)
+      strcpy(addr, root_hints[n]);
+    if (!parse_server_addr(addr, &sa))
+      continue;
+    if (n++ == 0)
+      iter->port = ntohs(sa.sin_port);
+
+    int server = iter_server(iter, sa.sin_addr);
+    if (server >= 0)
+      iter->roots[iter->nroots++] = server;
+  }
+
+  if (f)
+    fclose(f);
+  return iter->nroots > 0;
+}
+
+// Set up iterative resolution from the root hints in file (NULL for the
+// built-in ones) on the resolver, which must only be used through the
+// iterator. Return false, with nothing left to free, if it can't be set up
+bool iter_init(dns_iter_t *iter, dns_resolver_t *res, char *file) {
+  memset(iter, 0, sizeof(*iter));
+  iter->res = res;
+  iter->zones = calloc(ZONE_SLOTS, sizeof(dns_zone_t));
+  if (iter->zones == NULL || !load_root_hints(iter, file)) {
+    iter_free(iter);
+    return false;
+  }
+  return true;
+}
+
+// Send the next query of the lookup to the servers of its zone, or keep it
+// waiting until the resolver has a free slot
+static void lookup_send(dns_lookup_t *lookup) {
+  dns_iter_t *iter = lookup->iter;
+  if (resolver_submit_to(iter->res, lookup->name, lookup->qtype,
+                         lookup->servers, lookup->nservers, false, hop_done,
+                         lookup) >= 0) {
+    lookup->hops++;
+    iter->hops++;
+    return;
+  }
+
+  lookup->next = NULL;
+  if (iter->waiting_tail)
+    iter->waiting_tail->next = lookup;
+  else
+    iter->waiting = lookup;
+  iter->waiting_tail = lookup;
+}
+
+// Start the lookup from the closest zone it is under whose nameservers are
+// known, the root if none is
+static void lookup_start(dns_lookup_t *lookup) {
+  dns_iter_t *iter = lookup->iter;
+  long long now = now_usec();
+  char *zone = lookup->name;
+
+  for (;;) {
+    dns_zone_t *entry = zone_find(iter, zone, now);
+    if (entry) {
+      strcpy(lookup->zone, entry->name);
+      memcpy(lookup->servers, entry->servers, entry->nservers * sizeof(int));
+      lookup->nservers = entry->nservers;
+      iter->zone_hits++;
+      break;
+    }
+
+    char *dot = strchr(zone, '.');
+    if (*zone == 0 || dot == NULL) {
+      lookup->zone[0] = 0;
+      memcpy(lookup->servers, iter->roots, iter->nroots * sizeof(int));
+      lookup->nservers = iter->nroots;
+      break;
+    }
+    zone = dot + 1;
+  }
+  lookup_send(lookup);
+}
+
+// Allocate a lookup of name and qtype, or return NULL
+static dns_lookup_t *lookup_new(dns_iter_t *iter, char *name,
+                                enum query_type qtype) {
+  dns_lookup_t *lookup = calloc(1, sizeof(dns_lookup_t));
+  if (lookup == NULL)
+    return NULL;
+  lookup->iter = iter;
+  zone_key(lookup->name, name);
+  lookup->qtype = qtype;
+  return lookup;
+}
+
+static void nameserver_found(dns_lookup_t *lookup, dns_query_t *query,
+                             enum error_status status, dns_msg_t *ans);
+
+// Hand the outcome of the lookup to whoever started it: the caller, under
+// the name and type it asked for, or the lookup waiting for the address of a
+// nameserver. The lookup is freed
+static void lookup_finish(dns_lookup_t *lookup, dns_query_t *query,
+                          enum error_status status, dns_msg_t *ans) {
+  dns_lookup_t *parent = lookup->parent;
+  if (parent) {
+    free(lookup);
+    nameserver_found(parent, query, status, ans);
+    return;
+  }
+
+  snprintf(query->name, MAX_NAME_LEN, "%s", lookup->name);
+  query->qtype = lookup->qtype;
+  query->data = lookup->data;
+  lookup->iter->active--;
+  lookup->callback(lookup->iter->res, query, status, ans);
+  free(lookup);
+}
+
+// Look up the address of the next nameserver of a glueless referral, as a
+// lookup of its own. Fail the lookup if none is left
+static void lookup_nameserver(dns_lookup_t *lookup, dns_query_t *query) {
+  if (lookup->next_ns == lookup->nns || lookup->depth == GLUELESS_DEPTH) {
+    lookup_finish(lookup, query, NORESPONSE, NULL);
+    return;
+  }
+
+  dns_lookup_t *child = lookup_new(lookup->iter,
+                                   lookup->ns_names[lookup->next_ns++], A);
+  if (child == NULL) {
+    lookup_finish(lookup, query, NORESPONSE, NULL);
+    return;
+  }
+  child->parent = lookup;
+  child->depth = lookup->depth + 1;
+  lookup_start(child);
+}
+
+// Carry on with the lookup once the address of a nameserver of its zone was
+// looked up, or with the next nameserver if it wasn't found
+static void nameserver_found(dns_lookup_t *lookup, dns_query_t *query,
+                             enum error_status status, dns_msg_t *ans) {
+  int count;
+  dns_record_t *rr = status == NOERROR && ans->header.rcode == 0
+      ? msg_section(ans, ANSWER, &count) : NULL;
+  if (rr == NULL)
+    count = 0;
+
+  for (int i = 0; i < count && lookup->nservers < MAX_IPS; i++) {
+    if (rr[i].type != A || rr[i].rdlength != 4)
+      continue;
+    struct in_addr addr;
+    memcpy(&addr, ans->buf + rr[i].rdata, 4);
+    int server = iter_server(lookup->iter, addr);
+    if (server >= 0)
+      lookup->servers[lookup->nservers++] = server;
+  }
+
+  if (lookup->nservers == 0) {
+    lookup_nameserver(lookup, query);
+    return;
+  }
+  zone_store(lookup->iter, lookup->zone, lookup->servers, lookup->nservers,
+             lookup->ttl);
+  lookup_send(lookup);
+}
+
+// Look for a referral to a zone closer to the name of the lookup in the
+// authority section of ans, and the glue for its nameservers in the
+// additional section, trusted for names under the zone that was asked (the
+// servers of a zone can't vouch for addresses outside it). Return false if
+// there is none, otherwise the lookup moves down to the new zone, with the
+// nameservers that have an address. The others are looked up without glue
+static bool follow_referral(dns_lookup_t *lookup, dns_msg_t *ans) {
+  char zone[MAX_NAME_LEN], name[MAX_NAME_LEN], asked[MAX_NAME_LEN];
+  int count, nns = 0;
+  unsigned int ttl = 0;
+  dns_record_t *rr = msg_section(ans, AUTHORITY, &count);
+
+  zone[0] = 0;
+  for (int i = 0; i < count; i++) {
+    if (rr[i].type != NS || msg_name(ans, rr[i].name, name) < 0)
+      continue;
+    zone_key(name, name);
+    if (nns == 0) {
+      if (!in_zone(lookup->name, name) || !in_zone(name, lookup->zone)
+          || strlen(name) <= strlen(lookup->zone))
+        continue;  // not closer to the name
+      strcpy(zone, name);
+    } else if (strcmp(name, zone) != 0) {
+      continue;
+    }
+
+    if (nns == MAX_IPS || msg_name(ans, rr[i].rdata, name) < 0)
+      continue;
+    zone_key(lookup->ns_names[nns++], name);
+    if (ttl == 0 || rr[i].ttl < ttl)
+      ttl = rr[i].ttl;
+  }
+  if (nns == 0)
+    return false;
+
+  strcpy(asked, lookup->zone);
+  strcpy(lookup->zone, zone);
+  lookup->nns = nns;
+  lookup->next_ns = 0;
+  lookup->nservers = 0;
+  lookup->ttl = ttl;
+  lookup->iter->referrals++;
+
+  rr = msg_section(ans, ADDITIONAL, &count);
+  for (int i = 0; i < count && lookup->nservers < MAX_IPS; i++) {
+    if (rr[i].type != A || rr[i].rdlength != 4)
+      continue;
+    for (int j = 0; j < nns; j++) {
+      if (!msg_name_equal(ans, rr[i].name, lookup->ns_names[j]))
+        continue;
+      if (!in_zone(lookup->ns_names[j], asked))
+        break;  // out of bailiwick
+      struct in_addr addr;
+      memcpy(&addr, ans->buf + rr[i].rdata, 4);
+      int server = iter_server(lookup->iter, addr);
+      if (server >= 0)
+        lookup->servers[lookup->nservers++] = server;
+      break;
+    }
+  }
+  return true;
+}
+
+// Get the target of the CNAME of the lookup name in the answer of ans into
+// target, unless the answer also has records of the type asked for. Return
+// false if there is none
+static bool find_alias(dns_lookup_t *lookup, dns_msg_t *ans, char *target) {
+  int count;
+  dns_record_t *rr = msg_section(ans, ANSWER, &count);
+  bool found = false;
+
+  if (lookup->qtype == CNAME)
+    return false;
+  for (int i = 0; i < count; i++) {
+    if (rr[i].type == lookup->qtype)
+      return false;
+    if (rr[i].type == CNAME && msg_name_equal(ans, rr[i].name, lookup->name)
+        && msg_name(ans, rr[i].rdata, target) >= 0)
+      found = true;
+  }
+  return found;
+}
+
+// Handle the answer to one query of a lookup: a referral moves it down to the
+// servers of the zone it points to (looking up their addresses if it came
+// without glue), an alias starts it over for the target, anything else is
+// the final answer
+static void hop_done(dns_resolver_t *res, dns_query_t *query,
+                     enum error_status status, dns_msg_t *ans) {
+  dns_lookup_t *lookup = query->data;
+  char target[MAX_NAME_LEN];
+  (void) res;
+
+  if (status != NOERROR || ans->header.rcode != 0) {
+    lookup_finish(lookup, query, status, ans);
+    return;
+  }
+
+  // The answer is read before the next query can reuse its buffer
+  if (ans->header.ancount == 0 && follow_referral(lookup, ans)) {
+    if (lookup->hops >= MAX_HOPS) {
+      lookup_finish(lookup, query, NORESPONSE, NULL);
+    } else if (lookup->nservers) {
+      zone_store(lookup->iter, lookup->zone, lookup->servers,
+                 lookup->nservers, lookup->ttl);
+      lookup_send(lookup);
+    } else {
+      lookup_nameserver(lookup, query);
+    }
+    return;
+  }
+
+  if (lookup->cnames < MAX_CNAMES && find_alias(lookup, ans, target)) {
+    lookup->cnames++;
+    zone_key(lookup->name, target);
+    lookup_start(lookup);
+    return;
+  }
+  lookup_finish(lookup, query, NOERROR, ans);
+}
+
+// Resolve name iteratively, from the closest zone in the delegation cache
+// down. The callback gets the outcome with the query for the name (possibly
+// before this returns). Return false if the name is too long or the lookup
+// can't be allocated
+bool iter_submit(dns_iter_t *iter, char *name, enum query_type qtype,
+                 dns_callback_t callback, void *data) {
+  if (strlen(name) >= MAX_NAME_LEN)
+    return false;
+  dns_lookup_t *lookup = lookup_new(iter, name, qtype);
+  if (lookup == NULL)
+    return false;
+
+  lookup->callback = callback;
+  lookup->data = data;
+  iter->active++;
+  iter->lookups++;
+  lookup_start(lookup);
+  return true;
+}
+
+// Send the queries that were waiting for a free slot, for as long as there
+// are free slots
+static void send_waiting(dns_iter_t *iter) {
+  while (iter->waiting && iter->res->active < iter->res->window) {
+    dns_lookup_t *lookup = iter->waiting;
+    iter->waiting = lookup->next;
+    if (iter->waiting == NULL)
+      iter->waiting_tail = NULL;
+    lookup_send(lookup);
+  }
+}
+
+// Process the resolver as resolver_process does, keeping its window full
+// with the queries of the lookups. Return the number of lookups in flight
+int iter_process(dns_iter_t *iter, int timeout_ms) {
+  send_waiting(iter);
+  resolver_process(iter->res, iter->waiting ? 0 : timeout_ms);
+  send_waiting(iter);
+  return iter->active;
+}
+
+// Print how the lookups went to stderr
+void iter_summary(dns_iter_t *iter) {
+  fprintf(stderr, ";; iterative: %llu lookups, %llu hops, %llu referrals, "
+          "%llu started from a cached zone, %d nameservers\n", iter->lookups,
+          iter->hops, iter->referrals, iter->zone_hits, iter->naddrs);
+}
+
+// Free the delegation cache and the lookups still waiting. The resolver is
+// left to the caller
+void iter_free(dns_iter_t *iter) {
+  while (iter->waiting) {
+    dns_lookup_t *next = iter->waiting->next;
+    free(iter->waiting);
+    iter->waiting = next;
+  }
+  free(iter->zones);
+  free(iter->addr_keys);
+  free(iter->addr_servers);
+}
@@ -0,0 +1,261 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define LOG_SLOTS 4096          // power of two
+#define LOG_MASK (LOG_SLOTS - 1)
+#define LOG_CHUNK 118           // bytes of a record held by one slot
+#define LOG_OUT_SIZE 65536      // write() batch size per file
+
+/* Ring slot, holding a chunk of a record. Records longer than a chunk take
+ * consecutive slots, reserved all at once. seq is the position the slot can
+ * be reserved at, or that position + 1 once its chunk is published */
+typedef struct {
+  unsigned long seq;
+  unsigned char file;
+  unsigned char len;
+  char data[LOG_CHUNK];
+} log_slot_t;
+
+static struct {
+  log_slot_t ring[LOG_SLOTS];
+  unsigned long head;           // next position to reserve (producers)
+  unsigned long tail;           // next position to read (writer thread)
+  int fd[LOG_FILES];
+  char out[LOG_FILES][LOG_OUT_SIZE];
+  size_t out_len[LOG_FILES];
+  long long flush_usec;
+  int sample;                   // one in sample messages is logged
+  unsigned long messages, answers;  // seen, for sampling
+  bool drop, binary, running;
+  unsigned long dropped;
+  pthread_t writer;
+  pthread_mutex_t lock;         // only guards the writer's sleep
+  pthread_cond_t wake;
+} logger = {.fd = {-1, -1}};
+
+static const char hex_digits[] = "0123456789ABCDEF";
+
+// Reserve count consecutive slots, returning false if the ring is full
+static bool log_reserve(unsigned long count, unsigned long *pos) {
+  unsigned long head = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+
+  for (;;) {
+    // The writer frees slots in order, so if the last one is free, all are
+    log_slot_t *last = &logger.ring[(head + count - 1) & LOG_MASK];
+    unsigned long seq = __atomic_load_n(&last->seq, __ATOMIC_ACQUIRE);
+    long diff = (long) (seq - (head + count - 1));
+
+    if (diff < 0)
+      return false;
+    if (diff > 0) {
+      head = __atomic_load_n(&logger.head, __ATOMIC_RELAXED);
+      continue;  // another producer got there first
+    }
+    if (__atomic_compare_exchange_n(&logger.head, &head, head + count, true,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+      *pos = head;
+      return true;
+    }
+  }
+}
+
+// Write the buffered output of a file
+static void log_flush_file(int file) {
+  size_t done = 0;
+  while (done < logger.out_len[file]) {
+    ssize_t n = write(logger.fd[file], logger.out[file] + done,
+                      logger.out_len[file] - done);
+    if (n <= 0 && errno != EINTR)
+      break;  // nowhere to report it, the log is lost
+    if (n > 0)
+      done += n;
+  }
+  logger.out_len[file] = 0;
+}
+
+// Move every published chunk from the ring to the output buffers
+static void log_drain() {
+  for (;;) {
+    log_slot_t *slot = &logger.ring[logger.tail & LOG_MASK];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != logger.tail + 1)
+      return;  // empty, or reserved but not yet published
+
+    int file = slot->file;
+    if (logger.out_len[file] + slot->len > LOG_OUT_SIZE)
+      log_flush_file(file);
+    memcpy(logger.out[file] + logger.out_len[file], slot->data, slot->len);
+    logger.out_len[file] += slot->len;
+
+    __atomic_store_n(&slot->seq, logger.tail + LOG_SLOTS, __ATOMIC_RELEASE);
+    __atomic_store_n(&logger.tail, logger.tail + 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Background writer: drains the ring, and writes the output in large batches
+// every flush interval
+static void *log_writer(void *arg) {
+  long long last_flush = now_usec();
+
+  while (__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)) {
+    long long now = now_usec(), wait = last_flush + logger.flush_usec - now;
+    if (wait > 0) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += wait / 1000000;
+      deadline.tv_nsec += (wait % 1000000) * 1000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&logger.lock);
+      pthread_cond_timedwait(&logger.wake, &logger.lock, &deadline);
+      pthread_mutex_unlock(&logger.lock);
+    }
+
+    log_drain();
+    if (now_usec() - last_flush >= logger.flush_usec) {
+      for (int i = 0; i < LOG_FILES; i++)
+        log_flush_file(i);
+      last_flush = now_usec();
+    }
+  }
+  return arg;
+}
+
+// Open the log files once and start the writer thread. Everything still in
+// the ring is written when the process exits. Return false if the files can't
+// be opened or the thread can't start, in which case nothing is logged
+bool log_init(dns_options_t *opts) {
+  logger.fd[LOG_MSG] = open(opts->log_binary ? MSG_BIN_LOG : MSG_LOG,
+                            O_CREAT | O_APPEND | O_WRONLY, 0644);
+  logger.fd[LOG_DNS] = open(DNS_LOG, O_CREAT | O_APPEND | O_WRONLY, 0644);
+  if (logger.fd[LOG_MSG] < 0 || logger.fd[LOG_DNS] < 0) {
+    for (int i = 0; i < LOG_FILES; i++)
+      if (logger.fd[i] >= 0)
+        close(logger.fd[i]);
+    logger.fd[LOG_MSG] = logger.fd[LOG_DNS] = -1;
+    return false;
+  }
+
+  for (unsigned long i = 0; i < LOG_SLOTS; i++)
+    logger.ring[i].seq = i;
+  logger.flush_usec = opts->log_flush_ms > 0 ? opts->log_flush_ms * 1000LL
+                                             : 1000;
+  logger.sample = opts->log_sample > 1 ? opts->log_sample : 1;
+  logger.drop = opts->log_drop;
+  logger.binary = opts->log_binary;
+  logger.running = true;
+  pthread_mutex_init(&logger.lock, NULL);
+  pthread_cond_init(&logger.wake, NULL);
+
+  if (pthread_create(&logger.writer, NULL, log_writer, NULL) != 0) {
+    logger.running = false;
+    for (int i = 0; i < LOG_FILES; i++)
+      close(logger.fd[i]);
+    return false;
+  }
+  atexit(log_close);
+  return true;
+}
+
+// Append len bytes of data to a log file. When the ring is full the record is
+// dropped, or the caller waits for the writer, depending on the policy
+void log_write(int file, char *data, size_t len) {
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE) || len == 0)
+    return;
+
+  // Records that take more than half of the ring are cut, or they could
+  // wait forever for enough free slots
+  if (len > LOG_SLOTS / 2 * LOG_CHUNK)
+    len = LOG_SLOTS / 2 * LOG_CHUNK;
+  unsigned long count = (len + LOG_CHUNK - 1) / LOG_CHUNK, pos;
+
+  while (!log_reserve(count, &pos)) {
+    if (logger.drop) {
+      __atomic_fetch_add(&logger.dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    pthread_cond_signal(&logger.wake);
+    sched_yield();
+  }
+
+  for (unsigned long i = 0; i < count; i++) {
+    log_slot_t *slot = &logger.ring[(pos + i) & LOG_MASK];
+    size_t chunk = len < LOG_CHUNK ? len : LOG_CHUNK;
+    slot->file = (unsigned char) file;
+    slot->len = (unsigned char) chunk;
+    memcpy(slot->data, data, chunk);
+    data += chunk;
+    len -= chunk;
+    __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
+
+  // Wake the writer early once half of the ring is in use
+  if (pos + count - __atomic_load_n(&logger.tail, __ATOMIC_RELAXED)
+      >= LOG_SLOTS / 2)
+    pthread_cond_signal(&logger.wake);
+}
+
+// Whether the next answer is one of the sampled ones that go to DNS_LOG
+bool log_sampled() {
+  return __atomic_load_n(&logger.running, __ATOMIC_ACQUIRE)
+      && __atomic_fetch_add(&logger.answers, 1, __ATOMIC_RELAXED)
+         % logger.sample == 0;
+}
+
+// Save message of length len in MSG_LOG as hex segments, or in MSG_BIN_LOG
+// prefixed by its 16-bit big endian length. Only one in the sample rate is
+// kept, and none when the logger isn't running
+void log_msg(char *msg, size_t len) {
+  char line[3 * BUFLEN + 2];
+  size_t n = 0;
+
+  if (!__atomic_load_n(&logger.running, __ATOMIC_ACQUIRE))
+    return;
+  if (logger.sample > 1 && __atomic_fetch_add(&logger.messages, 1,
+                                              __ATOMIC_RELAXED)
+      % logger.sample)
+    return;
+
+  if (len > BUFLEN)
+    len = BUFLEN;
+
+  if (logger.binary) {
+    line[n++] = (char) (len >> 8);
+    line[n++] = (char) len;
+    memcpy(line + n, msg, len);
+    log_write(LOG_MSG, line, n + len);
+    return;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = (unsigned char) msg[i];
+    line[n++] = hex_digits[c >> 4];
+    line[n++] = hex_digits[c & 0xF];
+    line[n++] = ' ';
+  }
+  line[n++] = '\n';
+  log_write(LOG_MSG, line, n);
+}
+
+// Stop the writer thread and write everything that is left
+void log_close() {
+  if (!logger.running)
+    return;
+
+  __atomic_store_n(&logger.running, false, __ATOMIC_RELEASE);
+  pthread_cond_signal(&logger.wake);
+  pthread_join(logger.writer, NULL);
+
+  log_drain();
+  for (int i = 0; i < LOG_FILES; i++) {
+    log_flush_file(i);
+    close(logger.fd[i]);
+  }
+
+  if (logger.dropped)
+    fprintf(stderr, ";; %lu log records dropped\n", logger.dropped);
+}
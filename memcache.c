@@ -0,0 +1,403 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define MAX_READ_RETRIES 100
+#define NO_ROOM ((size_t) -1)
+// Index bytes per bucket: the bucket, the meta of its ways, and room in the
+// TTL index for two expiries per way
+#define BUCKET_COST (sizeof(dns_mem_bucket_t) \
+    + MEM_WAYS * (sizeof(dns_mem_meta_t) + 2 * sizeof(dns_mem_expiry_t)))
+
+/* Entry in the arena of a shard, followed by its key and its answer */
+typedef struct {
+  unsigned int hash;        // 0 for the padding before the end of the arena
+  unsigned int size;        // bytes it takes in the arena, 8-byte aligned
+  long long stored;         // wall clock time the answer was stored at
+  long long expires;        // wall clock time the answer expires at
+  unsigned short qtype;
+  unsigned short len;       // of the answer
+  unsigned short key_len;   // with the terminating 0
+} mem_entry_t;
+
+// Create an in-memory cache of about size bytes, a third of them for the
+// index, shared by the threads that look answers up in it. Return NULL if it
+// can't be allocated
+dns_memcache_t *memcache_create(size_t size) {
+  size_t shard_size = size / MEM_SHARDS;
+  size_t nbuckets = shard_size / 3 / BUCKET_COST;
+  if (nbuckets == 0)
+    nbuckets = 1;
+  size_t arena_size = shard_size > nbuckets * BUCKET_COST
+      ? (shard_size - nbuckets * BUCKET_COST) & ~(size_t) 7 : 0;
+  if (arena_size < sizeof(mem_entry_t) + MAX_NAME_LEN + MAX_MSG_LEN)
+    return NULL;
+
+  dns_memcache_t *mc = aligned_alloc(CACHE_LINE, sizeof(dns_memcache_t));
+  if (mc == NULL)
+    return NULL;
+  memset(mc, 0, sizeof(*mc));
+  for (int i = 0; i < MEM_SHARDS; i++)
+    pthread_mutex_init(&mc->shards[i].lock, NULL);
+
+  for (int i = 0; i < MEM_SHARDS; i++) {
+    dns_mem_shard_t *shard = &mc->shards[i];
+    shard->nbuckets = (unsigned int) nbuckets;
+    shard->buckets = aligned_alloc(CACHE_LINE,
+                                   nbuckets * sizeof(dns_mem_bucket_t));
+    shard->meta = calloc(nbuckets * MEM_WAYS, sizeof(dns_mem_meta_t));
+    shard->arena_size = arena_size;
+    shard->arena = malloc(arena_size);
+    shard->ttls_cap = (int) (2 * nbuckets * MEM_WAYS);
+    shard->ttls = malloc(shard->ttls_cap * sizeof(dns_mem_expiry_t));
+    if (!shard->buckets || !shard->meta || !shard->arena || !shard->ttls) {
+      memcache_free(mc);
+      return NULL;
+    }
+    memset(shard->buckets, 0, nbuckets * sizeof(dns_mem_bucket_t));
+  }
+  return mc;
+}
+
+// Mark a bucket as being written
+static void begin_write(dns_mem_bucket_t *bucket) {
+  __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+// Mark a bucket as written, for the readers that copied from it meanwhile to
+// try again
+static void end_write(dns_mem_bucket_t *bucket) {
+  __atomic_store_n(&bucket->seq, bucket->seq + 1, __ATOMIC_RELEASE);
+}
+
+// Get the entry at offset in the arena of the shard, or NULL if its header
+// doesn't fit there (an offset read while the bucket was written)
+static mem_entry_t *entry_at(dns_mem_shard_t *shard, size_t offset) {
+  if (offset > shard->arena_size - sizeof(mem_entry_t))
+    return NULL;
+  return (mem_entry_t *) (shard->arena + offset);
+}
+
+// Whether the entry at offset in the arena, whose header is given (a copy,
+// for readers), holds the answer to (key, qtype) within the arena
+static bool entry_matches(dns_mem_shard_t *shard, mem_entry_t *entry,
+                          size_t offset, char *key, size_t key_len,
+                          unsigned int hash, unsigned short qtype) {
+  size_t end = offset + sizeof(mem_entry_t) + key_len + entry->len;
+  return entry->hash == hash && entry->qtype == qtype
+      && entry->key_len == key_len && entry->len <= MAX_MSG_LEN
+      && end <= shard->arena_size
+      && memcmp(shard->arena + offset + sizeof(mem_entry_t), key,
+                key_len) == 0;
+}
+
+// Copy the answer to (key, qtype), of the given hash, into msg if it expires
+// after valid_after, with the times it was stored at and expires at. hits and
+// refreshing are pointed at the counters of the entry that readers update.
+// Return false on a miss, or if the bucket keeps changing under the reader
+bool memcache_get(dns_memcache_t *mc, char *key, unsigned int hash,
+                  unsigned short qtype, long long valid_after, char *msg,
+                  size_t *len, long long *stored, long long *expires,
+                  unsigned int **hits, long long **refreshing) {
+  dns_mem_shard_t *shard = &mc->shards[hash % MEM_SHARDS];
+  unsigned int b = hash / MEM_SHARDS % shard->nbuckets;
+  dns_mem_bucket_t *bucket = &shard->buckets[b];
+  size_t key_len = strlen(key) + 1;
+
+  for (int retry = 0; retry < MAX_READ_RETRIES; retry++) {
+    unsigned int seq = __atomic_load_n(&bucket->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+      continue;  // being written
+
+    // Every field is read once, since the writer may be changing them
+    int way;
+    mem_entry_t entry;
+    size_t offset = 0;
+    for (way = 0; way < MEM_WAYS; way++) {
+      offset = bucket->offsets[way];
+      if (bucket->hashes[way] != hash || entry_at(shard, offset) == NULL)
+        continue;
+      memcpy(&entry, shard->arena + offset, sizeof(entry));
+      if (entry_matches(shard, &entry, offset, key, key_len, hash, qtype))
+        break;
+    }
+    bool hit = way < MEM_WAYS && entry.expires > valid_after;
+    if (hit) {
+      *len = entry.len;
+      *stored = entry.stored;
+      *expires = entry.expires;
+      memcpy(msg, shard->arena + offset + sizeof(entry) + key_len, *len);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&bucket->seq, __ATOMIC_RELAXED) != seq)
+      continue;
+    if (hit) {
+      // Only set once per pass of the hand, the line is shared with others
+      dns_mem_meta_t *meta = &shard->meta[b * MEM_WAYS + way];
+      if (!__atomic_load_n(&meta->ref, __ATOMIC_RELAXED))
+        __atomic_store_n(&meta->ref, true, __ATOMIC_RELAXED);
+      *hits = &meta->hits;
+      *refreshing = &meta->refreshing;
+    }
+    return hit;
+  }
+  return false;
+}
+
+// Take size bytes at the head of the arena of the shard if they are free,
+// going around to its start if they don't fit before its end. Return their
+// offset, or NO_ROOM
+static size_t reserve(dns_mem_shard_t *shard, size_t size) {
+  if (shard->head == shard->tail)
+    shard->head = shard->tail = 0;  // empty, start over at its start
+
+  size_t at = shard->head % shard->arena_size;
+  size_t pad = at + size > shard->arena_size ? shard->arena_size - at : 0;
+  if (shard->head - shard->tail + pad + size > shard->arena_size)
+    return NO_ROOM;
+  if (pad >= sizeof(mem_entry_t))
+    ((mem_entry_t *) (shard->arena + at))->hash = 0;
+  shard->head += pad + size;
+  return (at + pad) % shard->arena_size;
+}
+
+// Reclaim the entry at the tail of the arena of the shard, evicting it, unless
+// move allows it to be moved to the head because it was asked for since the
+// hand last passed it. Return whether it was moved
+static bool reclaim(dns_mem_shard_t *shard, long long now, bool move) {
+  size_t at = shard->tail % shard->arena_size;
+  mem_entry_t *entry = entry_at(shard, at);
+  if (entry == NULL || entry->hash == 0) {
+    shard->tail += shard->arena_size - at;  // padding
+    return false;
+  }
+  shard->tail += entry->size;
+
+  unsigned int b = entry->hash / MEM_SHARDS % shard->nbuckets;
+  dns_mem_bucket_t *bucket = &shard->buckets[b];
+  int way = 0;
+  while (way < MEM_WAYS && (bucket->hashes[way] != entry->hash
+                            || bucket->offsets[way] != at))
+    way++;
+  if (way == MEM_WAYS)
+    return false;  // replaced or expired already
+
+  // Its bytes are free now, and those at the head don't overlap their start
+  dns_mem_meta_t *meta = &shard->meta[b * MEM_WAYS + way];
+  size_t offset = NO_ROOM;
+  begin_write(bucket);
+  if (move && __atomic_load_n(&meta->ref, __ATOMIC_RELAXED)
+      && entry->expires > now)
+    offset = reserve(shard, entry->size);
+  if (offset != NO_ROOM) {
+    memmove(shard->arena + offset, entry, entry->size);
+    bucket->offsets[way] = (unsigned int) offset;
+    shard->moved++;
+  } else {
+    bucket->hashes[way] = 0;
+    shard->entries--;
+    shard->evicted++;
+  }
+  __atomic_store_n(&meta->ref, false, __ATOMIC_RELAXED);
+  end_write(bucket);
+  return offset != NO_ROOM;
+}
+
+// Take size bytes at the head of the arena of the shard, reclaiming its tail
+// as a CLOCK hand goes around: the entries asked for since it last passed are
+// kept, up to MEM_MAX_MOVES of them, and the others evicted
+static size_t make_room(dns_mem_shard_t *shard, size_t size, long long now) {
+  int moves = 0;
+  size_t offset;
+  while ((offset = reserve(shard, size)) == NO_ROOM)
+    moves += reclaim(shard, now, moves < MEM_MAX_MOVES);
+  return offset;
+}
+
+// Move the expiry at i of the TTL index of the shard down to its place
+static void ttl_sift_down(dns_mem_shard_t *shard, int i) {
+  dns_mem_expiry_t e = shard->ttls[i];
+  int n = shard->nttls;
+
+  while (2 * i + 1 < n) {
+    int child = 2 * i + 1;
+    if (child + 1 < n
+        && shard->ttls[child + 1].expires < shard->ttls[child].expires)
+      child++;
+    if (e.expires <= shard->ttls[child].expires)
+      break;
+    shard->ttls[i] = shard->ttls[child];
+    i = child;
+  }
+  shard->ttls[i] = e;
+}
+
+// Whether the entry in a way of a bucket of the shard is the one an expiry of
+// the TTL index was added for (or another one expiring as late)
+static bool ttl_current(dns_mem_shard_t *shard, dns_mem_expiry_t *e) {
+  dns_mem_bucket_t *bucket = &shard->buckets[e->bucket];
+  if (bucket->hashes[e->way] == 0)
+    return false;
+  mem_entry_t *entry = entry_at(shard, bucket->offsets[e->way]);
+  return entry->expires + STALE_MAX_SEC == e->expires;
+}
+
+// Add an expiry to the TTL index of the shard. When it is full, the expiries of
+// the entries replaced since they were added are dropped first
+static void ttl_push(dns_mem_shard_t *shard, long long expires,
+                     unsigned int bucket, int way) {
+  if (shard->nttls == shard->ttls_cap) {
+    int n = 0;
+    for (int i = 0; i < shard->nttls; i++)
+      if (ttl_current(shard, &shard->ttls[i]))
+        shard->ttls[n++] = shard->ttls[i];
+    shard->nttls = n;
+    for (int i = n / 2 - 1; i >= 0; i--)
+      ttl_sift_down(shard, i);
+    if (n == shard->ttls_cap)
+      return;  // the arena reclaims the entry in time
+  }
+
+  dns_mem_expiry_t e = {expires, bucket, way};
+  int i = shard->nttls++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (shard->ttls[parent].expires <= expires)
+      break;
+    shard->ttls[i] = shard->ttls[parent];
+    i = parent;
+  }
+  shard->ttls[i] = e;
+}
+
+// Evict the entries of the shard that can no longer be served, even stale, in
+// the order of the TTL index. Their bytes are reclaimed when the tail of the
+// arena gets to them
+static void expire_entries(dns_mem_shard_t *shard, long long now) {
+  while (shard->nttls && shard->ttls[0].expires <= now) {
+    dns_mem_expiry_t e = shard->ttls[0];
+    shard->ttls[0] = shard->ttls[--shard->nttls];
+    if (shard->nttls)
+      ttl_sift_down(shard, 0);
+    if (!ttl_current(shard, &e))
+      continue;  // replaced since
+
+    dns_mem_bucket_t *bucket = &shard->buckets[e.bucket];
+    begin_write(bucket);
+    bucket->hashes[e.way] = 0;
+    end_write(bucket);
+    shard->entries--;
+    shard->expired++;
+  }
+}
+
+// Store the answer to (key, qtype), of the given hash, len bytes of msg
+// stored at now and expiring at expires, in place of the previous one
+void memcache_put(dns_memcache_t *mc, char *key, unsigned int hash,
+                  unsigned short qtype, char *msg, size_t len, long long now,
+                  long long expires) {
+  dns_mem_shard_t *shard = &mc->shards[hash % MEM_SHARDS];
+  unsigned int b = hash / MEM_SHARDS % shard->nbuckets;
+  dns_mem_bucket_t *bucket = &shard->buckets[b];
+  size_t key_len = strlen(key) + 1;
+  size_t size = (sizeof(mem_entry_t) + key_len + len + 7) & ~(size_t) 7;
+
+  pthread_mutex_lock(&shard->lock);
+  expire_entries(shard, now);
+
+  // No way points to the bytes taken, so readers can't see them yet
+  size_t offset = make_room(shard, size, now);
+  mem_entry_t *entry = (mem_entry_t *) (shard->arena + offset);
+  entry->hash = hash;
+  entry->size = (unsigned int) size;
+  entry->stored = now;
+  entry->expires = expires;
+  entry->qtype = qtype;
+  entry->len = (unsigned short) len;
+  entry->key_len = (unsigned short) key_len;
+  memcpy(entry + 1, key, key_len);
+  memcpy((char *) (entry + 1) + key_len, msg, len);
+
+  // Reuse the way of the key, or an empty one, or else evict the entry that
+  // expires first, among those not asked for since the hand passed if any
+  int way = -1, empty = -1, victim = -1;
+  bool victim_ref = false;
+  long long victim_expires = 0;
+  for (int i = 0; i < MEM_WAYS && way < 0; i++) {
+    if (bucket->hashes[i] == 0) {
+      if (empty < 0)
+        empty = i;
+      continue;
+    }
+    mem_entry_t *old = entry_at(shard, bucket->offsets[i]);
+    bool ref = shard->meta[b * MEM_WAYS + i].ref;
+    if (entry_matches(shard, old, bucket->offsets[i], key, key_len, hash,
+                      qtype))
+      way = i;
+    else if (victim < 0 || ref < victim_ref
+             || (ref == victim_ref && old->expires < victim_expires)) {
+      victim = i;
+      victim_ref = ref;
+      victim_expires = old->expires;
+    }
+  }
+  bool same = way >= 0;
+  if (!same)
+    way = empty >= 0 ? empty : victim;
+
+  if (!same && bucket->hashes[way])
+    shard->evicted++;
+  else if (!same)
+    shard->entries++;
+  dns_mem_meta_t *meta = &shard->meta[b * MEM_WAYS + way];
+  begin_write(bucket);
+  bucket->hashes[way] = hash;
+  bucket->offsets[way] = (unsigned int) offset;
+  // A refreshed answer stays hot for a while, unless it stops being asked for
+  unsigned int hits = __atomic_load_n(&meta->hits, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->hits, same ? hits / 2 : 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->refreshing, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&meta->ref, false, __ATOMIC_RELAXED);
+  end_write(bucket);
+
+  ttl_push(shard, expires + STALE_MAX_SEC, b, way);
+  pthread_mutex_unlock(&shard->lock);
+}
+
+// Print the counters of the in-memory cache, summed over its shards
+void memcache_summary(dns_memcache_t *mc) {
+  unsigned long long entries = 0, evicted = 0, expired = 0, moved = 0;
+  size_t used = 0;
+  for (int i = 0; i < MEM_SHARDS; i++) {
+    dns_mem_shard_t *shard = &mc->shards[i];
+    pthread_mutex_lock(&shard->lock);
+    entries += shard->entries;
+    evicted += shard->evicted;
+    expired += shard->expired;
+    moved += shard->moved;
+    used += shard->head - shard->tail;
+    pthread_mutex_unlock(&shard->lock);
+  }
+  fprintf(stderr, ";; memory cache: %llu entries, %zu KB of the arenas in use, "
+          "%llu evicted, %llu expired, %llu kept by the CLOCK hand\n", entries,
+          used >> 10, evicted, expired, moved);
+}
+
+// Free an in-memory cache, once no thread uses it
+void memcache_free(dns_memcache_t *mc) {
+  if (mc == NULL)
+    return;
+  for (int i = 0; i < MEM_SHARDS; i++) {
+    dns_mem_shard_t *shard = &mc->shards[i];
+    pthread_mutex_destroy(&shard->lock);
+    free(shard->buckets);
+    free(shard->meta);
+    free(shard->arena);
+    free(shard->ttls);
+  }
+  free(mc);
+}
@@ -0,0 +1,440 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define OUT_RECORD_SIZE 65536  // largest JSON record, longer ones are cut
+
+/* Output being built, written out with a single call once complete */
+typedef struct {
+  char *p, *end;
+  bool full;                // something didn't fit and was left out
+} out_buf_t;
+
+static __thread char record[OUT_RECORD_SIZE];
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char *rcode_names[] = {
+    "NOERROR", "FORMERR", "SERVFAIL", "NXDOMAIN", "NOTIMP", "REFUSED"
+};
+static const char *status_names[] = {
+    "NOERROR", "NORESPONSE", "SENDERROR", "RECVERROR", "NOSERVER"
+};
+
+// Append n bytes to the buffer
+static void put(out_buf_t *b, const char *s, size_t n) {
+  if (n > (size_t) (b->end - b->p)) {
+    b->full = true;
+    return;
+  }
+  memcpy(b->p, s, n);
+  b->p += n;
+}
+
+// Append a string literal or a NUL-terminated string
+static void put_str(out_buf_t *b, const char *s) {
+  put(b, s, strlen(s));
+}
+
+// Append a number in decimal
+static void put_uint(out_buf_t *b, unsigned long long v) {
+  char digits[20];
+  int n = 0;
+  do {
+    digits[sizeof(digits) - ++n] = (char) ('0' + v % 10);
+    v /= 10;
+  } while (v);
+  put(b, digits + sizeof(digits) - n, n);
+}
+
+// Append n bytes as the contents of a JSON string. Bytes that aren't
+// printable ASCII are escaped, so the output is valid UTF-8 whatever the
+// labels hold
+static void put_escaped(out_buf_t *b, const char *s, size_t n) {
+  size_t start = 0;
+  for (size_t i = 0; i < n; i++) {
+    unsigned char c = (unsigned char) s[i];
+    if (c >= 0x20 && c < 0x7F && c != '"' && c != '\\')
+      continue;
+
+    char esc[6] = {'\\', 'u', '0', '0', hex_digits[c >> 4],
+                   hex_digits[c & 0xF]};
+    put(b, s + start, i - start);
+    if (c == '"' || c == '\\')
+      put(b, (char[]) {'\\', (char) c}, 2);
+    else
+      put(b, esc, sizeof(esc));
+    start = i + 1;
+  }
+  put(b, s + start, n - start);
+}
+
+// Append a quoted JSON string
+static void put_json_str(out_buf_t *b, const char *s, size_t n) {
+  put(b, "\"", 1);
+  put_escaped(b, s, n);
+  put(b, "\"", 1);
+}
+
+// Append a "key": prefix, after a comma unless first
+static void put_key(out_buf_t *b, const char *key, bool first) {
+  put_str(b, first ? "\"" : ", \"");
+  put_str(b, key);
+  put(b, "\": ", 3);
+}
+
+// Append the name of a type, or TYPEnnn (RFC 3597) for unknown ones
+static void put_type(out_buf_t *b, unsigned short type) {
+  const char *name = rr_type_name(type);
+  put(b, "\"", 1);
+  if (name) {
+    put_str(b, name);
+  } else {
+    put_str(b, "TYPE");
+    put_uint(b, type);
+  }
+  put(b, "\"", 1);
+}
+
+// Append the name at offset in msg. Return false if it is malformed
+static bool put_name(out_buf_t *b, dns_msg_t *msg, int offset) {
+  char name[MAX_NAME_LEN];
+  int len = msg_name(msg, offset, name);
+  if (len < 0)
+    return false;
+  put(b, name, len);
+  return true;
+}
+
+// Append n bytes as a quoted character string
+static void put_quoted(out_buf_t *b, unsigned char *s, int n) {
+  put(b, "\"", 1);
+  for (int i = 0; i < n; i++) {
+    if (s[i] == '"' || s[i] == '\\')
+      put(b, "\\", 1);
+    put(b, (char *) s + i, 1);
+  }
+  put(b, "\"", 1);
+}
+
+// Append n bytes in hex
+static void put_hex(out_buf_t *b, unsigned char *s, int n) {
+  for (int i = 0; i < n; i++) {
+    char hex[2] = {hex_digits[s[i] >> 4], hex_digits[s[i] & 0xF]};
+    put(b, hex, 2);
+  }
+}
+
+/* The rdata formatters of the types of RR_TYPES. Each appends the rdata of
+ * rr in presentation format, returning false if it is malformed */
+
+static bool put_a(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  unsigned char *rdata = (unsigned char *) msg->buf + rr->rdata;
+  if (rr->rdlength != 4)
+    return false;
+  for (int i = 0; i < 4; i++) {
+    if (i)
+      put(b, ".", 1);
+    put_uint(b, rdata[i]);
+  }
+  return true;
+}
+
+static bool put_aaaa(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  char addr[INET6_ADDRSTRLEN];
+  if (rr->rdlength != 16
+      || !inet_ntop(AF_INET6, msg->buf + rr->rdata, addr, sizeof(addr)))
+    return false;
+  put_str(b, addr);
+  return true;
+}
+
+// NS, CNAME and PTR
+static bool put_name_rdata(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  return put_name(b, msg, rr->rdata);
+}
+
+static bool put_mx(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  if (rr->rdlength < 3)
+    return false;
+  put_uint(b, get16(msg->buf + rr->rdata));
+  put(b, " ", 1);
+  return put_name(b, msg, rr->rdata + 2);
+}
+
+static bool put_soa(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  int end = rr->rdata + rr->rdlength;
+  int rname = skip_name(msg->buf, end, rr->rdata);
+  int offset = rname < 0 ? -1 : skip_name(msg->buf, end, rname);
+  if (offset < 0 || offset + 20 > end || !put_name(b, msg, rr->rdata))
+    return false;
+  put(b, " ", 1);
+  put_name(b, msg, rname);
+  for (int i = 0; i < 5; i++) {
+    put(b, " ", 1);
+    put_uint(b, get32(msg->buf + offset + 4 * i));
+  }
+  return true;
+}
+
+static bool put_txt(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  unsigned char *rdata = (unsigned char *) msg->buf + rr->rdata;
+  for (int i = 0; i < rr->rdlength;) {
+    int len = rdata[i++];
+    if (i + len > rr->rdlength)
+      return false;
+    if (i > 1)
+      put(b, " ", 1);
+    put_quoted(b, rdata + i, len);
+    i += len;
+  }
+  return true;
+}
+
+// Priority, weight, port and target (RFC 2782)
+static bool put_srv(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  char *rdata = msg->buf + rr->rdata;
+  if (rr->rdlength < 7)
+    return false;
+  for (int i = 0; i < 3; i++) {
+    put_uint(b, get16(rdata + 2 * i));
+    put(b, " ", 1);
+  }
+  return put_name(b, msg, rr->rdata + 6);
+}
+
+// Key tag, algorithm, digest type and digest (RFC 4034)
+static bool put_ds(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  unsigned char *rdata = (unsigned char *) msg->buf + rr->rdata;
+  if (rr->rdlength < 5)
+    return false;
+  put_uint(b, get16((char *) rdata));
+  put(b, " ", 1);
+  put_uint(b, rdata[2]);
+  put(b, " ", 1);
+  put_uint(b, rdata[3]);
+  put(b, " ", 1);
+  put_hex(b, rdata + 4, rr->rdlength - 4);
+  return true;
+}
+
+// Flags, tag and value (RFC 8659)
+static bool put_caa(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  unsigned char *rdata = (unsigned char *) msg->buf + rr->rdata;
+  int tag_len = rr->rdlength >= 2 ? rdata[1] : 0;
+  if (tag_len == 0 || 2 + tag_len > rr->rdlength)
+    return false;
+  put_uint(b, rdata[0]);
+  put(b, " ", 1);
+  put(b, (char *) rdata + 2, tag_len);
+  put(b, " ", 1);
+  put_quoted(b, rdata + 2 + tag_len, rr->rdlength - 2 - tag_len);
+  return true;
+}
+
+// The EDNS parameters an OPT pseudo-record holds in its class and TTL
+static bool put_opt(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  put_str(b, "; EDNS: version: ");
+  put_uint(b, (rr->ttl >> 16) & 0xFF);
+  put_str(b, rr->ttl & 0x8000 ? ", flags: do; udp: " : ", flags:; udp: ");
+  put_uint(b, rr->class);
+  return true;
+}
+
+// Any other type, in the generic \# format (RFC 3597)
+static bool put_generic(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  put_str(b, "\\# ");
+  put_uint(b, rr->rdlength);
+  if (rr->rdlength)
+    put(b, " ", 1);
+  put_hex(b, (unsigned char *) msg->buf + rr->rdata, rr->rdlength);
+  return true;
+}
+
+static bool (*const rdata_formatters[RR_COUNT])(out_buf_t *, dns_msg_t *,
+                                                dns_record_t *) = {
+  [RR_GENERIC] = put_generic,
+#define RR_FORMATTER(name, value, formatter) [RR_##name] = formatter,
+  RR_TYPES(RR_FORMATTER)
+#undef RR_FORMATTER
+};
+
+// Append the rdata of rr in presentation format. Return false if it is
+// malformed
+static bool put_rdata(out_buf_t *b, dns_msg_t *msg, dns_record_t *rr) {
+  return rdata_formatters[rr_index(rr->type)](b, msg, rr);
+}
+
+// Format the rdata of the record rr of msg as text into dest, of size size
+void format_rdata(dns_msg_t *msg, dns_record_t *rr, char *dest, size_t size) {
+  out_buf_t b = {dest, dest + size - 1, false};
+  if (!put_rdata(&b, msg, rr)) {
+    b.p = dest;
+    put_str(&b, "MALFORMED");
+  }
+  *b.p = 0;
+}
+
+// Append the records of a section as a JSON array under key
+static void put_section(out_buf_t *b, dns_msg_t *msg, enum section section,
+                        const char *key) {
+  char text[2 * MAX_MSG_LEN];
+  int count;
+  dns_record_t *rr = msg_section(msg, section, &count);
+  bool first = true;
+
+  put_key(b, key, false);
+  put(b, "[", 1);
+  for (int i = 0; i < count; i++, rr++) {
+    if (rr->type == OPT)
+      continue;  // in "edns"
+
+    put_str(b, first ? "{" : ", {");
+    first = false;
+    out_buf_t t = {text, text + sizeof(text), false};
+    put_key(b, "name", true);
+    if (put_name(&t, msg, rr->name))
+      put_json_str(b, text, t.p - text);
+    else
+      put_str(b, "null");
+
+    if (section != QUESTION) {
+      put_key(b, "ttl", false);
+      put_uint(b, rr->ttl);
+    }
+    put_key(b, "class", false);
+    put_str(b, rr->class == 1 ? "\"IN\"" : "\"UNDEFINED\"");
+    put_key(b, "type", false);
+    put_type(b, rr->type);
+
+    if (section != QUESTION) {
+      t.p = text;
+      put_key(b, "data", false);
+      if (put_rdata(&t, msg, rr) && !t.full)
+        put_json_str(b, text, t.p - text);
+      else
+        put_str(b, "null");
+    }
+    put(b, "}", 1);
+  }
+  put(b, "]", 1);
+}
+
+// Append the header of msg: its flags, RCODE, and EDNS parameters if any
+static void put_header(out_buf_t *b, dns_msg_t *msg) {
+  dns_header_t header = msg->header;
+  unsigned short id = ntohs(header.id);
+  bool flags[] = {header.qr, header.aa, header.tc, header.rd, header.ra};
+  const char *flag_names[] = {"qr", "aa", "tc", "rd", "ra"};
+
+  put_key(b, "id", false);
+  put_uint(b, id);
+  put_key(b, "opcode", false);
+  put_uint(b, header.opcode);
+  put_key(b, "rcode", false);
+  if (header.rcode < 6) {
+    put(b, "\"", 1);
+    put_str(b, rcode_names[header.rcode]);
+    put(b, "\"", 1);
+  } else {
+    put_uint(b, header.rcode);
+  }
+  put_key(b, "flags", false);
+  put(b, "[", 1);
+  for (int i = 0, n = 0; i < 5; i++) {
+    if (!flags[i])
+      continue;
+    put_str(b, n++ ? ", \"" : "\"");
+    put_str(b, flag_names[i]);
+    put(b, "\"", 1);
+  }
+  put(b, "]", 1);
+
+  dns_record_t *opt = msg_opt(msg);
+  if (opt) {
+    put_key(b, "edns", false);
+    put_str(b, "{\"udp\": ");
+    put_uint(b, opt->class);
+    put_str(b, ", \"version\": ");
+    put_uint(b, (opt->ttl >> 16) & 0xFF);
+    put_str(b, opt->ttl & 0x8000 ? ", \"do\": true}" : ", \"do\": false}");
+  }
+}
+
+// Append what was asked and the outcome of a query
+static void put_outcome(out_buf_t *b, dns_query_t *query,
+                        enum error_status status) {
+  put_key(b, "name", true);
+  put_json_str(b, query->name, strlen(query->name));
+  put_key(b, "type", false);
+  put_type(b, (unsigned short) query->qtype);
+  put_key(b, "status", false);
+  put(b, "\"", 1);
+  put_str(b, status_names[status]);
+  put(b, "\"", 1);
+}
+
+// Append where the answer to a query came from and its contents
+static void put_answer(out_buf_t *b, dns_msg_t *ans, char *server) {
+  put_key(b, "server", false);
+  put_json_str(b, server, strlen(server));
+  put_key(b, "size", false);
+  put_uint(b, ans->len);
+  put_header(b, ans);
+  put_section(b, ans, QUESTION, "question");
+  put_section(b, ans, ANSWER, "answer");
+  put_section(b, ans, AUTHORITY, "authority");
+  put_section(b, ans, ADDITIONAL, "additional");
+}
+
+// Print a finished query as one line of JSON: the name and type asked, the
+// outcome, and for answers the server, header flags, EDNS parameters and
+// every section with its records and TTLs. The line is built in a buffer of
+// the calling thread and written with a single call
+void print_json(dns_query_t *query, enum error_status status, dns_msg_t *ans,
+                char *server) {
+  out_buf_t b = {record, record + OUT_RECORD_SIZE - 1, false};
+
+  put(&b, "{", 1);
+  put_outcome(&b, query, status);
+  if (status == NOERROR) {
+    char *start = b.p;
+    put_answer(&b, ans, server);
+    if (b.full) {
+      // Too large to print in full, only the outcome is left
+      b.p = start;
+      b.full = false;
+      put_str(&b, ", \"error\": \"answer too large to print\"");
+    }
+  }
+  put(&b, "}\n", 2);
+  fwrite(record, 1, b.p - record, output());
+}
+
+// Print a finished query as a binary record, all numbers big endian:
+//   u32 length of the rest of the record
+//   u8 status (enum error_status), u16 server index (0xFFFF for none or cache)
+//   u16 type, u8 name length, name (without the trailing dot)
+//   u16 answer length, answer in wire format (empty unless NOERROR)
+void print_binary(dns_query_t *query, enum error_status status,
+                  dns_msg_t *ans) {
+  size_t name_len = strlen(query->name);
+  size_t ans_len = status == NOERROR && ans->len <= UINT16_MAX ? ans->len : 0;
+  size_t len = 4 + 1 + 2 + 2 + 1 + name_len + 2 + ans_len;
+  char head[4 + 1 + 2 + 2 + 1 + MAX_NAME_LEN + 2];
+
+  put32(head, (unsigned int) (len - 4));
+  head[4] = (char) status;
+  put16(head + 5, (unsigned short) (status == NOERROR && query->server >= 0
+                                    ? query->server : 0xFFFF));
+  put16(head + 7, (unsigned short) query->qtype);
+  head[9] = (char) name_len;
+  memcpy(head + 10, query->name, name_len);
+  put16(head + 10 + name_len, (unsigned short) ans_len);
+
+  FILE *f = output();
+  fwrite(head, 1, len - ans_len, f);
+  if (ans_len)
+    fwrite(ans->buf, 1, ans_len, f);
+}
@@ -4,159 +4,147 @@
 
 #include "dnsclient.h"
 
-// Print a message (printf-like arguments) to both stdout and fd
-void print_and_log(int fd, char *msg,...) {
-  char buf[BUFLEN];
-  va_list args;
-  va_start(args, msg);
-  vsprintf(buf, msg, args);
-  write(fd, buf, strlen(buf));
-  printf("%s", buf);
-  va_end(args);
-}
+static __thread FILE *out;  // where the calling thread prints, stdout if NULL
 
+// Print the answers of the calling thread to f instead of stdout (NULL to go
+// back to stdout), e.g. to a private buffer of each worker thread
+void print_set_output(FILE *f) {
+  out = f;
+}
 
-// Save message of length len in MSG_LOG as hex segments
-void log_msg(char *msg, size_t len) {
-  int fd = open(MSG_LOG, O_CREAT | O_APPEND | O_WRONLY, 0755);
-
-  if (fd < 0)
-    error("Could not open message log file.\n");
-
-  char hex[10];
+// Get where the calling thread prints answers
+FILE *output() {
+  return out ? out : stdout;
+}
 
-  for (int i = 0; i < len; i++) {
-    sprintf(hex, "%02X ", msg[i]);
-    write(fd, hex, 3);
-  }
+// Print a message (printf-like arguments) to both the output and a log file
+void print_and_log(int file, char *msg,...) {
+  char buf[2 * MAX_MSG_LEN];
+  va_list args;
+  va_start(args, msg);
+  int len = vsnprintf(buf, sizeof(buf), msg, args);
+  va_end(args);
 
-  write(fd, "\n", 1);
-  close(fd);
+  if (len >= (int) sizeof(buf))
+    len = sizeof(buf) - 1;
+  fwrite(buf, 1, len, output());
+  log_write(file, buf, len);
 }
 
 // Print header using the host -v command format
 void print_header(dns_header_t header) {
-  printf(";; ->>HEADER<<- opcode: ");
+  FILE *f = output();
+
+  fprintf(f, ";; ->>HEADER<<- opcode: ");
   switch (header.opcode) {
-    case 0: printf("QUERY");
+    case 0: fprintf(f, "QUERY");
       break;
-    case 1: printf("IQUERY");
+    case 1: fprintf(f, "IQUERY");
       break;
-    case 2: printf("STATUS");
+    case 2: fprintf(f, "STATUS");
       break;
-    default: printf("INVALID");
+    default: fprintf(f, "INVALID");
   }
-  printf(", status: ");
+  fprintf(f, ", status: ");
   switch (header.rcode) {
-    case 0: printf("NOERROR");
+    case 0: fprintf(f, "NOERROR");
       break;
-    case 1: printf("FORMATERROR");
+    case 1: fprintf(f, "FORMATERROR");
       break;
-    case 2: printf("SERVERFAILURE");
+    case 2: fprintf(f, "SERVERFAILURE");
       break;
-    case 3: printf("NAMEERROR");
+    case 3: fprintf(f, "NAMEERROR");
       break;
-    case 4: printf("NOTIMPLEMENTED");
+    case 4: fprintf(f, "NOTIMPLEMENTED");
       break;
-    case 5: printf("REFUSED");
+    case 5: fprintf(f, "REFUSED");
       break;
-    default: printf("INVALID");
+    default: fprintf(f, "INVALID");
   }
-  printf(", id: %d\n;; flags:", header.id);
+  fprintf(f, ", id: %d\n;; flags:", ntohs(header.id));
   if (header.qr)
-    printf(" qr");
+    fprintf(f, " qr");
   if (header.aa)
-    printf(" aa");
+    fprintf(f, " aa");
   if (header.tc)
-    printf(" tc");
+    fprintf(f, " tc");
   if (header.rd)
-    printf(" rd");
+    fprintf(f, " rd");
   if (header.ra)
-    printf(" ra");
-  printf("; QUERY: %d, ANSWER: %d, AUTHORITY: %d, ADDITIONAL: %d\n\n",
-         header.qdcount, header.ancount, header.nscount, header.arcount);
+    fprintf(f, " ra");
+  fprintf(f, "; QUERY: %d, ANSWER: %d, AUTHORITY: %d, ADDITIONAL: %d\n\n",
+          header.qdcount, header.ancount, header.nscount, header.arcount);
 }
 
-// Interpret, print and log a number of count rdata sections starting at the
-// address ans + offset
-void parse_rrdata(int count, char *ans, int *offset, int fd) {
-  char name[BUFLEN], qclass[MAX_QUERY_LEN], qtype[MAX_QUERY_LEN], *rdata = NULL;
-  while (count) {
-    *offset += decompress_string(ans, name, *offset);
-    dns_rr_t rr = get_rr(ans + *offset);
-
-    *offset += sizeof(dns_rr_t) - 2;
-
-    get_qclass_string(qclass, rr.class);
-    get_qtype_string(qtype, rr.type);
-    rdata = get_rdata(ans, rr, *offset);
-    print_and_log(fd, ";%s %s %s %s\n", name, qclass, qtype, rdata);
-
-    *offset += rr.rdlength;
+// Print and log the count records of a section of msg, starting at rr
+static void print_records(dns_msg_t *msg, dns_record_t *rr, int count) {
+  char name[MAX_NAME_LEN], qclass[MAX_QUERY_LEN], qtype[MAX_QUERY_LEN];
+  char rdata[2 * MAX_MSG_LEN];
+
+  for (int i = 0; i < count; i++, rr++) {
+    if (rr->type == OPT)
+      continue;  // printed as a pseudo-section
+    if (msg_name(msg, rr->name, name) < 0)
+      strcpy(name, "MALFORMED");
+    get_qclass_string(qclass, rr->class);
+    get_qtype_string(qtype, rr->type);
+    format_rdata(msg, rr, rdata, sizeof(rdata));
+    print_and_log(LOG_DNS, ";%s %s %s %s\n", name, qclass, qtype, rdata);
+  }
+}
 
-    count--;
+// Print and log a section of msg, with its title
+static void print_section(dns_msg_t *msg, enum section section, char *title) {
+  int count, records = 0;
+  dns_record_t *rr = msg_section(msg, section, &count);
+  for (int i = 0; i < count; i++)
+    records += rr[i].type != OPT;
+
+  if (records) {
+    print_and_log(LOG_DNS, ";; %s SECTION:\n", title);
+    print_records(msg, rr, count);
+    print_and_log(LOG_DNS, "\n");
   }
-  if (rdata != NULL)
-    free(rdata);
 }
 
-// Print and log the sections in the received answer at address ans
-dns_header_t parse_answer(char *ans, char *server) {
-  char qname[BUFLEN], buf[BUFLEN], qtype[MAX_QUERY_LEN], qclass[MAX_QUERY_LEN];
-  int offset = 0, len;
-  dns_header_t header = get_header(ans);
-  offset += sizeof(dns_header_t);
+// Print and log the sections of the parsed answer msg
+dns_header_t print_answer(dns_msg_t *msg, char *server) {
+  char qname[MAX_NAME_LEN] = "", buf[BUFLEN];
+  char qtype[MAX_QUERY_LEN] = "", qclass[MAX_QUERY_LEN];
+  dns_header_t header = msg->header;
 
   if (header.rcode != 0)
     return header;
 
   print_header(header);
 
-  if (header.qdcount) {
-    printf(";; QUESTION SECTION:\n");
-
-    while (header.qdcount) {
-      len = decompress_string(ans, qname, offset);
-      offset += len;
-      dns_question_t question = get_question(ans + offset);
-      offset += sizeof(question);
-
-      get_qtype_string(qtype, question.qtype);
-      get_qclass_string(qclass, question.qclass);
-      printf(";%s %s %s\n\n", qname, qclass, qtype);
-
-      header.qdcount--;
-    }
+  dns_record_t *opt = msg_opt(msg);
+  if (opt) {
+    format_rdata(msg, opt, buf, BUFLEN);
+    fprintf(output(), ";; OPT PSEUDOSECTION:\n%s\n\n", buf);
   }
 
-  int fd = open(DNS_LOG, O_APPEND | O_CREAT | O_WRONLY, 0755);
-
-  if (fd < 0)
-    error("Could not open message log file.\n");
-
-  sprintf(buf, "; %s - %s %s\n\n", server, qname, qtype);
-  write(fd, buf, strlen(buf));
-
-  if (header.ancount) {
-    print_and_log(fd, ";; ANSWER SECTION:\n");
-    parse_rrdata(header.ancount, ans, &offset, fd);
-    print_and_log(fd, "\n");
-  }
-
-  if (header.nscount) {
-    print_and_log(fd, ";; AUTHORITY SECTION:\n");
-    parse_rrdata(header.nscount, ans, &offset, fd);
-    print_and_log(fd, "\n");
+  int count;
+  dns_record_t *question = msg_section(msg, QUESTION, &count);
+  if (count) {
+    fprintf(output(), ";; QUESTION SECTION:\n");
+
+    for (int i = 0; i < count; i++, question++) {
+      if (msg_name(msg, question->name, qname) < 0)
+        strcpy(qname, "MALFORMED");
+      get_qtype_string(qtype, question->type);
+      get_qclass_string(qclass, question->class);
+      fprintf(output(), ";%s %s %s\n\n", qname, qclass, qtype);
+    }
   }
 
-  if (header.arcount) {
-    print_and_log(fd, ";; ADDITIONAL SECTION:\n");
-    parse_rrdata(header.arcount, ans, &offset, fd);
-    print_and_log(fd, "\n");
-  }
+  int len = snprintf(buf, BUFLEN, "; %s - %s %s\n\n", server, qname, qtype);
+  log_write(LOG_DNS, buf, len < BUFLEN ? len : BUFLEN - 1);
 
-  write(fd, "\n", strlen("\n"));
+  print_section(msg, ANSWER, "ANSWER");
+  print_section(msg, AUTHORITY, "AUTHORITY");
+  print_section(msg, ADDITIONAL, "ADDITIONAL");
 
-  close(fd);
+  log_write(LOG_DNS, "\n", strlen("\n"));
   return header;
-}
\ No newline at end of file
+}
@@ -0,0 +1,200 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+// Write the output buffered by a worker to stdout in one call, so the output
+// of the workers is only mixed between whole answers
+static void flush_output(FILE **out, char **buf, size_t *size) {
+  if (*out) {
+    fclose(*out);
+    fwrite(*buf, 1, *size, stdout);
+    free(*buf);
+  }
+  *out = open_memstream(buf, size);
+  print_set_output(*out);  // NULL (stdout) if it couldn't be opened
+}
+
+// Move the names waiting in the ring of the worker to its resolver, as long as
+// its window has room
+static void take_names(dns_worker_t *w) {
+  unsigned long head = __atomic_load_n(&w->head, __ATOMIC_ACQUIRE);
+  while (w->tail != head && w->res.active < w->res.window) {
+    dns_pool_item_t *item = &w->queue[w->tail % POOL_QUEUE];
+    resolver_submit(&w->res, item->name, item->qtype, w->pool->callback, w);
+    __atomic_store_n(&w->tail, w->tail + 1, __ATOMIC_RELEASE);
+  }
+}
+
+// Worker thread: resolve the names of its ring until the pool is finished
+static void *worker_run(void *arg) {
+  dns_worker_t *w = arg;
+  FILE *out = NULL;
+  char *buf = NULL;
+  size_t size = 0;
+  uint64_t count;
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(w->cpu, &cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+  flush_output(&out, &buf, &size);
+  for (;;) {
+    take_names(w);
+
+    // Sleep only if nothing arrived after the flag was raised, otherwise the
+    // producer may have missed it
+    __atomic_store_n(&w->sleeping, true, __ATOMIC_SEQ_CST);
+    bool waiting = __atomic_load_n(&w->head, __ATOMIC_SEQ_CST) != w->tail
+        && w->res.active < w->res.window;
+    bool eof = __atomic_load_n(&w->pool->eof, __ATOMIC_SEQ_CST);
+    if (eof && w->tail == __atomic_load_n(&w->head, __ATOMIC_ACQUIRE)
+        && w->res.active == 0)
+      break;
+
+    resolver_process(&w->res, waiting ? 0 : -1);
+    __atomic_store_n(&w->sleeping, false, __ATOMIC_RELAXED);
+    if (read(w->evfd, &count, sizeof(count)) < 0)
+      count = 0;  // EAGAIN: woken by something else
+
+    if (out && ftello(out) > POOL_OUT_SIZE)
+      flush_output(&out, &buf, &size);
+  }
+
+  if (out) {
+    fclose(out);
+    fwrite(buf, 1, size, stdout);
+    free(buf);
+  }
+  return NULL;
+}
+
+// Wake a worker waiting for events
+static void wake_worker(dns_worker_t *w) {
+  uint64_t one = 1;
+  if (write(w->evfd, &one, sizeof(one)) < 0)
+    return;  // the counter is already set, it will wake anyway
+}
+
+// Let the first nthreads workers finish what they were given and wait for
+// them to stop
+static void stop_workers(dns_pool_t *pool, int nthreads) {
+  __atomic_store_n(&pool->eof, true, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < nthreads; i++)
+    wake_worker(&pool->workers[i]);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(pool->workers[i].thread, NULL);
+}
+
+// Release what the workers hold, once they stopped
+static void free_workers(dns_pool_t *pool) {
+  for (int i = 0; i < pool->nworkers; i++) {
+    dns_worker_t *w = &pool->workers[i];
+    if (w->started)
+      resolver_free(&w->res);
+    if (w->evfd >= 0)
+      close(w->evfd);
+    free(w->servers);
+  }
+  free(pool->workers);
+}
+
+// Start a pool of opts->threads workers, one per core, each resolving with
+// its own resolver and a window of opts->window queries. The callback runs in
+// the worker threads, where the print functions write to a buffer of the
+// worker. Return false if the pool can't be started
+bool pool_start(dns_pool_t *pool, dns_server_t *servers, int nservers,
+                dns_options_t *opts, dns_callback_t callback) {
+  memset(pool, 0, sizeof(*pool));
+  pool->servers = servers;
+  pool->nservers = nservers;
+  pool->opts = opts;
+  pool->callback = callback;
+  pool->nworkers = opts->threads;
+  pool->workers = calloc(pool->nworkers, sizeof(dns_worker_t));
+  if (pool->workers == NULL)
+    return false;
+
+  long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+  for (int i = 0; i < pool->nworkers; i++) {
+    dns_worker_t *w = &pool->workers[i];
+    w->pool = pool;
+    w->cpu = ncpus > 0 ? (int) (i % ncpus) : 0;
+    w->evfd = eventfd(0, EFD_NONBLOCK);
+    w->servers = malloc(nservers * sizeof(dns_server_t));
+
+    bool ok = w->evfd >= 0 && (w->servers || nservers == 0);
+    if (ok) {
+      memcpy(w->servers, servers, nservers * sizeof(dns_server_t));
+      ok = w->started = resolver_init(&w->res, w->servers, nservers,
+                                      opts->window);
+    }
+    if (ok) {
+      resolver_set_options(&w->res, opts);
+      struct epoll_event ev;
+      ev.events = EPOLLIN;
+      ev.data.fd = w->evfd;
+      ok = epoll_ctl(resolver_fd(&w->res), EPOLL_CTL_ADD, w->evfd, &ev) == 0;
+    }
+    if (!ok) {
+      pool->nworkers = i + 1;
+      free_workers(pool);
+      return false;
+    }
+  }
+
+  for (int i = 0; i < pool->nworkers; i++) {
+    if (pthread_create(&pool->workers[i].thread, NULL, worker_run,
+                       &pool->workers[i]) != 0) {
+      stop_workers(pool, i);
+      free_workers(pool);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Hand name to the worker its hash picks, waiting while its ring is full. The
+// same name always goes to the same worker. Only one thread may submit
+void pool_submit(dns_pool_t *pool, char *name, enum query_type qtype) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; name[i]; i++)
+    hash = (hash ^ (unsigned char) tolower(name[i])) * 16777619u;
+  dns_worker_t *w = &pool->workers[hash % pool->nworkers];
+
+  while (w->head - __atomic_load_n(&w->tail, __ATOMIC_ACQUIRE) == POOL_QUEUE)
+    sched_yield();
+
+  dns_pool_item_t *item = &w->queue[w->head % POOL_QUEUE];
+  snprintf(item->name, MAX_NAME_LEN, "%s", name);
+  item->qtype = qtype;
+  __atomic_store_n(&w->head, w->head + 1, __ATOMIC_SEQ_CST);
+
+  if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST))
+    wake_worker(w);
+}
+
+// Write the statistics of every worker, summed, to path (see stats_write)
+bool pool_write_stats(dns_pool_t *pool, char *path) {
+  dns_resolver_t *res[pool->nworkers];
+  for (int i = 0; i < pool->nworkers; i++)
+    res[i] = &pool->workers[i].res;
+  return stats_write(path, res, pool->nworkers);
+}
+
+// Wait for the workers to resolve every name submitted, stop them, write their
+// statistics if asked to, and merge their server estimates back into the
+// servers of the pool
+void pool_finish(dns_pool_t *pool) {
+  stop_workers(pool, pool->nworkers);
+  if (pool->opts->stats_file)
+    pool_write_stats(pool, pool->opts->stats_file);
+
+  dns_server_t *copies[pool->nworkers];
+  for (int i = 0; i < pool->nworkers; i++)
+    copies[i] = pool->workers[i].servers;
+  merge_server_state(pool->servers, copies, pool->nworkers, pool->nservers);
+  free_workers(pool);
+}
@@ -0,0 +1,343 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define PCAP_MAGIC 0xA1B2C3D4u       // microsecond timestamps
+#define PCAP_MAGIC_NSEC 0xA1B23C4Du  // nanosecond timestamps
+#define PCAPNG_MAGIC 0x0A0D0D0Au
+#define LINKTYPE_NULL 0              // BSD loopback
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101             // IPv4 or IPv6, no link header
+#define LINKTYPE_LINUX_SLL 113       // tcpdump -i any
+#define LINKTYPE_LINUX_SLL2 276
+
+/* Message found in the input, by its position in the input data */
+typedef struct {
+  size_t offset;
+  size_t len;
+} replay_msg_t;
+
+static struct {
+  char *data;               // the whole input (hex dumps are decoded in place)
+  size_t len;
+  replay_msg_t *msgs;
+  size_t nmsgs, cap;
+  unsigned long long skipped;  // packets that don't hold whole messages
+  bool swapped;             // the capture is in the other byte order
+} replay;
+
+// Read the whole of path ("-" for stdin) into replay.data. Return false if it
+// can't be read
+static bool read_input(char *path) {
+  FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "rb");
+  if (f == NULL)
+    return false;
+
+  size_t cap = 1 << 20;
+  replay.data = malloc(cap);
+  while (replay.data) {
+    replay.len += fread(replay.data + replay.len, 1, cap - replay.len, f);
+    if (replay.len < cap)
+      break;
+    cap *= 2;
+    char *data = realloc(replay.data, cap);
+    if (data == NULL)
+      free(replay.data);
+    replay.data = data;
+  }
+
+  bool ok = replay.data && !ferror(f);
+  if (f != stdin)
+    fclose(f);
+  return ok;
+}
+
+// Add the message of len bytes at offset in the input. Return false if there
+// is no memory left for it
+static bool add_msg(size_t offset, size_t len) {
+  if (replay.nmsgs == replay.cap) {
+    size_t cap = replay.cap ? 2 * replay.cap : 4096;
+    replay_msg_t *msgs = realloc(replay.msgs, cap * sizeof(replay_msg_t));
+    if (msgs == NULL)
+      return false;
+    replay.msgs = msgs;
+    replay.cap = cap;
+  }
+  replay.msgs[replay.nmsgs].offset = offset;
+  replay.msgs[replay.nmsgs++].len = len;
+  return true;
+}
+
+// Get the value of a hex digit, or -1
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  c = (char) tolower(c);
+  return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+// Find the messages of a MSG_LOG dump, a line of hex bytes per message,
+// decoding them in place (a message takes fewer bytes than its dump)
+static bool load_hex() {
+  size_t out = 0, start = 0;
+  for (size_t i = 0; i < replay.len; i++) {
+    char c = replay.data[i];
+    if (c == '\n') {
+      if (out > start && !add_msg(start, out - start))
+        return false;
+      start = out;
+      continue;
+    }
+    int high = hex_value(c);
+    int low = i + 1 < replay.len ? hex_value(replay.data[i + 1]) : -1;
+    if (high >= 0 && low >= 0) {
+      replay.data[out++] = (char) (high << 4 | low);
+      i++;
+    }
+  }
+  return out == start || add_msg(start, out - start);
+}
+
+// Find the messages of a MSG_BIN_LOG dump, each prefixed by its 16-bit big
+// endian length
+static bool load_binary() {
+  size_t p = 0;
+  while (p + 2 <= replay.len) {
+    size_t len = get16(replay.data + p);
+    if (p + 2 + len > replay.len) {
+      replay.skipped++;  // cut short
+      break;
+    }
+    if (!add_msg(p + 2, len))
+      return false;
+    p += 2 + len;
+  }
+  return true;
+}
+
+// Read a 32-bit value of the capture file, in its byte order
+static unsigned int pcap32(char *p) {
+  unsigned int v;
+  memcpy(&v, p, 4);
+  return replay.swapped ? __builtin_bswap32(v) : v;
+}
+
+// Find the DNS messages in the TCP segment or UDP datagram of the given IP
+// protocol at p (len bytes): the whole payload of a datagram, or every whole
+// length-prefixed message of a segment (RFC 7766). Messages split across
+// segments aren't reassembled
+static bool add_transport(char *p, size_t len, int protocol) {
+  if (protocol == IPPROTO_UDP) {
+    if (len < 8) {
+      replay.skipped++;  // truncated header
+      return true;
+    }
+    return len == 8 || add_msg(p + 8 - replay.data, len - 8);
+  }
+
+  size_t header = len >= 20 ? (size_t) ((unsigned char) p[12] >> 4) * 4 : 0;
+  if (header < 20 || header > len) {
+    replay.skipped++;  // truncated or malformed header
+    return true;
+  }
+  p += header;
+  len -= header;
+  while (len >= 2) {
+    size_t msg_len = get16(p);
+    if (msg_len + 2 > len)
+      break;
+    if (!add_msg(p + 2 - replay.data, msg_len))
+      return false;
+    p += 2 + msg_len;
+    len -= 2 + msg_len;
+  }
+  if (len)
+    replay.skipped++;  // part of a message
+  return true;
+}
+
+// Find the DNS messages in the IPv4 or IPv6 packet at p (len bytes). Other
+// packets and fragments are skipped
+static bool add_ip(char *p, size_t len) {
+  int version = len ? (unsigned char) p[0] >> 4 : 0, protocol;
+  size_t header;
+
+  if (version == 4 && len >= 20) {
+    header = (size_t) (p[0] & 0xF) * 4;
+    size_t total = get16(p + 2);
+    if (total < len)
+      len = total;  // Ethernet padding
+    if (get16(p + 6) & 0x3FFF) {
+      replay.skipped++;  // more fragments, or not the first one
+      return true;
+    }
+    protocol = (unsigned char) p[9];
+  } else if (version == 6 && len >= 40) {
+    header = 40;
+    protocol = (unsigned char) p[6];
+    // Hop-by-hop, routing and destination options headers
+    while ((protocol == 0 || protocol == 43 || protocol == 60)
+           && header + 8 <= len) {
+      protocol = (unsigned char) p[header];
+      header += ((size_t) (unsigned char) p[header + 1] + 1) * 8;
+    }
+  } else {
+    replay.skipped++;
+    return true;
+  }
+
+  if (header < 20 || header > len
+      || (protocol != IPPROTO_UDP && protocol != IPPROTO_TCP)) {
+    replay.skipped++;
+    return true;
+  }
+  return add_transport(p + header, len - header, protocol);
+}
+
+// Find the DNS messages of a pcap capture: every UDP datagram, and the whole
+// messages of TCP segments, of the link types tcpdump writes. Other traffic is
+// skipped, so captures are best filtered with "port 53"
+static bool load_pcap() {
+  if (replay.len < 24)
+    return true;
+  unsigned int linktype = pcap32(replay.data + 20);
+  size_t p = 24;
+
+  while (p + 16 <= replay.len) {
+    size_t caplen = pcap32(replay.data + p + 8);
+    p += 16;
+    if (caplen > replay.len - p)
+      break;  // cut short
+
+    // The protocol is that of an Ethernet frame, 0 when only the IP version
+    // in the packet tells
+    char *pkt = replay.data + p;
+    size_t link = 0;
+    unsigned short protocol = 0;
+    switch (linktype) {
+      case LINKTYPE_NULL:
+        link = 4;
+        break;
+      case LINKTYPE_RAW:
+        break;
+      case LINKTYPE_ETHERNET:
+        for (link = 14; link <= caplen; link += 4) {
+          protocol = get16(pkt + link - 2);
+          if (protocol != 0x8100 && protocol != 0x88A8)
+            break;  // past the VLAN tags
+        }
+        break;
+      case LINKTYPE_LINUX_SLL:
+        link = 16;
+        protocol = caplen >= link ? get16(pkt + 14) : 0;
+        break;
+      case LINKTYPE_LINUX_SLL2:
+        link = 20;
+        protocol = caplen >= link ? get16(pkt) : 0;
+        break;
+      default:
+        return false;
+    }
+
+    bool ip = protocol == 0 || protocol == 0x0800 || protocol == 0x86DD;
+    if (ip && link < caplen) {
+      if (!add_ip(pkt + link, caplen - link))
+        return false;
+    } else {
+      replay.skipped++;
+    }
+    p += caplen;
+  }
+  return true;
+}
+
+// Load the messages of path: a pcap capture, a MSG_BIN_LOG dump (by the name
+// of its file) or a MSG_LOG hex dump
+static void load_messages(char *path) {
+  if (!read_input(path))
+    error("Could not read the replay input.\n");
+
+  unsigned int magic = 0;
+  if (replay.len >= 4)
+    memcpy(&magic, replay.data, 4);
+  if (magic == PCAPNG_MAGIC)
+    error("pcapng captures aren't supported, convert them to pcap first\n");
+
+  bool ok;
+  replay.swapped = __builtin_bswap32(magic) == PCAP_MAGIC
+      || __builtin_bswap32(magic) == PCAP_MAGIC_NSEC;
+  size_t len = strlen(path);
+  if (replay.swapped || magic == PCAP_MAGIC || magic == PCAP_MAGIC_NSEC)
+    ok = load_pcap();
+  else if (len >= 4 && strcmp(path + len - 4, ".bin") == 0)
+    ok = load_binary();
+  else
+    ok = load_hex();
+  if (!ok)
+    error("Could not load the replay input (unknown link type?)\n");
+}
+
+// Decode every message of the input (-Y file, "-" for stdin) as fast as it
+// goes, printing each in the format of the options, or not at all with
+// "-o none". The rate of messages and bytes is reported on stderr, without
+// the time it took to read the input
+void run_replay(dns_options_t *opts) {
+  static dns_msg_t msg;
+  static dns_query_t query;  // what printing takes from the question
+  unsigned long long bytes = 0, malformed = 0;
+
+  load_messages(opts->replay);
+  setvbuf(stdout, NULL, _IOFBF, POOL_OUT_SIZE);
+  query.server = -1;
+
+  long long start = now_nsec();
+  for (size_t i = 0; i < replay.nmsgs; i++) {
+    char *buf = replay.data + replay.msgs[i].offset;
+    size_t len = replay.msgs[i].len;
+    bytes += len;
+    if (!parse_msg(&msg, buf, len)) {
+      malformed++;
+      continue;
+    }
+
+    switch (opts->format) {
+      case OUT_NONE:
+        break;
+      case OUT_TEXT: {
+        dns_header_t header = print_answer(&msg, opts->replay);
+        if (header.rcode != 0)
+          print_header(header);
+        fprintf(output(), "Received %zu bytes from %s\n\n", len,
+                opts->replay);
+        break;
+      }
+      default:
+        // Named the way queries are, without the trailing dot
+        query.name[0] = 0;
+        query.qtype = NONE;
+        if (msg.header.qdcount && msg_name(&msg, msg.records[0].name,
+                                           query.name) > 0) {
+          query.qtype = (enum query_type) msg.records[0].type;
+          size_t name_len = strlen(query.name);
+          if (name_len > 1 && query.name[name_len - 1] == '.')
+            query.name[name_len - 1] = 0;
+        }
+        if (opts->format == OUT_JSON)
+          print_json(&query, NOERROR, &msg, opts->replay);
+        else
+          print_binary(&query, NOERROR, &msg);
+    }
+  }
+  fflush(stdout);
+  double secs = (now_nsec() - start) / 1e9;
+
+  fprintf(stderr, ";; replay: %zu messages, %llu malformed, %llu packets "
+          "skipped, %llu bytes in %.3f s, %.0f messages/s, %.1f MB/s\n",
+          replay.nmsgs, malformed, replay.skipped, bytes, secs,
+          secs > 0 ? replay.nmsgs / secs : 0, secs > 0 ? bytes / secs / 1e6
+                                                      : 0);
+  free(replay.msgs);
+  free(replay.data);
+}
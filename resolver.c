@@ -0,0 +1,1124 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define ID_SPACE 65536
+#define HEDGE(server) (-1 - (server))
+
+// Push a timer for the query in slot on the deadline heap. A position in the
+// order of the query marks the timeout of the query sent to that server, while
+// HEDGE(i) marks the moment the query should also be sent to the server at
+// position i. Return false if the heap can't grow
+static bool timer_push(dns_resolver_t *res, long long deadline, int slot,
+                       int pos) {
+  dns_query_t *query = &res->queries[slot];
+  if (res->ntimers == res->timers_cap) {
+    int cap = res->timers_cap ? 2 * res->timers_cap : 2 * res->window;
+    dns_timer_t *timers = realloc(res->timers, cap * sizeof(dns_timer_t));
+    if (timers == NULL)
+      return false;
+    res->timers = timers;
+    res->timers_cap = cap;
+  }
+
+  dns_timer_t timer = {deadline, slot, query->gen, pos,
+                       pos < 0 ? 0 : query->sent[pos]};
+  int i = res->ntimers++;
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (res->timers[parent].deadline <= deadline)
+      break;
+    res->timers[i] = res->timers[parent];
+    i = parent;
+  }
+  res->timers[i] = timer;
+  return true;
+}
+
+// Remove the earliest timeout from the deadline heap
+static void timer_pop(dns_resolver_t *res) {
+  dns_timer_t last = res->timers[--res->ntimers];
+  int i = 0, n = res->ntimers;
+
+  while (2 * i + 1 < n) {
+    int child = 2 * i + 1;
+    if (child + 1 < n && res->timers[child + 1].deadline
+        < res->timers[child].deadline)
+      child++;
+    if (last.deadline <= res->timers[child].deadline)
+      break;
+    res->timers[i] = res->timers[child];
+    i = child;
+  }
+  if (n)
+    res->timers[i] = last;
+}
+
+// Pick a random transaction id that isn't used by another query in flight
+static unsigned short new_id(dns_resolver_t *res) {
+  unsigned short id;
+  do {
+    id = (unsigned short) rand_r(&res->seed);
+  } while (res->by_id[id] != -1);
+  return id;
+}
+
+// Sort n server indices by expected latency. Servers that were never
+// measured come first, so that they get a sample
+static void sort_servers(dns_resolver_t *res, int *order, int n) {
+  for (int i = 1; i < n; i++) {
+    int server = order[i];
+    long long srtt = res->servers[server]->srtt;
+    int j = i;
+    while (j > 0 && res->servers[order[j - 1]]->srtt > srtt) {
+      order[j] = order[j - 1];
+      j--;
+    }
+    order[j] = server;
+  }
+}
+
+// Hash of the lowercased name and type of a query, the same for identical
+// queries
+static unsigned int query_key(char *name, enum query_type qtype) {
+  unsigned int hash = 2166136261u;
+  for (int i = 0; name[i]; i++)
+    hash = (hash ^ (unsigned char) tolower(name[i])) * 16777619u;
+  return (hash ^ (unsigned int) qtype) * 16777619u;
+}
+
+// Find the query in flight to the conf servers that is identical to the one
+// in slot, or return -1
+static int find_inflight(dns_resolver_t *res, int slot) {
+  dns_query_t *query = &res->queries[slot];
+  int other = res->inflight[query->key & res->inflight_mask];
+  while (other >= 0) {
+    dns_query_t *q = &res->queries[other];
+    if (q->key == query->key && q->qtype == query->qtype
+        && strcasecmp(q->name, query->name) == 0)
+      return other;
+    other = q->next_inflight;
+  }
+  return -1;
+}
+
+// Remove the query in slot from the queries in flight
+static void unlink_inflight(dns_resolver_t *res, int slot) {
+  int *link = &res->inflight[res->queries[slot].key & res->inflight_mask];
+  while (*link != slot)
+    link = &res->queries[*link].next_inflight;
+  *link = res->queries[slot].next_inflight;
+  res->queries[slot].inflight = false;
+}
+
+// Mark the server at position pos of the query as answered (or given up on),
+// making room in its congestion window
+static void clear_pending(dns_resolver_t *res, dns_query_t *query, int pos) {
+  if (!(query->pending & (1ULL << pos)))
+    return;
+  query->pending &= ~(1ULL << pos);
+  res->cwnds[query->order[pos]].inflight--;
+  if (res->nwaiting)
+    res->admit = true;
+}
+
+// Make the query in slot wait for room in the congestion window of server,
+// behind the queries already waiting for it
+static void wait_for_room(dns_resolver_t *res, int slot, int server) {
+  dns_query_t *query = &res->queries[slot];
+  dns_cwnd_t *cw = &res->cwnds[server];
+  query->wait_server = server;
+  query->wait_prev = cw->tail;
+  query->wait_next = -1;
+  if (cw->tail >= 0)
+    res->queries[cw->tail].wait_next = slot;
+  else
+    cw->head = slot;
+  cw->tail = slot;
+  res->nwaiting++;
+  stats_add(&res->stats[server].counters[STAT_THROTTLED], 1);
+}
+
+// Remove the query in slot from the queries waiting for a server, if it is
+// one of them
+static void stop_waiting(dns_resolver_t *res, int slot) {
+  dns_query_t *query = &res->queries[slot];
+  if (query->wait_server < 0)
+    return;
+
+  dns_cwnd_t *cw = &res->cwnds[query->wait_server];
+  if (query->wait_prev >= 0)
+    res->queries[query->wait_prev].wait_next = query->wait_next;
+  else
+    cw->head = query->wait_next;
+  if (query->wait_next >= 0)
+    res->queries[query->wait_next].wait_prev = query->wait_prev;
+  else
+    cw->tail = query->wait_prev;
+  query->wait_server = -1;
+  res->nwaiting--;
+}
+
+// Whether the query in slot can be sent to server now: while fewer queries
+// than its congestion window are in flight to it, and no query before this
+// one waits for it. A server that didn't answer for MAX_RTO_USEC is down
+// rather than loaded, and its window would only hold the queries back
+static bool window_open(dns_resolver_t *res, int slot, int server) {
+  dns_cwnd_t *cw = &res->cwnds[server];
+  return res->cwnd_init == 0
+      || (cw->inflight < cw->cwnd && (cw->head < 0 || cw->head == slot))
+      || now_usec() - cw->answered > MAX_RTO_USEC;
+}
+
+// Count a loss (a timeout, SERVFAIL or REFUSED) of the query sent to server at
+// sent. The losses of the queries sent before the last one that counted are
+// part of the same event, which cuts the congestion window once. Return
+// whether it is a new one
+static bool loss_event(dns_resolver_t *res, int server, long long sent,
+                       long long now) {
+  if (!cwnd_cut(&res->cwnds[server], sent, now))
+    return false;
+  if (res->cwnd_init)
+    stats_add(&res->stats[server].counters[STAT_CWND_CUTS], 1);
+  return true;
+}
+
+// Put the query in slot back in the free slots. The servers still pending
+// won't be waited for
+static void release_slot(dns_resolver_t *res, int slot) {
+  dns_query_t *query = &res->queries[slot];
+  stop_waiting(res, slot);
+  for (int pos = 0; query->pending; pos++)
+    clear_pending(res, query, pos);
+  res->by_id[query->id] = -1;
+  query->in_use = false;
+  query->gen++;
+  res->free_slots[res->window - res->active] = slot;
+  res->active--;
+}
+
+// Put the transaction id of the query in slot in the cached answer msg
+static void set_cached_id(dns_resolver_t *res, int slot, dns_msg_t *msg) {
+  msg->header.id = htons(res->queries[slot].id);
+  memcpy(msg->buf, &msg->header.id, sizeof(msg->header.id));
+}
+
+// Release the query in slot, handing the outcome to the callback, then to
+// the callbacks of the identical queries that were waiting for it. When no
+// server answered, an expired answer is better than none (RFC 8767)
+static void finish_query(dns_resolver_t *res, int slot,
+                         enum error_status status, dns_msg_t *ans) {
+  dns_query_t *query = &res->queries[slot];
+  if (query->inflight)
+    unlink_inflight(res, slot);
+
+  if (status == NORESPONSE && !query->refresh && res->use_cache
+      && cache_lookup_stale(&res->cache, query->name, query->qtype, res->buf,
+                            &res->msg, NULL)) {
+    set_cached_id(res, slot, &res->msg);
+    stats_add(&res->counters[RES_STALE], 1);
+    status = NOERROR;
+    ans = &res->msg;
+  }
+
+  query->callback(res, query, status, ans);
+
+  int follower = query->followers, server = query->server;
+  release_slot(res, slot);
+  while (follower >= 0) {
+    dns_query_t *f = &res->queries[follower];
+    int next = f->next_follower;
+    f->server = server;
+    f->callback(res, f, status, ans);
+    release_slot(res, follower);
+    follower = next;
+  }
+}
+
+static bool send_next(dns_resolver_t *res, int slot);
+
+// Send the queued datagrams, with as few sendmmsg calls as possible. A
+// datagram that can't be sent is a send error for its query, which moves on
+// to the next server. Return false if the socket buffer filled up, leaving the
+// rest queued
+static bool flush_sends(dns_resolver_t *res) {
+  int n = res->ntx, done = 0, nfailed = 0;
+  dns_send_t failed[MAX_BATCH];
+
+  for (int i = 0; i < n; i++) {
+    dns_query_t *query = &res->queries[res->tx_queue[i].slot];
+    res->tx_iov[i].iov_base = query->msg;
+    res->tx_iov[i].iov_len = query->msg_len;
+    int server = query->order[res->tx_queue[i].pos];
+    res->tx[i].msg_hdr.msg_name = &res->addrs[server];
+  }
+
+  while (done < n) {
+    int r = sendmmsg(res->sock, res->tx + done, n - done, 0);
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (r <= 0)
+      failed[nfailed++] = res->tx_queue[done++];  // skip the one that failed
+    else
+      done += r;
+  }
+
+  // The queue is updated before failed queries are sent on
+  res->ntx = n - done;
+  memmove(res->tx_queue, res->tx_queue + done, res->ntx * sizeof(dns_send_t));
+  for (int i = 0; i < nfailed; i++) {
+    dns_query_t *query = &res->queries[failed[i].slot];
+    if (!query->in_use || query->gen != failed[i].gen)
+      continue;
+
+    clear_pending(res, query, failed[i].pos);
+    query->status = SENDERROR;
+    if (!send_next(res, failed[i].slot) && !query->pending)
+      finish_query(res, failed[i].slot, query->status, NULL);
+  }
+  return done == n;
+}
+
+// Queue the query in slot for the server at position pos in its order until
+// the next flush_sends. Return false if the queue is full and the socket can't
+// take any of it
+static bool queue_send(dns_resolver_t *res, int slot, int pos) {
+  if (res->ntx == res->batch && !flush_sends(res) && res->ntx == res->batch)
+    return false;
+
+  dns_send_t *send = &res->tx_queue[res->ntx++];
+  send->slot = slot;
+  send->gen = res->queries[slot].gen;
+  send->pos = pos;
+  return true;
+}
+
+// Send the query in slot to the server at position pos in its order and arm
+// its timeout. It goes over UDP (queued for sendmmsg when batching), or over
+// the TCP connection to the server once it answered truncated. Return false if
+// it couldn't be sent
+static bool send_to(dns_resolver_t *res, int slot, int pos) {
+  dns_query_t *query = &res->queries[slot];
+  int server = query->order[pos];
+  bool tcp = query->tcp & (1ULL << pos), sent = true;
+
+  if (tcp)
+    sent = tcp_send(&res->conns[server], res->epfd, &res->addrs[server],
+                    query->msg, query->msg_len);
+  else if (res->batch > 1)
+    sent = queue_send(res, slot, pos);
+  else
+    sent = sendto(res->sock,
+                  query->msg,
+                  query->msg_len,
+                  0,
+                  (struct sockaddr *) &res->addrs[server],
+                  sizeof(struct sockaddr_in)) >= 0;
+  if (!sent) {
+    query->status = SENDERROR;
+    return false;
+  }
+
+  // Opening a connection takes another round trip. Without a timeout, the
+  // query could wait forever, so it counts as unsent
+  long long rto = res->servers[server]->rto;
+  query->sent[pos] = now_usec();
+  if (!timer_push(res, query->sent[pos] + (tcp ? 2 * rto : rto), slot, pos)) {
+    query->status = SENDERROR;
+    return false;
+  }
+  if (!(query->pending & (1ULL << pos)))
+    res->cwnds[server].inflight++;
+  query->pending |= 1ULL << pos;
+
+  unsigned long long *counters = res->stats[server].counters;
+  stats_add(&counters[STAT_QUERIES], 1);
+  stats_add(&counters[STAT_BYTES_OUT], query->msg_len);
+  if (query->sends++)
+    stats_add(&counters[STAT_RETRIES], 1);
+  return true;
+}
+
+// Send the query in slot to the next server, skipping the ones it can't be
+// sent to. When racing, it is sent to every remaining server at once, and when
+// hedging, a timer is armed to also send it to the following server if no
+// answer arrives in the meantime. A server whose congestion window is full
+// swaps places with the first of the following ones that has room, and when
+// none has, the query waits for it until admit_waiting sends it. Return false
+// if nothing could be sent or queued
+static bool send_next(dns_resolver_t *res, int slot) {
+  dns_query_t *query = &res->queries[slot];
+  bool sent = false;
+
+  while (query->next_server < query->nservers) {
+    int pos = query->next_server, server = query->order[pos], later = pos + 1;
+    while (!window_open(res, slot, query->order[pos])
+           && later < query->nservers) {
+      if (window_open(res, slot, query->order[later])) {
+        query->order[pos] = query->order[later];
+        query->order[later] = server;
+      }
+      later++;
+    }
+    if (!window_open(res, slot, query->order[pos])) {
+      if (query->wait_server != server)
+        wait_for_room(res, slot, server);
+      return true;
+    }
+    stop_waiting(res, slot);
+    query->next_server++;
+    if (!send_to(res, slot, pos))
+      continue;
+
+    sent = true;
+    if (res->hedge != 0) {
+      if (res->hedge > 0 && query->next_server < query->nservers)
+        timer_push(res, query->sent[pos] + res->hedge, slot,
+                   HEDGE(query->next_server));
+      break;
+    }
+  }
+  return sent;
+}
+
+// Get the template of the queries of type qtype, with an OPT record
+// advertising edns unless it is 0, and RD set if recurse. The resolver keeps
+// one per known type and one for the others, set up again when it was last
+// used with another type or other flags
+static dns_template_t *get_template(dns_resolver_t *res,
+                                    enum query_type qtype,
+                                    unsigned short edns, bool recurse) {
+  dns_template_t *t = &res->templates[rr_index((unsigned short) qtype)];
+  if (t->tail_len == 0 || t->qtype != (unsigned short) qtype
+      || t->edns != edns || t->recurse != recurse)
+    query_template(t, (unsigned short) qtype, edns, recurse);
+  return t;
+}
+
+// Encode the query in slot with or without an OPT record, straight into its
+// send buffer: only its id and name are written over the template of its
+// type. Return false if its name can't be encoded
+static bool encode_query(dns_resolver_t *res, int slot, bool edns) {
+  dns_query_t *query = &res->queries[slot];
+  query->edns = edns && res->edns;
+  dns_template_t *t = get_template(res, query->qtype,
+                                   query->edns ? res->edns : 0,
+                                   query->recurse);
+  query->msg_len = template_query(t, query->msg, query->name, query->id);
+  if (query->msg_len == 0) {
+    query->status = SENDERROR;
+    return false;
+  }
+  log_msg(query->msg, query->msg_len);
+  return true;
+}
+
+// Check that the question of the answer is the one that was asked
+static bool match_question(dns_msg_t *ans, dns_query_t *query) {
+  return ans->header.qdcount == 1
+      && ans->records[0].type == query->qtype
+      && msg_name_equal(ans, ans->records[0].name, query->name);
+}
+
+// Handle a message received from host, over TCP or as a datagram
+static void handle_answer(dns_resolver_t *res, char *buf, ssize_t len,
+                          struct sockaddr_in *host, bool tcp) {
+  dns_msg_t *ans = &res->msg;
+  long long start = now_nsec();
+  bool parsed = parse_msg(ans, buf, len);
+  hist_record(&res->parse_time, now_nsec() - start);
+  if (!parsed)
+    return;
+
+  dns_header_t header = ans->header;
+  int slot = res->by_id[ntohs(header.id)];
+  if (slot < 0 || !header.qr)
+    return;
+
+  // The answer must come from a server that hasn't answered yet, over the
+  // transport it was last asked on, and be for the same question, otherwise
+  // it is a late duplicate or a spoofed response
+  dns_query_t *query = &res->queries[slot];
+  int pos;
+  for (pos = 0; pos < query->nservers; pos++)
+    if ((query->pending & (1ULL << pos)) && host->sin_addr.s_addr
+        == res->addrs[query->order[pos]].sin_addr.s_addr)
+      break;
+  if (pos == query->nservers || !match_question(ans, query)
+      || tcp != ((query->tcp & (1ULL << pos)) != 0))
+    return;
+
+  // The RTT over TCP includes the handshake of a new connection
+  int server = query->order[pos];
+  long long now = now_usec(), rtt = now - query->sent[pos];
+  long long rto = res->servers[server]->rto;
+  clear_pending(res, query, pos);
+  res->servers[server]->timeouts = 0;
+  if (!tcp)
+    server_rtt_sample(res->servers[server], rtt);
+  res->order_dirty = true;
+
+  // SERVFAIL and REFUSED are how loaded servers shed queries, so they cut
+  // the congestion window as losses do. It grows on answers within the RTO
+  res->cwnds[server].answered = now;
+  if (header.rcode == 2 || header.rcode == 5)
+    loss_event(res, server, query->sent[pos], now);
+  else if (rtt <= rto)
+    cwnd_grow(&res->cwnds[server], res->window);
+
+  dns_server_stats_t *stats = &res->stats[server];
+  hist_record(&stats->latency, rtt);
+  stats_add(&stats->counters[STAT_ANSWERS], 1);
+  stats_add(&stats->counters[STAT_BYTES_IN], len);
+  stats_add(&stats->counters[STAT_RCODE + (header.rcode < 6 ? header.rcode
+                                                             : 6)], 1);
+  if (header.tc)
+    stats_add(&stats->counters[STAT_TRUNCATED], 1);
+
+  // Truncated answers are asked for again over TCP (RFC 7766)
+  if (header.tc && !tcp) {
+    query->tcp |= 1ULL << pos;
+    if (send_to(res, slot, pos))
+      return;
+  }
+
+  // Servers that don't know EDNS reply FORMERR or NOTIMP without an OPT
+  // record (RFC 6891), so they get the query again in plain DNS
+  if (query->edns && (header.rcode == 1 || header.rcode == 4)
+      && msg_opt(ans) == NULL) {
+    if (encode_query(res, slot, false) && send_to(res, slot, pos))
+      return;
+  }
+
+  // Errors are only final once no other server can answer
+  if (header.rcode != 0 && (send_next(res, slot) || query->pending))
+    return;
+
+  if (res->use_cache)
+    cache_store(&res->cache, query->name, query->qtype, ans);
+
+  query->server = server;
+  finish_query(res, slot, NOERROR, ans);
+}
+
+// Receive every datagram that is waiting on the socket, up to a batch per
+// recvmmsg call
+static void read_batches(dns_resolver_t *res) {
+  for (;;) {
+    for (int i = 0; i < res->batch; i++)
+      res->rx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    int n = recvmmsg(res->sock, res->rx, res->batch, 0, NULL);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return;  // EAGAIN: socket drained
+    }
+
+    for (int i = 0; i < n; i++)
+      handle_answer(res, res->rx_bufs + (size_t) i * MAX_MSG_LEN,
+                    res->rx[i].msg_len, &res->rx_addrs[i], false);
+    if (n < res->batch)
+      return;
+  }
+}
+
+// Receive every datagram that is waiting on the socket
+static void read_answers(dns_resolver_t *res) {
+  if (res->batch > 1) {
+    read_batches(res);
+    return;
+  }
+
+  struct sockaddr_in host;
+  socklen_t host_len;
+  ssize_t r;
+
+  for (;;) {
+    host_len = sizeof(host);
+    r = recvfrom(res->sock,
+                 res->buf,
+                 MAX_MSG_LEN,
+                 0,
+                 (struct sockaddr *) &host,
+                 &host_len);
+    if (r < 0) {
+      if (errno == EINTR)
+        continue;
+      break;  // EAGAIN: socket drained
+    }
+    handle_answer(res, res->buf, r, &host, false);
+  }
+}
+
+// Close the TCP connection to server, moving the queries that were waiting on
+// it on to the next server
+static void close_conn(dns_resolver_t *res, int server) {
+  tcp_close(&res->conns[server]);
+
+  for (int slot = 0; slot < res->window; slot++) {
+    dns_query_t *query = &res->queries[slot];
+    int pos = 0;
+    while (pos < query->nservers && query->order[pos] != server)
+      pos++;
+    if (!query->in_use || pos == query->nservers
+        || !(query->pending & query->tcp & (1ULL << pos)))
+      continue;
+
+    clear_pending(res, query, pos);
+    query->status = RECVERROR;
+    if (!send_next(res, slot) && !query->pending)
+      finish_query(res, slot, query->status, NULL);
+  }
+}
+
+// Handle the events of the TCP connection to server: write what is queued on
+// it, and handle every answer received on it. Handling an answer may add
+// servers (iterative mode), moving the connections, so none is held across it
+static void handle_conn(dns_resolver_t *res, int server, unsigned int events) {
+  if ((events & EPOLLOUT) && !tcp_flush(&res->conns[server], res->epfd)) {
+    close_conn(res, server);
+    return;
+  }
+  if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+    return;
+
+  for (;;) {
+    int r = tcp_read(&res->conns[server]);
+
+    char *msg;
+    size_t len;
+    while ((msg = tcp_next_msg(&res->conns[server], &len)))
+      handle_answer(res, msg, len, &res->addrs[server], true);
+
+    if (r < 0)
+      close_conn(res, server);
+    if (r <= 0)
+      break;
+  }
+}
+
+// Close the TCP connections that have nothing in flight and weren't used for
+// TCP_IDLE_USEC
+static void close_idle_conns(dns_resolver_t *res) {
+  long long now = now_usec();
+  for (int i = 0; i < res->nservers; i++) {
+    dns_conn_t *conn = &res->conns[i];
+    if (conn->fd >= 0 && conn->outstanding == 0
+        && now - conn->last_used > TCP_IDLE_USEC)
+      tcp_close(conn);
+  }
+}
+
+// Move the queries whose timeout has passed on to the next server
+static void expire_queries(dns_resolver_t *res) {
+  long long now = now_usec();
+
+  while (res->ntimers && res->timers[0].deadline <= now) {
+    dns_timer_t timer = res->timers[0];
+    timer_pop(res);
+
+    dns_query_t *query = &res->queries[timer.slot];
+    if (!query->in_use || query->gen != timer.gen)
+      continue;  // the query was answered since the timer was armed
+
+    if (timer.server < 0) {
+      // Hedge: only send if no timeout or error moved on to the server already
+      if (HEDGE(timer.server) == query->next_server)
+        send_next(res, timer.slot);
+      continue;
+    }
+
+    int pos = timer.server, server = query->order[pos];
+    if (!(query->pending & (1ULL << pos)) || query->sent[pos] != timer.sent)
+      continue;  // that server already answered, or was sent the query again
+
+    clear_pending(res, query, pos);
+    query->status = NORESPONSE;
+    stats_add(&res->stats[server].counters[STAT_TIMEOUTS], 1);
+    dns_conn_t *conn = &res->conns[server];
+    if ((query->tcp & (1ULL << pos)) && conn->outstanding)
+      conn->outstanding--;
+    // Backing off the RTO for every timeout of a burst would take it to
+    // MAX_RTO_USEC at once, and every query lost after that would wait as long
+    if (loss_event(res, server, query->sent[pos], now))
+      server_timeout(res->servers[server], now - query->sent[pos]);
+    res->servers[server]->timeouts++;
+    res->order_dirty = true;
+    if (!send_next(res, timer.slot) && !query->pending)
+      finish_query(res, timer.slot, query->status, NULL);
+  }
+}
+
+// Initialise a resolver with a window of queries (MAX_WINDOW at most) that can
+// be in flight at the same time on one non-blocking socket. Servers are tried
+// one after another, unless hedge is set afterwards (0 to race them all, or a
+// delay in usec). Return false, with nothing left to free, if it can't be set
+// up
+bool resolver_init(dns_resolver_t *res, dns_server_t *servers, int nservers,
+                   int window) {
+  memset(res, 0, sizeof(*res));
+  res->sock = res->epfd = -1;
+  if (window <= 0 || window > MAX_WINDOW)
+    return false;
+
+  res->servers = calloc(nservers, sizeof(dns_server_t *));
+  res->addrs = calloc(nservers, sizeof(struct sockaddr_in));
+  res->conns = calloc(nservers, sizeof(dns_conn_t));
+  res->cwnds = calloc(nservers, sizeof(dns_cwnd_t));
+  res->queries = calloc(window, sizeof(dns_query_t));
+  res->free_slots = calloc(window, sizeof(int));
+  res->by_id = malloc(ID_SPACE * sizeof(int));
+  res->stats = calloc(nservers, sizeof(dns_server_stats_t));
+  unsigned int buckets = 1;
+  while (buckets < 2 * (unsigned int) window)
+    buckets <<= 1;
+  res->inflight = malloc(buckets * sizeof(int));
+  res->inflight_mask = buckets - 1;
+  if ((nservers && (!res->servers || !res->addrs || !res->conns
+                    || !res->cwnds || !res->stats))
+      || !res->queries || !res->free_slots || !res->by_id
+      || !res->inflight) {
+    resolver_free(res);
+    return false;
+  }
+
+  for (int i = 0; i < nservers && res->nservers < MAX_IPS; i++) {
+    struct sockaddr_in *addr = &res->addrs[res->nservers];
+    if (!parse_server_addr(servers[i].addr, addr))
+      continue;
+    res->conns[res->nservers].fd = -1;
+    cwnd_init(&res->cwnds[res->nservers], CWND_INIT);
+    res->order[res->nservers] = res->nservers;
+    res->servers[res->nservers++] = &servers[i];
+  }
+  res->nconf = res->servers_cap = res->nservers;
+  res->order_dirty = true;
+
+  res->window = window;
+  for (int i = 0; i < window; i++)
+    res->free_slots[i] = window - 1 - i;
+  memset(res->by_id, -1, ID_SPACE * sizeof(int));
+  memset(res->inflight, -1, (res->inflight_mask + 1) * sizeof(int));
+  res->seed = (unsigned int) (getpid() ^ now_usec());
+  res->hedge = -1;
+  res->cwnd_init = CWND_INIT;
+  res->edns = EDNS_PAYLOAD;
+  res->batch = 1;
+
+  res->sock = socket(PF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+  res->epfd = epoll_create1(0);
+
+  // Room for the answers of a whole window, so a burst isn't dropped while
+  // the thread is busy (the kernel caps it at net.core.rmem_max)
+  int rcvbuf = window * RCVBUF_PER_QUERY;
+  if (res->sock >= 0 && rcvbuf > DEFAULT_RCVBUF)
+    setsockopt(res->sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.fd = res->sock;
+  if (res->sock < 0 || res->epfd < 0
+      || epoll_ctl(res->epfd, EPOLL_CTL_ADD, res->sock, &ev) < 0) {
+    resolver_free(res);
+    return false;
+  }
+  return true;
+}
+
+// Add a server at addr ("ip[:port]") to the ones queries can be sent to with
+// resolver_submit_to, owned by the resolver and without saved estimates.
+// Return its index, or -1 if the address is invalid or it can't be added
+int resolver_add_server(dns_resolver_t *res, char *addr) {
+  if (res->nservers == res->servers_cap) {
+    int cap = res->servers_cap ? 2 * res->servers_cap : MAX_IPS;
+    dns_server_t **servers = realloc(res->servers,
+                                     cap * sizeof(dns_server_t *));
+    if (servers)
+      res->servers = servers;
+    struct sockaddr_in *addrs = realloc(res->addrs,
+                                        cap * sizeof(struct sockaddr_in));
+    if (addrs)
+      res->addrs = addrs;
+    dns_conn_t *conns = realloc(res->conns, cap * sizeof(dns_conn_t));
+    if (conns)
+      res->conns = conns;
+    dns_cwnd_t *cwnds = realloc(res->cwnds, cap * sizeof(dns_cwnd_t));
+    if (cwnds)
+      res->cwnds = cwnds;
+    dns_server_stats_t *stats = realloc(res->stats,
+                                        cap * sizeof(dns_server_stats_t));
+    if (stats)
+      res->stats = stats;
+    if (!servers || !addrs || !conns || !cwnds || !stats)
+      return -1;
+    res->servers_cap = cap;
+  }
+
+  int i = res->nservers;
+  dns_server_t *server = calloc(1, sizeof(dns_server_t));
+  if (server == NULL)
+    return -1;
+  snprintf(server->addr, MAX_ADDR_LEN, "%s", addr);
+  server->rto = MAX_RTO_USEC;
+  if (!parse_server_addr(server->addr, &res->addrs[i])) {
+    free(server);
+    return -1;
+  }
+
+  memset(&res->conns[i], 0, sizeof(dns_conn_t));
+  res->conns[i].fd = -1;
+  cwnd_init(&res->cwnds[i], res->cwnd_init);
+  memset(&res->stats[i], 0, sizeof(dns_server_stats_t));
+  res->servers[i] = server;
+  return res->nservers++;
+}
+
+// Take the slot of a new query for name and fill it in, to be sent to the n
+// servers in order. Return the slot, or -1 if the window is full or the name
+// is too long. The callback gets the outcome, possibly before the query is
+// submitted (cached answers, or when nothing can be sent)
+static int start_query(dns_resolver_t *res, char *name, enum query_type qtype,
+                       int *order, int n, dns_callback_t callback,
+                       void *data) {
+  if (res->active == res->window || strlen(name) >= MAX_NAME_LEN)
+    return -1;
+
+  int slot = res->free_slots[res->window - res->active - 1];
+
+  dns_query_t *query = &res->queries[slot];
+  snprintf(query->name, MAX_NAME_LEN, "%s", name);
+  size_t len = strlen(query->name);
+  if (len && query->name[len - 1] == '.')
+    query->name[len - 1] = 0;
+
+  query->nservers = n < MAX_IPS ? n : MAX_IPS;
+  memcpy(query->order, order, query->nservers * sizeof(int));
+
+  query->qtype = qtype;
+  query->recurse = true;
+  query->refresh = false;
+  query->id = new_id(res);
+  query->server = -1;
+  query->next_server = 0;
+  query->pending = 0;
+  query->tcp = 0;
+  query->sends = 0;
+  query->status = NOSERVER;
+  query->inflight = false;
+  query->followers = -1;
+  query->wait_server = -1;
+  query->callback = callback;
+  query->data = data;
+  query->in_use = true;
+
+  res->by_id[query->id] = slot;
+  res->active++;
+  return slot;
+}
+
+// Called once a refresh is done, its answer being cached already
+static void refresh_done(dns_resolver_t *res, dns_query_t *query,
+                         enum error_status status, dns_msg_t *ans) {
+  (void) res;
+  (void) query;
+  (void) status;
+  (void) ans;
+}
+
+// Send the query again in the background, for its answer to be cached again.
+// Refreshes only take the spare half of the window, leaving the rest to the
+// callers. Return false if it wasn't sent
+static bool refresh_query(dns_resolver_t *res, dns_query_t *query) {
+  if (res->active >= res->window / 2)
+    return false;
+
+  int slot = start_query(res, query->name, query->qtype, query->order,
+                         query->nservers, refresh_done, NULL);
+  if (slot < 0)
+    return false;
+
+  dns_query_t *refresh = &res->queries[slot];
+  refresh->recurse = query->recurse;
+  refresh->refresh = true;
+  if (encode_query(res, slot, true) && send_next(res, slot))
+    return true;
+  finish_query(res, slot, refresh->status, NULL);
+  return false;
+}
+
+// Whether every server of the query timed out DOWN_TIMEOUTS times in a row
+static bool servers_down(dns_resolver_t *res, dns_query_t *query) {
+  for (int pos = 0; pos < query->nservers; pos++)
+    if (res->servers[query->order[pos]]->timeouts < DOWN_TIMEOUTS)
+      return false;
+  return query->nservers > 0;
+}
+
+// Send the query in slot, or hand over its cached answer. Hot answers about
+// to expire are refreshed in the background, and so are expired answers, which
+// are handed over while none of the servers answers (RFC 8767). Callbacks may
+// submit queries, so cached answers are read into res->cache_msg, leaving the
+// answer in res->msg to the followers of the query that got it
+static void submit_query(dns_resolver_t *res, int slot) {
+  dns_query_t *query = &res->queries[slot];
+  enum resolver_counter counter = RES_CACHE_MISSES;
+  bool refresh = false;
+  // Refreshes are only claimed if refresh_query will have room for them once
+  // the slot is released, since a claim holds off the others for a while
+  bool *claim = res->active <= res->window / 2 ? &refresh : NULL;
+
+  if (res->use_cache) {
+    if (cache_lookup(&res->cache, query->name, query->qtype, res->cache_buf,
+                     &res->cache_msg, claim))
+      counter = RES_CACHE_HITS;
+    else if (servers_down(res, query)
+             && cache_lookup_stale(&res->cache, query->name, query->qtype,
+                                   res->cache_buf, &res->cache_msg, claim))
+      counter = RES_STALE;
+    stats_add(&res->counters[counter], 1);
+  }
+
+  if (counter == RES_CACHE_MISSES) {
+    if (!encode_query(res, slot, true) || !send_next(res, slot))
+      finish_query(res, slot, query->status, NULL);
+    return;
+  }
+
+  // Handed over right away, under the new transaction id. The slot is
+  // released by then, so the refresh is made from a copy of the query
+  set_cached_id(res, slot, &res->cache_msg);
+  if (!refresh) {
+    finish_query(res, slot, NOERROR, &res->cache_msg);
+    return;
+  }
+  dns_query_t copy = *query;
+  finish_query(res, slot, NOERROR, &res->cache_msg);
+  if (refresh_query(res, &copy) && counter == RES_CACHE_HITS)
+    stats_add(&res->counters[RES_PREFETCHES], 1);
+}
+
+// Submit a query for name to the servers from the conf file, returning its
+// slot, or -1 if the window is full or the name is too long. The callback gets
+// the outcome, possibly before this returns (cached answers, or when nothing
+// can be sent). When coalescing, a query identical to one in flight isn't
+// sent, and gets the same answer once it arrives
+int resolver_submit(dns_resolver_t *res, char *name, enum query_type qtype,
+                    dns_callback_t callback, void *data) {
+  if (res->order_dirty) {
+    sort_servers(res, res->order, res->nconf);
+    res->order_dirty = false;
+  }
+
+  int slot = start_query(res, name, qtype, res->order, res->nconf, callback,
+                         data);
+  if (slot < 0 || !res->coalesce) {
+    if (slot >= 0)
+      submit_query(res, slot);
+    return slot;
+  }
+
+  // An identical query in flight gets the answer for both, so this one
+  // waits for it instead of being sent
+  dns_query_t *query = &res->queries[slot];
+  query->key = query_key(query->name, qtype);
+  int leader = find_inflight(res, slot);
+  if (leader >= 0) {
+    query->next_follower = res->queries[leader].followers;
+    res->queries[leader].followers = slot;
+    stats_add(&res->counters[RES_COALESCED], 1);
+    return slot;
+  }
+
+  int *bucket = &res->inflight[query->key & res->inflight_mask];
+  query->next_inflight = *bucket;
+  *bucket = slot;
+  query->inflight = true;
+  submit_query(res, slot);
+  return slot;
+}
+
+// Submit a query for name to the n servers (indices from resolver_add_server,
+// up to MAX_IPS), tried by expected latency, with recursion desired or not.
+// Return its slot, or -1 as resolver_submit does
+int resolver_submit_to(dns_resolver_t *res, char *name, enum query_type qtype,
+                       int *servers, int n, bool recurse,
+                       dns_callback_t callback, void *data) {
+  int slot = start_query(res, name, qtype, servers, n, callback, data);
+  if (slot < 0)
+    return -1;
+
+  dns_query_t *query = &res->queries[slot];
+  query->recurse = recurse;
+  sort_servers(res, query->order, query->nservers);
+  submit_query(res, slot);
+  return slot;
+}
+
+// Get the descriptor to wait on for the resolver to have events to process,
+// readable when there are (an epoll instance, so it can be polled, or added to
+// another epoll set)
+int resolver_fd(dns_resolver_t *res) {
+  return res->epfd;
+}
+
+// Get the time in ms until the next timeout the resolver has to process, or
+// -1 if there is none
+int resolver_timeout(dns_resolver_t *res) {
+  if (res->ntx)
+    return 1;  // datagrams waiting for room in the socket buffer
+  if (res->ntimers == 0)
+    return -1;
+
+  long long wait = (res->timers[0].deadline - now_usec() + 999) / 1000;
+  return wait < 0 ? 0 : (int) wait;
+}
+
+// Send the queries that wait for room in the congestion windows of servers,
+// oldest first, now that some was made: in the window they wait for, or in
+// that of one of their other servers. Then send the datagrams that queued
+static void admit_waiting(dns_resolver_t *res) {
+  while (res->admit) {
+    res->admit = false;
+    for (int server = 0; server < res->nservers && res->nwaiting; server++) {
+      int slot;
+      while ((slot = res->cwnds[server].head) >= 0) {
+        dns_query_t *query = &res->queries[slot];
+        if (!send_next(res, slot) && !query->pending)
+          finish_query(res, slot, query->status, NULL);
+        else if (query->wait_server == server)
+          break;  // no room for it yet
+      }
+    }
+  }
+  while (res->ntx && flush_sends(res))
+    continue;
+}
+
+// Wait up to timeout_ms (-1 for no limit, 0 to only handle what is ready) for
+// answers, handle them and any expired queries. Return the number of queries
+// still in flight
+int resolver_process(dns_resolver_t *res, int timeout_ms) {
+  struct epoll_event events[MAX_EVENTS];
+
+  // Queries whose send failed may queue another one
+  while (res->ntx && flush_sends(res))
+    continue;
+
+  int wait = resolver_timeout(res);
+  if (wait >= 0 && (timeout_ms < 0 || wait < timeout_ms))
+    timeout_ms = wait;
+
+  int n = epoll_wait(res->epfd, events, MAX_EVENTS, timeout_ms);
+  for (int i = 0; i < n; i++) {
+    if (events[i].data.fd == res->sock) {
+      read_answers(res);
+      continue;
+    }
+    for (int server = 0; server < res->nservers; server++)
+      if (res->conns[server].fd == events[i].data.fd)
+        handle_conn(res, server, events[i].events);
+  }
+
+  expire_queries(res);
+  admit_waiting(res);
+  close_idle_conns(res);
+  return res->active;
+}
+
+// Allocate the buffers for sendmmsg and recvmmsg batches of res->batch
+// datagrams, set up once and reused by every call. Return false if they can't
+// be allocated
+static bool alloc_batches(dns_resolver_t *res) {
+  int n = res->batch;
+  res->rx = calloc(n, sizeof(struct mmsghdr));
+  res->tx = calloc(n, sizeof(struct mmsghdr));
+  res->rx_iov = calloc(n, sizeof(struct iovec));
+  res->tx_iov = calloc(n, sizeof(struct iovec));
+  res->rx_addrs = calloc(n, sizeof(struct sockaddr_in));
+  res->rx_bufs = malloc((size_t) n * MAX_MSG_LEN);
+  res->tx_queue = calloc(n, sizeof(dns_send_t));
+  if (!res->rx || !res->tx || !res->rx_iov || !res->tx_iov || !res->rx_addrs
+      || !res->rx_bufs || !res->tx_queue)
+    return false;
+
+  for (int i = 0; i < n; i++) {
+    res->rx_iov[i].iov_base = res->rx_bufs + (size_t) i * MAX_MSG_LEN;
+    res->rx_iov[i].iov_len = MAX_MSG_LEN;
+    res->rx[i].msg_hdr.msg_name = &res->rx_addrs[i];
+    res->rx[i].msg_hdr.msg_iov = &res->rx_iov[i];
+    res->rx[i].msg_hdr.msg_iovlen = 1;
+
+    res->tx[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    res->tx[i].msg_hdr.msg_iov = &res->tx_iov[i];
+    res->tx[i].msg_hdr.msg_iovlen = 1;
+  }
+  return true;
+}
+
+// Apply the command line options to a resolver. Return false if batching
+// can't be set up, in which case datagrams are sent one at a time
+bool resolver_set_options(dns_resolver_t *res, dns_options_t *opts) {
+  bool ok = true;
+  res->hedge = opts->hedge;
+  if (opts->batch > 1 && res->rx == NULL) {
+    res->batch = opts->batch;
+    ok = alloc_batches(res);
+    if (!ok)
+      res->batch = 1;
+  }
+  res->edns = (unsigned short) opts->edns;
+  res->coalesce = opts->coalesce;
+  res->cwnd_init = opts->cwnd;
+  for (int i = 0; i < res->nservers; i++)
+    cwnd_init(&res->cwnds[i], opts->cwnd);
+  res->cache.mem = opts->memcache;
+  res->use_cache = opts->cache && (opts->memcache || cache_open(&res->cache));
+  res->cache.prefetch = opts->prefetch;
+  return ok;
+}
+
+// Get the name of the server that answered a query
+char *resolver_server_name(dns_resolver_t *res, dns_query_t *query) {
+  if (query->server < 0)
+    return res->cache.mem ? "cache" : CACHE_FILE;
+  return res->servers[query->server]->addr;
+}
+
+// Free the resources held by a resolver
+void resolver_free(dns_resolver_t *res) {
+  if (res->use_cache && res->cache.mem == NULL)
+    cache_close(&res->cache);  // the in-memory one is shared
+  for (int i = 0; i < res->nservers; i++) {
+    tcp_close(&res->conns[i]);
+    free(res->conns[i].in);
+    free(res->conns[i].out);
+    if (i >= res->nconf)
+      free(res->servers[i]);  // added by resolver_add_server
+  }
+  if (res->epfd >= 0)
+    close(res->epfd);
+  if (res->sock >= 0)
+    close(res->sock);
+  free(res->servers);
+  free(res->addrs);
+  free(res->conns);
+  free(res->cwnds);
+  free(res->queries);
+  free(res->free_slots);
+  free(res->by_id);
+  free(res->inflight);
+  free(res->stats);
+  free(res->timers);
+  free(res->rx);
+  free(res->tx);
+  free(res->rx_iov);
+  free(res->tx_iov);
+  free(res->rx_addrs);
+  free(res->rx_bufs);
+  free(res->tx_queue);
+}
@@ -0,0 +1,138 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+// Keep a retransmit timeout within [MIN_RTO_USEC, MAX_RTO_USEC]
+static long long clamp_rto(long long rto) {
+  if (rto < MIN_RTO_USEC)
+    return MIN_RTO_USEC;
+  if (rto > MAX_RTO_USEC)
+    return MAX_RTO_USEC;
+  return rto;
+}
+
+// Update the RTT estimates of server with a new sample, the same way TCP
+// computes its retransmit timeout (RFC 6298)
+void server_rtt_sample(dns_server_t *server, long long rtt) {
+  if (server->srtt == 0) {
+    server->srtt = rtt;
+    server->rttvar = rtt / 2;
+  } else {
+    long long delta = server->srtt - rtt;
+    server->rttvar = (3 * server->rttvar + (delta < 0 ? -delta : delta)) / 4;
+    server->srtt = (7 * server->srtt + rtt) / 8;
+  }
+  if (server->srtt == 0)
+    server->srtt = 1;  // 0 means no sample yet
+
+  server->rto = clamp_rto(server->srtt + 4 * server->rttvar);
+}
+
+// Back off the retransmit timeout of server after a query sent to it went
+// unanswered for waited usec. The time waited is a lower bound of the RTT, so
+// it also pushes the server back in the latency order
+void server_timeout(dns_server_t *server, long long waited) {
+  if (server->srtt < waited)
+    server->srtt = waited;
+  if (server->rttvar == 0)
+    server->rttvar = waited / 2;
+  server->rto = clamp_rto(2 * server->rto);
+}
+
+// Set up the congestion window of a server, starting at cwnd queries in slow
+// start (0 for no window). The server counts as having just answered, so the
+// window holds until it had the time to
+void cwnd_init(dns_cwnd_t *cw, int cwnd) {
+  memset(cw, 0, sizeof(*cw));
+  cw->cwnd = cwnd;
+  cw->ssthresh = 1e9;
+  cw->head = cw->tail = -1;
+  cw->answered = now_usec();
+}
+
+// Grow the congestion window of a server after a prompt answer: by one query
+// per answer in slow start, by one per window of answers after it, up to max
+void cwnd_grow(dns_cwnd_t *cw, int max) {
+  cw->cwnd += cw->cwnd < cw->ssthresh ? 1 : 1 / cw->cwnd;
+  if (cw->cwnd > max)
+    cw->cwnd = max;
+}
+
+// Halve the congestion window of a server after the query sent to it at sent
+// was lost or refused, leaving slow start. Queries sent before the last cut
+// were sent with the larger window, so their losses don't cut it again.
+// Return whether it was cut
+bool cwnd_cut(dns_cwnd_t *cw, long long sent, long long now) {
+  if (sent < cw->cut)
+    return false;
+  cw->ssthresh = cw->cwnd / 2 < CWND_MIN ? CWND_MIN : cw->cwnd / 2;
+  cw->cwnd = cw->ssthresh;
+  cw->cut = now;
+  return true;
+}
+
+// Load the RTT estimates of the servers found in STATE_FILE, one
+// "address srtt rttvar rto" line per server
+void load_server_state(dns_server_t *servers, int n) {
+  FILE *f = fopen(STATE_FILE, "r");
+  if (f == NULL)
+    return;  // first run
+
+  char addr[MAX_ADDR_LEN];
+  long long srtt, rttvar, rto;
+  while (fscanf(f, "%63s %lld %lld %lld", addr, &srtt, &rttvar, &rto) == 4) {
+    for (int i = 0; i < n; i++) {
+      if (strcmp(servers[i].addr, addr) == 0) {
+        servers[i].srtt = srtt;
+        servers[i].rttvar = rttvar;
+        servers[i].rto = clamp_rto(rto);
+      }
+    }
+  }
+  fclose(f);
+}
+
+// Save the RTT estimates of the servers in STATE_FILE. The file is replaced
+// atomically, so concurrent runs never read a partial state
+void save_server_state(dns_server_t *servers, int n) {
+  char tmp[MAX_NAME_LEN];
+  snprintf(tmp, MAX_NAME_LEN, "%s.%d", STATE_FILE, getpid());
+
+  FILE *f = fopen(tmp, "w");
+  if (f == NULL)
+    return;  // the estimates are only a hint
+
+  for (int i = 0; i < n; i++)
+    fprintf(f, "%s %lld %lld %lld\n", servers[i].addr, servers[i].srtt,
+            servers[i].rttvar, servers[i].rto);
+
+  if (fclose(f) != 0 || rename(tmp, STATE_FILE) != 0)
+    unlink(tmp);
+}
+
+// Merge the estimates of ncopies copies of the n servers (updated separately
+// by worker threads) back into servers, averaging the copies that measured
+// each server
+void merge_server_state(dns_server_t *servers, dns_server_t **copies,
+                        int ncopies, int n) {
+  for (int i = 0; i < n; i++) {
+    long long srtt = 0, rttvar = 0, rto = 0;
+    int measured = 0;
+    for (int c = 0; c < ncopies; c++) {
+      dns_server_t *copy = &copies[c][i];
+      if (copy->srtt == 0)
+        continue;
+      srtt += copy->srtt;
+      rttvar += copy->rttvar;
+      rto += copy->rto;
+      measured++;
+    }
+    if (measured) {
+      servers[i].srtt = srtt / measured;
+      servers[i].rttvar = rttvar / measured;
+      servers[i].rto = clamp_rto(rto / measured);
+    }
+  }
+}
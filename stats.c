@@ -0,0 +1,202 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define SUB_BITS 4  // log2(STATS_SUB_BUCKETS)
+
+// Add n to a counter. Each resolver is only used by one thread, so there is a
+// single writer, and a relaxed load and store (no lock prefix) is enough for
+// other threads to read whole values at any time
+void stats_add(unsigned long long *counter, unsigned long long n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+// Get the bucket of a value: small values have one each, larger ones share
+// STATS_SUB_BUCKETS linear buckets per power of two
+static int hist_bucket(unsigned long long value) {
+  if (value < STATS_SUB_BUCKETS)
+    return (int) value;
+
+  int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+  int bucket = (shift + 1) * STATS_SUB_BUCKETS
+      + (int) (value >> shift) - STATS_SUB_BUCKETS;
+  return bucket < STATS_BUCKETS ? bucket : STATS_BUCKETS - 1;
+}
+
+// Get the largest value counted in a bucket
+static unsigned long long hist_value(int bucket) {
+  if (bucket < STATS_SUB_BUCKETS)
+    return (unsigned long long) bucket;
+
+  int shift = bucket / STATS_SUB_BUCKETS - 1;
+  unsigned long long sub = bucket % STATS_SUB_BUCKETS + STATS_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+// Count a value in the histogram, without locks or allocations
+void hist_record(dns_hist_t *hist, unsigned long long value) {
+  stats_add(&hist->counts[hist_bucket(value)], 1);
+  stats_add(&hist->total, 1);
+  stats_add(&hist->sum, value);
+  if (value > __atomic_load_n(&hist->max, __ATOMIC_RELAXED))
+    __atomic_store_n(&hist->max, value, __ATOMIC_RELAXED);
+}
+
+// Get the value below which a fraction q of the histogram falls (within the
+// precision of its buckets)
+static unsigned long long hist_quantile(dns_hist_t *hist, double q) {
+  unsigned long long rank = (unsigned long long) (q * hist->total), seen = 0;
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen > rank)
+      return hist_value(i) < hist->max ? hist_value(i) : hist->max;
+  }
+  return hist->max;
+}
+
+// Add the histogram from, which its thread may still be recording to, to sum
+static void hist_sum(dns_hist_t *sum, dns_hist_t *from) {
+  for (int i = 0; i < STATS_BUCKETS; i++)
+    sum->counts[i] += __atomic_load_n(&from->counts[i], __ATOMIC_RELAXED);
+  sum->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+  sum->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+  unsigned long long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+  if (max > sum->max)
+    sum->max = max;
+}
+
+// Add the counters of server from to sum
+static void server_stats_sum(dns_server_stats_t *sum,
+                             dns_server_stats_t *from) {
+  for (int i = 0; i < STATS_COUNTERS; i++)
+    sum->counters[i] += __atomic_load_n(&from->counters[i], __ATOMIC_RELAXED);
+  hist_sum(&sum->latency, &from->latency);
+}
+
+// Names of the counters, by enum stats_counter
+static char *counter_names[STATS_COUNTERS] = {
+    "queries", "retries", "timeouts", "truncated", "answers", "bytes_out",
+    "bytes_in", "throttled", "cwnd_cuts", "rcode_noerror", "rcode_formerr",
+    "rcode_servfail", "rcode_nxdomain", "rcode_notimp", "rcode_refused",
+    "rcode_other"
+};
+
+static char *resolver_counter_names[RES_COUNTERS] = {
+    "coalesced", "cache_hits", "cache_misses", "prefetches", "stale_served"
+};
+
+// Write a histogram as a JSON object
+static void write_hist_json(FILE *f, dns_hist_t *hist) {
+  fprintf(f, "{\"count\": %llu, \"sum\": %llu, \"p50\": %llu, \"p90\": %llu, "
+          "\"p99\": %llu, \"p999\": %llu, \"max\": %llu}", hist->total,
+          hist->sum, hist_quantile(hist, 0.5), hist_quantile(hist, 0.9),
+          hist_quantile(hist, 0.99), hist_quantile(hist, 0.999), hist->max);
+}
+
+// Write a histogram as a Prometheus summary, with labels (may be empty)
+static void write_hist_prom(FILE *f, char *metric, char *labels,
+                            dns_hist_t *hist) {
+  double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+  for (int i = 0; i < 4; i++)
+    fprintf(f, "%s{%s%squantile=\"%g\"} %llu\n", metric, labels,
+            *labels ? "," : "", quantiles[i],
+            hist_quantile(hist, quantiles[i]));
+  fprintf(f, "%s_sum{%s} %llu\n%s_count{%s} %llu\n", metric, labels,
+          hist->sum, metric, labels, hist->total);
+}
+
+// Write the statistics summed in servers (of the servers of res), parse and
+// counters (of the resolvers) as JSON
+static void write_json(FILE *f, dns_resolver_t *res,
+                       dns_server_stats_t *servers, dns_hist_t *parse,
+                       unsigned long long *counters) {
+  fprintf(f, "{\"servers\": [");
+  for (int i = 0; i < res->nservers; i++) {
+    fprintf(f, "%s\n  {\"server\": \"%s\"", i ? "," : "",
+            res->servers[i]->addr);
+    for (int j = 0; j < STATS_COUNTERS; j++)
+      fprintf(f, ", \"%s\": %llu", counter_names[j], servers[i].counters[j]);
+    fprintf(f, ", \"latency_usec\": ");
+    write_hist_json(f, &servers[i].latency);
+    fprintf(f, "}");
+  }
+  fprintf(f, "\n]");
+  for (int j = 0; j < RES_COUNTERS; j++)
+    fprintf(f, ", \"%s\": %llu", resolver_counter_names[j], counters[j]);
+  fprintf(f, ", \"parse_nsec\": ");
+  write_hist_json(f, parse);
+  fprintf(f, "}\n");
+}
+
+// Write the statistics summed in servers (of the servers of res), parse and
+// counters as Prometheus text, where the samples of a metric must be together
+static void write_prom(FILE *f, dns_resolver_t *res,
+                       dns_server_stats_t *servers, dns_hist_t *parse,
+                       unsigned long long *counters) {
+  char labels[MAX_ADDR_LEN + 16];
+  for (int j = 0; j < STATS_COUNTERS; j++) {
+    fprintf(f, "# TYPE dnsclient_%s_total counter\n", counter_names[j]);
+    for (int i = 0; i < res->nservers; i++)
+      fprintf(f, "dnsclient_%s_total{server=\"%s\"} %llu\n", counter_names[j],
+              res->servers[i]->addr, servers[i].counters[j]);
+  }
+
+  fprintf(f, "# TYPE dnsclient_latency_usec summary\n");
+  for (int i = 0; i < res->nservers; i++) {
+    snprintf(labels, sizeof(labels), "server=\"%s\"", res->servers[i]->addr);
+    write_hist_prom(f, "dnsclient_latency_usec", labels, &servers[i].latency);
+  }
+  for (int j = 0; j < RES_COUNTERS; j++)
+    fprintf(f, "# TYPE dnsclient_%s_total counter\ndnsclient_%s_total %llu\n",
+            resolver_counter_names[j], resolver_counter_names[j],
+            counters[j]);
+  fprintf(f, "# TYPE dnsclient_parse_nsec summary\n");
+  write_hist_prom(f, "dnsclient_parse_nsec", "", parse);
+}
+
+// Write the statistics of the n resolvers (with the same servers, in the same
+// order) to path, summed per server: as JSON if its name ends in ".json", as
+// Prometheus text otherwise. The resolvers may still be in use by other
+// threads. The file is replaced at once, so readers never see half of it.
+// Return false if it couldn't be written
+bool stats_write(char *path, dns_resolver_t **res, int n) {
+  if (n == 0)
+    return true;
+
+  int nservers = res[0]->nservers;
+  dns_server_stats_t *servers = calloc(nservers + 1,
+                                       sizeof(dns_server_stats_t));
+  dns_hist_t *parse = calloc(1, sizeof(dns_hist_t));
+  char tmp[strlen(path) + 5];
+  sprintf(tmp, "%s.tmp", path);
+  FILE *f = servers && parse ? fopen(tmp, "w") : NULL;
+  if (f == NULL) {
+    free(servers);
+    free(parse);
+    return false;
+  }
+
+  unsigned long long counters[RES_COUNTERS] = {0};
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < nservers; j++)
+      server_stats_sum(&servers[j], &res[i]->stats[j]);
+    hist_sum(parse, &res[i]->parse_time);
+    for (int j = 0; j < RES_COUNTERS; j++)
+      counters[j] += __atomic_load_n(&res[i]->counters[j], __ATOMIC_RELAXED);
+  }
+
+  size_t len = strlen(path);
+  bool json = len >= 5 && strcmp(path + len - 5, ".json") == 0;
+  if (json)
+    write_json(f, res[0], servers, parse, counters);
+  else
+    write_prom(f, res[0], servers, parse, counters);
+
+  bool ok = fclose(f) == 0 && rename(tmp, path) == 0;
+  free(servers);
+  free(parse);
+  return ok;
+}
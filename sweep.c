@@ -0,0 +1,205 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+#define MAX_SWEEPS 64     // ranges given at once
+#define PROBE(data) ((long) (data) >> 32 < 32)
+
+/* Block of addresses whose children are being generated: the addresses, or
+ * the reverse zones of the next octet boundary */
+typedef struct {
+  unsigned int addr;
+  int bits;                 // prefix length of the children
+  unsigned int next, count; // children generated, and their number
+} sweep_block_t;
+
+static struct {
+  sweep_block_t *stack;     // blocks generated depth first, the last on top
+  int depth, cap;
+  unsigned long long addresses, queries, found, missing, pruned, failed;
+} sweep;
+
+// Push the block addr/bits on the stack, to generate its children at the
+// next octet boundary. Return false if the stack can't grow
+static bool push_block(unsigned int addr, int bits) {
+  if (sweep.depth == sweep.cap) {
+    int cap = sweep.cap ? 2 * sweep.cap : 64;
+    sweep_block_t *stack = realloc(sweep.stack, cap * sizeof(sweep_block_t));
+    if (stack == NULL)
+      return false;
+    sweep.stack = stack;
+    sweep.cap = cap;
+  }
+
+  // A single address is its own child
+  int child_bits = bits == 32 ? 32 : (bits / 8 + 1) * 8;
+  sweep_block_t *block = &sweep.stack[sweep.depth++];
+  block->addr = addr;
+  block->bits = child_bits;
+  block->next = 0;
+  block->count = 1u << (child_bits - bits);
+  return true;
+}
+
+// Write the reverse name of the first bits / 8 octets of addr into name
+static void reverse_name(unsigned int addr, int bits, char *name) {
+  int len = 0;
+  for (int i = bits / 8 - 1; i >= 0; i--)
+    len += sprintf(name + len, "%u.", (addr >> (24 - 8 * i)) & 0xFF);
+  strcpy(name + len, "in-addr.arpa");
+}
+
+// Get the next name to query from the block on top of the stack, storing the
+// child it stands for in data, or return false once every block is done
+static bool next_name(char *name, void **data) {
+  while (sweep.depth) {
+    sweep_block_t *block = &sweep.stack[sweep.depth - 1];
+    if (block->next == block->count) {
+      sweep.depth--;
+      continue;
+    }
+
+    unsigned int addr = block->addr
+        + (unsigned int) ((unsigned long long) block->next++
+                          << (32 - block->bits));
+    reverse_name(addr, block->bits, name);
+    *data = (void *) ((long) block->bits << 32 | addr);
+    return true;
+  }
+  return false;
+}
+
+// Handle a finished sweep query: a zone that exists is swept in turn, one
+// that doesn't is skipped with everything under it (RFC 8020), and the PTR
+// records of addresses are printed as they arrive
+static void sweep_done(dns_resolver_t *res, dns_query_t *query,
+                       enum error_status status, dns_msg_t *ans) {
+  int bits = (int) ((long) query->data >> 32);
+  unsigned int addr = (unsigned int) (long) query->data;
+  bool nxdomain = status == NOERROR && ans->header.rcode == 3;
+
+  if (PROBE(query->data)) {
+    // Anything but NXDOMAIN may hide names, failures included
+    if (nxdomain)
+      sweep.pruned += 1ULL << (32 - bits);
+    else if (!push_block(addr, bits))
+      error("ERROR allocating the sweep!\n");
+    return;
+  }
+
+  sweep.addresses++;
+  if (nxdomain) {
+    sweep.missing++;
+    return;
+  }
+  if (status != NOERROR)
+    sweep.failed++;
+  else if (ans->header.rcode == 0 && ans->header.ancount)
+    sweep.found++;
+  bulk_done(res, query, status, ans);
+}
+
+// Parse a comma separated list of ranges in CIDR notation ("a.b.c.d/len", or
+// a single address) into addrs and bits. Return their number, or -1 if one
+// is invalid
+static int parse_ranges(char *list, unsigned int *addrs, int *bits) {
+  char copy[strlen(list) + 1], *save;
+  int n = 0;
+
+  strcpy(copy, list);
+  for (char *range = strtok_r(copy, ",", &save); range;
+       range = strtok_r(NULL, ",", &save)) {
+    char *slash = strchr(range, '/');
+    struct in_addr in;
+    if (n == MAX_SWEEPS)
+      return -1;
+
+    bits[n] = 32;
+    if (slash) {
+      char *end;
+      *slash = 0;
+      bits[n] = (int) strtol(slash + 1, &end, 10);
+      if (end == slash + 1 || *end || bits[n] < 0 || bits[n] > 32)
+        return -1;
+    }
+    if (inet_pton(AF_INET, range, &in) != 1)
+      return -1;
+
+    // The host bits are ignored
+    unsigned int mask = bits[n] ? ~0u << (32 - bits[n]) : 0;
+    addrs[n++] = ntohl(in.s_addr) & mask;
+  }
+  return n;
+}
+
+// Sweep the ranges of opts->sweep for PTR records, generating the reverse
+// names as they are needed, with up to a window of queries in flight and at
+// most opts->rate queries per second (0 for no limit). Every octet boundary
+// under a range is probed first, so that a reverse zone that doesn't exist
+// isn't swept. Results are printed as they arrive, and a summary at the end
+void run_sweep(dns_options_t *opts) {
+  unsigned int addrs[MAX_SWEEPS];
+  int bits[MAX_SWEEPS];
+  int n = parse_ranges(opts->sweep, addrs, bits);
+  if (n <= 0)
+    error("Please enter valid ranges, as a.b.c.d/len[,a.b.c.d/len...]\n");
+
+  int conf_size;
+  dns_server_t *data = get_conf_data(&conf_size);
+  if (data == NULL) {
+    fprintf(stderr, "Failed to open conf file!\n");
+    exit(0);
+  }
+
+  dns_resolver_t res;
+  if (!resolver_init(&res, data, conf_size, opts->window))
+    error("ERROR setting up the resolver!\n");
+  resolver_set_options(&res, opts);
+  bulk_output(opts);
+
+  // The first range ends up on top
+  for (int i = n - 1; i >= 0; i--)
+    if (!push_block(addrs[i], bits[i]))
+      error("ERROR allocating the sweep!\n");
+
+  char name[MAX_NAME_LEN];
+  void *child;
+  long long start = now_usec();
+
+  // Probes still in flight may add blocks
+  while (sweep.depth || res.active) {
+    int timeout = -1;
+    while (res.active < res.window) {
+      // Queries are paced by the time they are allowed to go at
+      if (opts->rate) {
+        long long due = start + (long long) (sweep.queries * 1e6 / opts->rate);
+        long long wait = due - now_usec();
+        if (wait > 0) {
+          timeout = (int) ((wait + 999) / 1000);
+          break;
+        }
+      }
+
+      if (!next_name(name, &child))
+        break;
+      sweep.queries++;
+      resolver_submit(&res, name, PTR, sweep_done, child);
+    }
+
+    if (res.active || timeout >= 0)
+      resolver_process(&res, timeout);
+  }
+
+  fflush(stdout);
+  fprintf(stderr, ";; sweep: %llu queries, %llu addresses, %llu found, "
+          "%llu nxdomain, %llu pruned, %llu failed\n", sweep.queries,
+          sweep.addresses, sweep.found, sweep.missing, sweep.pruned,
+          sweep.failed);
+
+  free(sweep.stack);
+  resolver_free(&res);
+  save_server_state(data, conf_size);
+  free(data);
+}
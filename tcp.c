@@ -0,0 +1,161 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+// Wait for the connection to be writable or not, besides readable
+static bool tcp_watch(dns_conn_t *conn, int epfd, bool writing) {
+  if (conn->writing == writing)
+    return true;
+
+  struct epoll_event ev;
+  ev.events = writing ? EPOLLIN | EPOLLOUT : EPOLLIN;
+  ev.data.fd = conn->fd;
+  conn->writing = writing;
+  return epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev) == 0;
+}
+
+// Start a non-blocking connection to addr, watched by epfd. It can be written
+// to once it becomes writable
+static bool tcp_connect(dns_conn_t *conn, int epfd, struct sockaddr_in *addr) {
+  conn->fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (conn->fd < 0)
+    return false;
+
+  conn->connected = false;
+  conn->writing = true;
+  conn->out_len = 0;
+  conn->in_len = conn->in_start = 0;
+  conn->outstanding = 0;
+  conn->last_used = now_usec();
+  if (conn->in == NULL)
+    conn->in = malloc(TCP_BUFLEN);
+
+  // Pipelined queries are small, they shouldn't wait for each other's ACKs
+  int one = 1;
+  setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT;
+  ev.data.fd = conn->fd;
+  if (conn->in == NULL
+      || (connect(conn->fd, (struct sockaddr *) addr, sizeof(*addr)) < 0
+          && errno != EINPROGRESS)
+      || epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) < 0) {
+    tcp_close(conn);
+    return false;
+  }
+  return true;
+}
+
+// Queue the message of length len on the connection to addr, opening it if
+// needed, and write as much as possible right away. Return false if the
+// connection failed
+bool tcp_send(dns_conn_t *conn, int epfd, struct sockaddr_in *addr, char *msg,
+              size_t len) {
+  if (conn->fd < 0 && !tcp_connect(conn, epfd, addr))
+    return false;
+
+  if (conn->out_len + 2 + len > conn->out_cap) {
+    size_t cap = conn->out_cap ? 2 * conn->out_cap : 4 * BUFLEN;
+    while (cap < conn->out_len + 2 + len)
+      cap *= 2;
+    char *out = realloc(conn->out, cap);
+    if (out == NULL)
+      return false;
+    conn->out = out;
+    conn->out_cap = cap;
+  }
+
+  conn->out[conn->out_len++] = (char) (len >> 8);
+  conn->out[conn->out_len++] = (char) len;
+  memcpy(conn->out + conn->out_len, msg, len);
+  conn->out_len += len;
+  conn->outstanding++;
+  conn->last_used = now_usec();
+
+  return conn->connected ? tcp_flush(conn, epfd) : true;
+}
+
+// Write the queued messages, finishing the connection first if it was still
+// being opened. Return false if the connection failed
+bool tcp_flush(dns_conn_t *conn, int epfd) {
+  if (!conn->connected) {
+    int err = 0;
+    socklen_t err_len = sizeof(err);
+    if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) < 0 || err)
+      return false;
+    conn->connected = true;
+  }
+
+  size_t done = 0;
+  while (done < conn->out_len) {
+    ssize_t n = write(conn->fd, conn->out + done, conn->out_len - done);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      break;
+    }
+    done += n;
+  }
+
+  conn->out_len -= done;
+  memmove(conn->out, conn->out + done, conn->out_len);
+  return tcp_watch(conn, epfd, conn->out_len > 0);
+}
+
+// Read what has arrived on the connection, after dropping the messages that
+// were already handled. Return the number of bytes read, 0 if there was
+// nothing to read, or -1 if the connection was closed or failed
+int tcp_read(dns_conn_t *conn) {
+  conn->in_len -= conn->in_start;
+  memmove(conn->in, conn->in + conn->in_start, conn->in_len);
+  conn->in_start = 0;
+
+  for (;;) {
+    ssize_t n = read(conn->fd, conn->in + conn->in_len,
+                     TCP_BUFLEN - conn->in_len);
+    if (n > 0) {
+      conn->in_len += n;
+      conn->last_used = now_usec();
+      return (int) n;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+  }
+}
+
+// Get the next complete message received on the connection, storing its
+// length in len, or NULL if there is none. Answers come in any order, the
+// caller matches them to their queries by transaction id. The message stays
+// valid until the next tcp_read
+char *tcp_next_msg(dns_conn_t *conn, size_t *len) {
+  size_t avail = conn->in_len - conn->in_start;
+  if (avail < 2)
+    return NULL;
+
+  char *frame = conn->in + conn->in_start;
+  *len = get16(frame);
+  if (avail < 2 + *len)
+    return NULL;
+
+  conn->in_start += 2 + *len;
+  if (conn->outstanding)
+    conn->outstanding--;
+  return frame + 2;
+}
+
+// Close the connection, dropping whatever was queued on it
+void tcp_close(dns_conn_t *conn) {
+  if (conn->fd >= 0)
+    close(conn->fd);  // which also removes it from epoll
+  conn->fd = -1;
+  conn->connected = false;
+  conn->out_len = 0;
+  conn->in_len = conn->in_start = 0;
+  conn->outstanding = 0;
+}
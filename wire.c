@@ -0,0 +1,382 @@
+//
+// Copyright Ioana Alexandru 2018.
+//
+
+#include "dnsclient.h"
+
+// Read a 16-bit big endian value
+unsigned short get16(char *p) {
+  return (unsigned short) (((unsigned char) p[0] << 8) | (unsigned char) p[1]);
+}
+
+// Read a 32-bit big endian value
+unsigned int get32(char *p) {
+  return ((unsigned int) get16(p) << 16) | get16(p + 2);
+}
+
+// Write a 16-bit value in big endian order
+void put16(char *p, unsigned short v) {
+  p[0] = (char) (v >> 8);
+  p[1] = (char) v;
+}
+
+// Write a 32-bit value in big endian order
+void put32(char *p, unsigned int v) {
+  put16(p, (unsigned short) (v >> 16));
+  put16(p + 2, (unsigned short) v);
+}
+
+// Encode the dotted name (with or without its trailing dot) into wire, as
+// length-prefixed labels ending with the root label, in a single pass. Return
+// the encoded length, or -1 if the name has an empty label or one longer than
+// 63 bytes, or is longer than MAX_WIRE_NAME_LEN once encoded
+int encode_name(char *wire, char *name) {
+  if (name[0] == '.' && name[1] == 0)
+    name++;  // the root
+
+  // The length of each label is filled in once its end is found
+  char *label = wire, *out = wire + 1;
+  for (char *p = name; *p; p++) {
+    if (out - wire >= MAX_WIRE_NAME_LEN - 1)
+      return -1;  // no room left for this byte and the root label
+    if (*p != '.') {
+      *out++ = *p;
+      continue;
+    }
+    long len = out - label - 1;
+    if (len == 0 || len > 63)
+      return -1;
+    *label = (char) len;
+    label = out++;
+  }
+
+  long len = out - label - 1;
+  if (len > 63)
+    return -1;
+  *label = (char) len;
+  if (len == 0)
+    return (int) (label - wire + 1);  // after a trailing dot, or the root
+  *out = 0;
+  return (int) (out - wire + 1);
+}
+
+// Set up the template of the queries of type qtype, with RD set if recurse,
+// and an OPT record advertising edns as the UDP payload unless it is 0
+// (RFC 6891). Every byte is written in wire order, independently of the
+// layout of dns_header_t
+void query_template(dns_template_t *t, unsigned short qtype,
+                    unsigned short edns, bool recurse) {
+  memset(t, 0, sizeof(*t));
+  t->qtype = qtype;
+  t->edns = edns;
+  t->recurse = recurse;
+
+  t->header[2] = recurse ? 0x01 : 0;  // QR, opcode, AA, TC 0, then RD
+  put16(t->header + 4, 1);            // QDCOUNT
+  put16(t->header + 10, edns ? 1 : 0);  // ARCOUNT
+
+  put16(t->tail, qtype);
+  put16(t->tail + 2, 1);  // IN
+  t->tail_len = 4;
+  if (edns) {
+    // Root name, type, payload size as class, zero extended RCODE, version,
+    // flags (as TTL) and no options
+    char *opt = t->tail + 4;
+    put16(opt + 1, OPT);
+    put16(opt + 3, edns);
+    t->tail_len += OPT_LEN;
+  }
+}
+
+// Write the query for name with transaction id into msg (of MAX_QUERY_SIZE
+// bytes at least) from the template of its type. Return its length, or 0 if
+// name can't be encoded
+size_t template_query(dns_template_t *t, char *msg, char *name,
+                      unsigned short id) {
+  memcpy(msg, t->header, sizeof(t->header));
+  put16(msg, id);
+
+  int len = encode_name(msg + sizeof(t->header), name);
+  if (len < 0)
+    return 0;
+
+  char *tail = msg + sizeof(t->header) + len;
+  memcpy(tail, t->tail, t->tail_len);
+  return tail + t->tail_len - msg;
+}
+
+// Allocate size bytes of scratch memory from the arena, or return NULL if it
+// is full. The memory lives until the arena is reset
+void *arena_alloc(dns_arena_t *arena, size_t size) {
+  size = (size + 7) & ~(size_t) 7;  // keep allocations aligned
+  if (size > ARENA_SIZE - arena->used)
+    return NULL;
+  void *p = arena->mem + arena->used;
+  arena->used += size;
+  return p;
+}
+
+// Release everything allocated from the arena at once
+void arena_reset(dns_arena_t *arena) {
+  arena->used = 0;
+}
+
+// Skip the (possibly compressed) name at buf + offset, returning the offset
+// right after it, or -1 if it runs past the end of the message
+int skip_name(char *buf, size_t len, int offset) {
+  while ((size_t) offset < len) {
+    unsigned char c = (unsigned char) buf[offset];
+    if (c == 0)
+      return offset + 1;
+    if ((c & 0xC0) == 0xC0)
+      return (size_t) offset + 2 <= len ? offset + 2 : -1;
+    if (c & 0xC0)
+      return -1;  // reserved label types
+    offset += c + 1;
+  }
+  return -1;
+}
+
+// Find the memoized decoding of the name suffix at offset, or NULL
+static dns_name_memo_t *memo_find(dns_msg_t *msg, int offset) {
+  if (msg->memo == NULL)
+    return NULL;
+
+  for (int i = 0; i < NAME_MEMO_SIZE; i++) {
+    dns_name_memo_t *memo = &msg->memo[(offset + i) % NAME_MEMO_SIZE];
+    if (memo->str == NULL)
+      return NULL;
+    if (memo->offset == offset)
+      return memo;
+  }
+  return NULL;
+}
+
+// Memoize the decoding of the name suffix at offset. Nothing happens if the
+// arena or the memo table is full, the name just gets decoded again
+static void memo_put(dns_msg_t *msg, int offset, char *str, int len) {
+  if (msg->memo == NULL) {
+    msg->memo = arena_alloc(&msg->arena,
+                            NAME_MEMO_SIZE * sizeof(dns_name_memo_t));
+    if (msg->memo == NULL)
+      return;
+    memset(msg->memo, 0, NAME_MEMO_SIZE * sizeof(dns_name_memo_t));
+  }
+
+  for (int i = 0; i < NAME_MEMO_SIZE; i++) {
+    dns_name_memo_t *memo = &msg->memo[(offset + i) % NAME_MEMO_SIZE];
+    if (memo->str == NULL) {
+      memo->offset = (unsigned short) offset;
+      memo->len = (unsigned char) len;
+      memo->str = str;
+      return;
+    }
+  }
+}
+
+// Follow the compression pointer at buf + offset. To rule out loops, it must
+// point before start, the beginning of the labels that lead to it. Return the
+// new offset, or -1 if the pointer is invalid
+static int follow_pointer(dns_msg_t *msg, int offset, int start, int *hops) {
+  if ((size_t) offset + 2 > msg->len || ++*hops > MAX_POINTER_HOPS)
+    return -1;
+
+  int target = get16(msg->buf + offset) & 0x3FFF;  // clearing first two bits
+  return target < start ? target : -1;
+}
+
+// Decode the name at msg->buf + offset into dest (of at least MAX_NAME_LEN
+// bytes), in dotted form with a trailing dot. Suffixes reached through
+// compression pointers are memoized, so a zone shared by many records is only
+// walked once per message. Return the length of the name, or -1 if it is
+// malformed or breaks the RFC 1035 limits
+int msg_name(dns_msg_t *msg, int offset, char *dest) {
+  char *buf = msg->buf;
+  int len = 0, wire_len = 1, hops = 0, start = offset;
+  int starts[MAX_POINTER_HOPS + 1], dest_pos[MAX_POINTER_HOPS + 1], n = 0;
+
+  starts[n] = offset;
+  dest_pos[n++] = 0;
+
+  while ((size_t) offset < msg->len) {
+    dns_name_memo_t *memo = memo_find(msg, offset);
+    if (memo) {
+      if (len == 0 && offset == starts[0]) {
+        memcpy(dest, memo->str, memo->len + 1);
+        return memo->len;
+      }
+      if ((wire_len += memo->len) > MAX_WIRE_NAME_LEN)
+        return -1;
+      memcpy(dest + len, memo->str, memo->len);
+      len += memo->len;
+      if (offset == starts[n - 1])
+        n--;  // reached through a pointer, already memoized
+      break;
+    }
+
+    unsigned char c = (unsigned char) buf[offset];
+    if (c == 0) {
+      if (len == 0) {
+        strcpy(dest, ".");  // root
+        return 1;
+      }
+      break;
+    }
+
+    if ((c & 0xC0) == 0xC0) {
+      offset = start = follow_pointer(msg, offset, start, &hops);
+      if (offset < 0)
+        return -1;
+      starts[n] = offset;
+      dest_pos[n++] = len;
+      continue;
+    }
+
+    if (c & 0xC0 || (size_t) offset + 1 + c > msg->len
+        || (wire_len += c + 1) > MAX_WIRE_NAME_LEN)
+      return -1;
+    memcpy(dest + len, buf + offset + 1, c);
+    len += c;
+    dest[len++] = '.';
+    offset += c + 1;
+  }
+
+  if ((size_t) offset >= msg->len)
+    return -1;
+  dest[len] = 0;
+
+  // Memoize the name and the suffixes found through pointers, all pointing
+  // into a single copy of it
+  char *copy = arena_alloc(&msg->arena, len + 1);
+  if (copy) {
+    memcpy(copy, dest, len + 1);
+    for (int i = 0; i < n; i++)
+      memo_put(msg, starts[i], copy + dest_pos[i], len - dest_pos[i]);
+  }
+  return len;
+}
+
+// Compare the name at msg->buf + offset with a dotted name (with or without
+// the trailing dot), ignoring case, without decoding it
+bool msg_name_equal(dns_msg_t *msg, int offset, char *name) {
+  char *buf = msg->buf;
+  int i = 0, wire_len = 1, hops = 0, start = offset;
+
+  if (strcmp(name, ".") == 0)
+    name = "";
+
+  while ((size_t) offset < msg->len) {
+    unsigned char c = (unsigned char) buf[offset];
+    if (c == 0)
+      return name[i] == 0;
+
+    if ((c & 0xC0) == 0xC0) {
+      offset = start = follow_pointer(msg, offset, start, &hops);
+      if (offset < 0)
+        return false;
+      continue;
+    }
+
+    if (c & 0xC0 || (size_t) offset + 1 + c > msg->len
+        || (wire_len += c + 1) > MAX_WIRE_NAME_LEN)
+      return false;
+    for (int j = 1; j <= c; j++, i++)
+      if (name[i] == 0 || tolower((unsigned char) name[i])
+          != tolower((unsigned char) buf[offset + j]))
+        return false;
+
+    if (name[i] == '.')
+      i++;
+    else if (name[i] != 0)
+      return false;
+    offset += c + 1;
+  }
+  return false;
+}
+
+// Parse the message of length len at buf in a single pass into msg. Nothing
+// is copied: the records of msg point into buf, which must outlive it.
+// Return false if the message is malformed
+bool parse_msg(dns_msg_t *msg, char *buf, size_t len) {
+  msg->buf = buf;
+  msg->len = len;
+  msg->nrecords = 0;
+  msg->memo = NULL;
+  arena_reset(&msg->arena);
+
+  if (len < sizeof(dns_header_t))
+    return false;
+  msg->header = get_header(buf);
+
+  // Every question takes at least 5 bytes, so the counts are bounded by the
+  // size of the message before anything is allocated
+  int count[4] = {msg->header.qdcount, msg->header.ancount,
+                  msg->header.nscount, msg->header.arcount};
+  int total = count[0] + count[1] + count[2] + count[3];
+  if ((size_t) total * 5 > len - sizeof(dns_header_t))
+    return false;
+
+  msg->records = arena_alloc(&msg->arena, total * sizeof(dns_record_t));
+  if (msg->records == NULL)
+    return false;
+
+  int offset = sizeof(dns_header_t);
+  for (int section = QUESTION; section <= ADDITIONAL; section++) {
+    for (int i = 0; i < count[section]; i++) {
+      dns_record_t *rr = &msg->records[msg->nrecords++];
+      rr->section = (unsigned char) section;
+      rr->name = (unsigned short) offset;
+
+      offset = skip_name(buf, len, offset);
+      if (offset < 0)
+        return false;
+
+      if (section == QUESTION) {
+        if ((size_t) offset + 4 > len)
+          return false;
+        rr->type = get16(buf + offset);
+        rr->class = get16(buf + offset + 2);
+        rr->ttl = 0;
+        rr->rdlength = 0;
+        offset += 4;
+        rr->rdata = (unsigned short) offset;
+        continue;
+      }
+
+      if ((size_t) offset + 10 > len)
+        return false;
+      rr->type = get16(buf + offset);
+      rr->class = get16(buf + offset + 2);
+      rr->ttl = get32(buf + offset + 4);
+      rr->rdlength = get16(buf + offset + 8);
+      offset += 10;
+      rr->rdata = (unsigned short) offset;
+
+      if ((size_t) offset + rr->rdlength > len)
+        return false;
+      offset += rr->rdlength;
+    }
+  }
+  return true;
+}
+
+// Get the records of a section of the message, storing their number in count
+dns_record_t *msg_section(dns_msg_t *msg, enum section section, int *count) {
+  int counts[4] = {msg->header.qdcount, msg->header.ancount,
+                   msg->header.nscount, msg->header.arcount};
+  int first = 0;
+  for (int i = QUESTION; i < (int) section; i++)
+    first += counts[i];
+  *count = counts[section];
+  return msg->records + first;
+}
+
+// Get the OPT pseudo-record of the message, or NULL if there is none
+dns_record_t *msg_opt(dns_msg_t *msg) {
+  int count;
+  dns_record_t *rr = msg_section(msg, ADDITIONAL, &count);
+  for (int i = 0; i < count; i++)
+    if (rr[i].type == OPT)
+      return &rr[i];
+  return NULL;
+}